@@ -0,0 +1,835 @@
+#include "../clopts/include/clopts.hh"
+#include "../lib/context.hh"
+#include "../lib/model.hh"
+#include "../lib/renderer.hh"
+#include "../lib/vertex.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <ranges>
+#include <thread>
+#include <glm/gtc/matrix_transform.hpp>
+#include <sys/resource.h>
+#include <unistd.h>
+
+using namespace command_line_options;
+using options = clopts< // clang-format off
+    option<"--scene", "Only run scenes whose name contains this string", std::string>,
+    option<"--frames", "Number of measured frames per scene (default: per scene)", i64>,
+    option<"--warmup", "Number of frames to draw before measuring (default: 30)", i64>,
+    option<"--shaders", "Directory that contains the compiled shaders (default: out)", std::string>,
+    option<"--output", "Write the results to this file instead of stdout", std::string>,
+    option<"--label", "Label to include in the results, e.g. a commit hash", std::string>,
+    option<"--replay", "Replay a command capture instead of running the built-in scenes", std::string>,
+    option<"--runs", "Run every scene this many times (default: 1)", i64>,
+    option<"--baseline", "Compare the results against this baseline and fail if any of them regressed", std::string>,
+    option<"--threshold", "Slowdown in percent that counts as a regression (default: 5)", i64>,
+    option<"--write-baseline", "Write the results to this file as a new baseline", std::string>,
+    flag<"--list", "List all scenes and exit">
+>; // clang-format on
+
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+/// Summary of a series of measurements, in milliseconds.
+struct percentiles {
+    f64 mean = 0, p50 = 0, p95 = 0, p99 = 0, max = 0;
+};
+
+auto summarise(std::vector<f64> values) -> percentiles {
+    if (values.empty()) return {};
+    std::ranges::sort(values);
+
+    /// Nearest-rank percentiles.
+    auto rank = [&](f64 p) { return values[std::min(values.size() - 1, u64(std::ceil(p * f64(values.size()))) - 1)]; };
+    percentiles res;
+    for (auto v : values) res.mean += v;
+    res.mean /= f64(values.size());
+    res.p50 = rank(.50);
+    res.p95 = rank(.95);
+    res.p99 = rank(.99);
+    res.max = values.back();
+    return res;
+}
+
+auto ms_since(clock_type::time_point start, clock_type::time_point end = clock_type::now()) -> f64 {
+    return std::chrono::duration<f64, std::milli>(end - start).count();
+}
+
+/// Resident set size of the process in MiB.
+auto rss_mb() -> f64 {
+    std::ifstream statm{ "/proc/self/statm" };
+    u64 size = 0, resident = 0;
+    statm >> size >> resident;
+    return f64(resident * u64(::sysconf(_SC_PAGESIZE))) / (1024. * 1024.);
+}
+
+auto peak_rss_mb() -> f64 {
+    rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    return f64(usage.ru_maxrss) / 1024.;
+}
+
+/// Results of a single scene.
+struct scene_result {
+    std::string name;
+    u32 run = 0;
+    u32 width = 0, height = 0;
+    u64 frames = 0;
+
+    /// Work done in the last measured frame.
+    vk::frame_stats stats;
+
+    /// Timings of all measured frames.
+    std::vector<f64> cpu_ms;
+    std::vector<f64> gpu_ms;
+    std::vector<f64> frame_ms;
+    f64 rss_mb = 0;
+    f64 peak_rss_mb = 0;
+
+    /// Scene-specific metrics.
+    std::vector<std::pair<std::string, f64>> extra;
+};
+
+/// Settings and state shared by all scenes.
+struct bench {
+    std::string shader_dir = "out";
+    std::optional<u32> frames;
+    u32 warmup = 30;
+    std::string device_name;
+    std::vector<scene_result> results;
+
+    auto shader(std::string_view name) const -> std::string {
+        return fmt::format("{}/{}.spv", shader_dir, name);
+    }
+
+    /// Draw warmup frames, then measured frames, and record the results.
+    ///
+    /// The CPU time of a frame is the time spent in draw_frame() once the frame
+    /// slot is free, i.e. recording and submission; the frame time is the time
+    /// between two consecutive frames; the GPU time comes from the GPU profiler.
+    void measure(vk::context& ctx, scene_result& res, u32 default_frames, const vk::context::render_callback& tick) {
+        if (device_name.empty()) {
+            VkPhysicalDeviceProperties props;
+            vkGetPhysicalDeviceProperties(ctx.physical_device, &props);
+            device_name = props.deviceName;
+        }
+
+        res.width = ctx.swap_chain_extent.width;
+        res.height = ctx.swap_chain_extent.height;
+        res.frames = frames.value_or(default_frames);
+
+        u64 first_measured = ctx.frame_number + warmup;
+        u64 last_measured = first_measured + res.frames - 1;
+        u64 last_gpu_frame = u64(-1);
+        auto collect_results = [&] {
+            /// Pipeline statistics arrive late as well; keep those of the last measured frame.
+            if (ctx.frame_statistics().frame == last_measured) res.stats = ctx.frame_statistics();
+
+            auto* latest = ctx.gpu_profile ? ctx.gpu_profile->latest() : nullptr;
+            if (!latest || latest->frame == last_gpu_frame) return;
+            last_gpu_frame = latest->frame;
+            if (latest->frame >= first_measured && latest->frame <= last_measured)
+                res.gpu_ms.push_back(latest->zones.front().duration_ms);
+        };
+
+        auto last_frame_end = clock_type::now();
+        for (u64 i = 0; i < warmup + res.frames; i++) {
+            ctx.wait_for_slot();
+            auto start = clock_type::now();
+            ctx.draw_frame(tick);
+            auto end = clock_type::now();
+            collect_results();
+
+            if (i >= warmup) {
+                res.cpu_ms.push_back(ms_since(start, end));
+                res.frame_ms.push_back(ms_since(last_frame_end, end));
+            }
+
+            last_frame_end = end;
+        }
+
+        /// The results of the last few frames only come in once their slots are reused.
+        for (u32 i = 0; i < ctx.frames_in_flight; i++) {
+            ctx.draw_frame([](VkCommandBuffer) {});
+            collect_results();
+        }
+
+        vkDeviceWaitIdle(ctx.device);
+        res.rss_mb = rss_mb();
+        res.peak_rss_mb = peak_rss_mb();
+    }
+};
+
+/// A scene renders something for a number of frames and records the results.
+struct scene {
+    std::string name;
+    std::function<void(bench&, scene_result&)> run;
+};
+
+/// Create a headless context for a scene.
+auto make_context(u32 wd = 1920, u32 ht = 1080, u32 features = vk::CONTEXT_FEATURE_NONE) -> std::unique_ptr<vk::context> {
+    auto ctx = std::make_unique<vk::context>(vk::headless, wd, ht, features);
+    ctx->enable_gpu_profiling();
+    ctx->enable_pipeline_statistics();
+    return ctx;
+}
+
+/// Transform that places instance `i` of `n` in a grid covering the screen.
+auto grid_transform(u64 i, u64 n) -> glm::mat4 {
+    auto side = u64(std::ceil(std::sqrt(f64(n))));
+    f32 cell = 2.f / f32(side);
+    glm::vec3 pos{ -1.f + cell * (f32(i % side) + .5f), -1.f + cell * (f32(i / side) + .5f), 0.f };
+    return glm::scale(glm::translate(glm::mat4{ 1.f }, pos), glm::vec3(cell * .4f));
+}
+
+/// Set the parts of the uniforms that the texture renderer doesn't set itself.
+void reset_uniforms(vk::texture_renderer& r) {
+    r.update_uniform_buffers([](uniform_buffer_object& ubo) {
+        ubo.model = glm::mat4{ 1.f };
+        ubo.view = glm::mat4{ 1.f };
+    });
+}
+
+/// N instances of a model, one draw call each.
+auto model_scene(std::string_view model_name, u64 count) -> scene {
+    return {
+        fmt::format("{}-{}", model_name, count),
+        [=](bench& b, scene_result& res) {
+            auto ctx = make_context();
+            vk::texture_renderer renderer(ctx.get(), b.shader("tex_shader_vert"), b.shader("tex_shader_frag"));
+            vk::model m(&renderer, fmt::format("assets/{}.png", model_name), fmt::format("assets/{}.obj", model_name));
+
+            std::vector<vk::model_instance> instances;
+            instances.reserve(count);
+            for (u64 i = 0; i < count; i++) instances.emplace_back(&m, push_constant{ grid_transform(i, count) });
+
+            b.measure(*ctx, res, count >= 10'000 ? 60 : 300, [&](VkCommandBuffer command_buffer) {
+                reset_uniforms(renderer);
+                for (auto& inst : instances) renderer.draw(command_buffer, inst);
+            });
+        },
+    };
+}
+
+/// N instances of a model recorded through record_parallel() on a number of
+/// threads, to see how recording scales with the number of cores.
+auto parallel_scene(std::string_view model_name, u64 count, u32 threads) -> scene {
+    return {
+        fmt::format("parallel-{}-{}-t{}", model_name, count, threads),
+        [=](bench& b, scene_result& res) {
+            auto ctx = make_context();
+            ctx->enable_parallel_recording(threads);
+            vk::texture_renderer renderer(ctx.get(), b.shader("tex_shader_vert"), b.shader("tex_shader_frag"));
+            vk::model m(&renderer, fmt::format("assets/{}.png", model_name), fmt::format("assets/{}.obj", model_name));
+
+            std::vector<vk::model_instance> instances;
+            instances.reserve(count);
+            for (u64 i = 0; i < count; i++) instances.emplace_back(&m, push_constant{ grid_transform(i, count) });
+
+            b.measure(*ctx, res, 60, [&](VkCommandBuffer command_buffer) {
+                reset_uniforms(renderer);
+                ctx->record_parallel(command_buffer, instances.size(), [&](VkCommandBuffer secondary, u64 begin, u64 end) {
+                    for (u64 i = begin; i < end; i++) renderer.draw(secondary, instances[i]);
+                });
+            });
+
+            res.extra.emplace_back("threads", f64(threads));
+        },
+    };
+}
+
+/// Loading an OBJ file with load_obj(), without a context. The same file is
+/// also loaded in two passes, read_obj() and deduplicate_vertices(), to see
+/// which of them the time goes to; those timings are only informational.
+auto loader_scene(std::string_view model_name) -> scene {
+    return {
+        fmt::format("load-{}", model_name),
+        [=](bench& b, scene_result& res) {
+            auto path = fmt::format("assets/{}.obj", model_name);
+            u32 iterations = b.frames.value_or(10);
+            std::vector<f64> load_ms, read_ms, dedup_ms;
+            vk::mesh_data mesh;
+
+            /// The first run is only there to get the file into the page cache.
+            for (u32 i = 0; i <= iterations; i++) {
+                auto start = clock_type::now();
+                mesh = vk::load_obj(path);
+                auto loaded = clock_type::now();
+                auto vertices = vk::read_obj(path);
+                auto read = clock_type::now();
+                vk::deduplicate_vertices(vertices);
+                auto end = clock_type::now();
+
+                if (i == 0) continue;
+                load_ms.push_back(ms_since(start, loaded));
+                read_ms.push_back(ms_since(loaded, read));
+                dedup_ms.push_back(ms_since(read, end));
+            }
+
+            res.frames = iterations;
+            res.extra.emplace_back("load_obj_ms", summarise(load_ms).mean);
+            res.extra.emplace_back("split read_obj ms", summarise(read_ms).mean);
+            res.extra.emplace_back("split dedup ms", summarise(dedup_ms).mean);
+            res.extra.emplace_back("vertices", f64(mesh.vertices.size()));
+            res.extra.emplace_back("indices", f64(mesh.indices.size()));
+        },
+    };
+}
+
+/// Uploading the vertices and indices of a model to the GPU.
+auto upload_scene(std::string_view model_name) -> scene {
+    return {
+        fmt::format("upload-{}", model_name),
+        [=](bench& b, scene_result& res) {
+            auto ctx = make_context();
+            auto mesh = vk::load_obj(fmt::format("assets/{}.obj", model_name));
+            u32 iterations = b.frames.value_or(20);
+            std::vector<f64> upload_ms;
+            for (u32 i = 0; i < iterations; i++) {
+                auto start = clock_type::now();
+                vk::vertex_buffer verts{ ctx.get(), mesh.vertices, mesh.indices };
+                upload_ms.push_back(ms_since(start));
+            }
+
+            auto bytes = mesh.vertices.size() * sizeof(vertex) + mesh.indices.size() * sizeof(u32);
+            res.frames = iterations;
+            res.extra.emplace_back("upload_ms", summarise(upload_ms).mean);
+            res.extra.emplace_back("upload_mb", f64(bytes) / (1024. * 1024.));
+        },
+    };
+}
+
+/// Lots of immediate-mode 2D shapes.
+auto batch_scene(u64 shapes) -> scene {
+    return {
+        fmt::format("batch-2d-{}", shapes),
+        [=](bench& b, scene_result& res) {
+            auto ctx = make_context();
+            vk::geometric_renderer renderer(ctx.get(), b.shader("geom_shader_vert"), b.shader("geom_shader_frag"));
+
+            b.measure(*ctx, res, 300, [&](VkCommandBuffer command_buffer) {
+                f32 t = f32(ctx->frame_number) * .01f;
+                for (u64 i = 0; i < shapes; i++) {
+                    auto centre = glm::vec2(grid_transform(i, shapes)[3]);
+                    glm::vec3 colour{ f32(i % 7) / 7.f, f32(i % 11) / 11.f, f32(i % 13) / 13.f };
+                    switch (i % 4) {
+                        case 0: renderer.rect(centre - .004f, centre + .004f, colour); break;
+                        case 1: renderer.circle(centre, .004f, colour, 12); break;
+                        case 2: renderer.line(centre, centre + .008f * glm::vec2{ std::cos(t), std::sin(t) }, .002f, colour); break;
+                        case 3: renderer.triangle(centre, centre + glm::vec2{ .008f, 0 }, centre + glm::vec2{ 0, .008f }, colour); break;
+                    }
+                }
+
+                renderer.flush(command_buffer);
+            });
+        },
+    };
+}
+
+/// Many full-screen quads, each with a texture of its own.
+auto texture_scene(u64 textures) -> scene {
+    return {
+        fmt::format("textures-{}", textures),
+        [=](bench& b, scene_result& res) {
+            auto ctx = make_context();
+            vk::texture_renderer renderer(ctx.get(), b.shader("tex_shader_vert"), b.shader("tex_shader_frag"));
+
+            std::vector<std::unique_ptr<vk::model>> quads;
+            std::vector<vk::model_instance> instances;
+            for (u64 i = 0; i < textures; i++) {
+                auto& m = quads.emplace_back(std::make_unique<vk::model>(&renderer, "assets/viking_room.png", glm::vec3{ -.5f, -.5f, 0.f }));
+                instances.emplace_back(m.get());
+            }
+
+            b.measure(*ctx, res, 200, [&](VkCommandBuffer command_buffer) {
+                reset_uniforms(renderer);
+                for (auto& inst : instances) renderer.draw(command_buffer, inst);
+            });
+        },
+    };
+}
+
+/// Read back every frame at the given resolution.
+auto readback_scene(std::string_view name, u32 wd, u32 ht) -> scene {
+    return {
+        fmt::format("readback-{}", name),
+        [=](bench& b, scene_result& res) {
+            auto ctx = make_context(wd, ht);
+            vk::texture_renderer renderer(ctx.get(), b.shader("tex_shader_vert"), b.shader("tex_shader_frag"));
+            vk::model m(&renderer, "assets/viking_room.png", "assets/viking_room.obj");
+            vk::model_instance inst{ &m };
+
+            /// Touch every byte like an encoder would, so the copy can't be skipped.
+            u64 checksum = 0;
+            ctx->enable_readback([&](const vk::readback_frame& f) {
+                for (u64 i = 0; i < f.pixels.size(); i += 64) checksum += u64(f.pixels[i]);
+            });
+
+            auto start = clock_type::now();
+            b.measure(*ctx, res, 200, [&](VkCommandBuffer command_buffer) {
+                reset_uniforms(renderer);
+                renderer.draw(command_buffer, inst);
+            });
+
+            auto seconds = ms_since(start) / 1000.;
+            res.extra.emplace_back("readback_frames_per_s", f64(ctx->readback->frames_delivered) / seconds);
+            res.extra.emplace_back("readback_mb_per_s", f64(ctx->readback->bytes_delivered) / (1024. * 1024.) / seconds);
+            res.extra.emplace_back("readback_checksum", f64(checksum % 1'000'000));
+        },
+    };
+}
+
+/// Resize the target every few frames, like a user dragging the edge of a
+/// window. Recreating the swap chain shouldn't wait for the device, so the
+/// worst frame should stay close to the others.
+auto resize_scene(u32 interval) -> scene {
+    return {
+        fmt::format("resize-every-{}", interval),
+        [=](bench& b, scene_result& res) {
+            auto ctx = make_context(1280, 720);
+            vk::texture_renderer renderer(ctx.get(), b.shader("tex_shader_vert"), b.shader("tex_shader_frag"));
+            vk::model m(&renderer, "assets/viking_room.png", "assets/viking_room.obj");
+            vk::model_instance inst{ &m };
+
+            /// Cycle through a few sizes, growing and shrinking.
+            static constexpr VkExtent2D sizes[] = { { 1280, 720 }, { 1600, 900 }, { 1920, 1080 }, { 1440, 810 }, { 1024, 576 } };
+            u64 resizes = 0;
+            b.measure(*ctx, res, 300, [&](VkCommandBuffer command_buffer) {
+                if (ctx->frame_number % interval == interval - 1) {
+                    auto size = sizes[++resizes % std::size(sizes)];
+                    ctx->resize(size.width, size.height);
+                }
+
+                reset_uniforms(renderer);
+                renderer.draw(command_buffer, inst);
+            });
+
+            if (!res.frame_ms.empty()) {
+                res.extra.emplace_back("worst_frame_ms", std::ranges::max(res.frame_ms));
+                res.extra.emplace_back("worst_cpu_ms", std::ranges::max(res.cpu_ms));
+            }
+            res.extra.emplace_back("resizes", f64(resizes));
+        },
+    };
+}
+
+/// Cost of an empty CPU profiling zone.
+auto cpu_zone_scene() -> scene {
+    return {
+        "cpu-zone-overhead",
+        [](bench&, scene_result& res) {
+            constexpr u64 iterations = 1'000'000;
+            auto start = clock_type::now();
+            for (u64 i = 0; i < iterations; i++) {
+                CPU_ZONE("bench");
+                asm volatile("" ::: "memory");
+            }
+
+            res.extra.emplace_back("ns_per_zone", ms_since(start) * 1e6 / f64(iterations));
+#ifndef ENABLE_CPU_PROFILING
+            res.extra.emplace_back("compiled_out", 1);
+#endif
+        },
+    };
+}
+
+/// Time from constructing a context to the first finished frame, with a cold
+/// pipeline cache on the first run and a warm one on the others.
+auto startup_scene() -> scene {
+    return {
+        "startup",
+        [](bench& b, scene_result& res) {
+            auto cache = std::filesystem::temp_directory_path() / fmt::format("vulkan-engine-bench-{}.bin", ::getpid());
+            std::filesystem::remove(cache);
+            ::setenv("VULKAN_ENGINE_PIPELINE_CACHE", cache.c_str(), 1);
+            defer {
+                ::setenv("VULKAN_ENGINE_PIPELINE_CACHE", "", 1);
+                std::filesystem::remove(cache);
+            };
+
+            u32 runs = b.frames.value_or(5);
+            std::vector<f64> warm_ms;
+            std::map<std::string, f64> phase_ms;
+            for (u32 i = 0; i < runs; i++) {
+                auto start = clock_type::now();
+                vk::context ctx{ vk::headless, 1920, 1080 };
+                vk::texture_renderer renderer(&ctx, b.shader("tex_shader_vert"), b.shader("tex_shader_frag"));
+                vk::model m(&renderer, "assets/viking_room.png", "assets/viking_room.obj");
+                vk::model_instance inst{ &m };
+                ctx.run_for(1, [&](VkCommandBuffer command_buffer) {
+                    reset_uniforms(renderer);
+                    renderer.draw(command_buffer, inst);
+                });
+
+                auto ms = ms_since(start);
+                if (i == 0) res.extra.emplace_back("first_frame_cold_ms", ms);
+                else warm_ms.push_back(ms);
+
+                for (const auto& p : ctx.startup.phases) phase_ms[p.name] += p.duration_ms / f64(runs);
+                if (i + 1 == runs) info("{}", ctx.startup.report());
+            }
+
+            res.frames = runs;
+            res.frame_ms = warm_ms;
+            if (!warm_ms.empty()) res.extra.emplace_back("first_frame_warm_ms", summarise(warm_ms).mean);
+            for (const auto& [name, ms] : phase_ms) res.extra.emplace_back(fmt::format("phase {}", name), ms);
+            res.rss_mb = rss_mb();
+            res.peak_rss_mb = peak_rss_mb();
+        },
+    };
+}
+
+/// Replay a command capture, looping over its frames.
+auto replay_scene(std::string path) -> scene {
+    return {
+        fmt::format("replay-{}", std::filesystem::path(path).stem().string()),
+        [=](bench& b, scene_result& res) {
+            /// The replay owns resources on the context, so it has to go first.
+            std::unique_ptr<vk::context> ctx;
+            vk::command_replay replay{ path };
+            if (replay.frame_count() == 0) die("[Bench] \"{}\" contains no frames", path);
+            replay.shader_dir = b.shader_dir;
+
+            ctx = make_context(replay.width, replay.height, replay.bindless ? vk::CONTEXT_FEATURE_BINDLESS_TEXTURES : vk::CONTEXT_FEATURE_NONE);
+            replay.load(ctx.get());
+            b.measure(*ctx, res, u32(std::max<u64>(replay.frame_count(), 300)), [&](VkCommandBuffer command_buffer) {
+                replay.play(command_buffer, ctx->frame_number);
+            });
+
+            res.extra.emplace_back("captured_frames", f64(replay.frame_count()));
+        },
+    };
+}
+
+auto all_scenes() -> std::vector<scene> {
+    std::vector<scene> scenes;
+    for (auto model_name : { "teapot", "spoon", "teacup", "viking_room" }) {
+        scenes.push_back(loader_scene(model_name));
+        scenes.push_back(upload_scene(model_name));
+        for (u64 count : { 1, 100, 10'000, 100'000 })
+            scenes.push_back(model_scene(model_name, count));
+    }
+
+    /// 1, 2, 4, ... recording threads, up to the number of cores.
+    auto cores = std::max(std::thread::hardware_concurrency(), 1u);
+    for (u32 threads = 1; threads < cores; threads *= 2) scenes.push_back(parallel_scene("viking_room", 50'000, threads));
+    scenes.push_back(parallel_scene("viking_room", 50'000, cores));
+
+    scenes.push_back(batch_scene(10'000));
+    scenes.push_back(batch_scene(100'000));
+    scenes.push_back(texture_scene(16));
+    scenes.push_back(texture_scene(64));
+    scenes.push_back(readback_scene("1080p", 1920, 1080));
+    scenes.push_back(readback_scene("4k", 3840, 2160));
+    scenes.push_back(resize_scene(10));
+    scenes.push_back(cpu_zone_scene());
+    scenes.push_back(startup_scene());
+    return scenes;
+}
+
+auto to_json(const percentiles& p) -> std::string {
+    return fmt::format(R"({{"mean":{:.4f},"p50":{:.4f},"p95":{:.4f},"p99":{:.4f},"max":{:.4f}}})", p.mean, p.p50, p.p95, p.p99, p.max);
+}
+
+auto to_json(const bench& b, std::string_view label) -> std::string {
+    std::string json = fmt::format(R"({{"label":"{}","device":"{}","scenes":[)", json_escape(label), json_escape(b.device_name));
+    bool first = true;
+    for (const auto& r : b.results) {
+        if (!first) json += ",";
+        first = false;
+
+        json += fmt::format(
+            "\n  {{\"name\":\"{}\",\"run\":{},\"width\":{},\"height\":{},\"frames\":{},\"draw_calls\":{},\"triangles\":{},"
+            "\"pipeline_binds\":{},\"descriptor_binds\":{},\"upload_bytes\":{},"
+            "\"cpu_ms\":{},\"gpu_ms\":{},\"frame_ms\":{},\"rss_mb\":{:.1f},\"peak_rss_mb\":{:.1f}",
+            json_escape(r.name),
+            r.run,
+            r.width,
+            r.height,
+            r.frames,
+            r.stats.draw_calls,
+            r.stats.triangles,
+            r.stats.pipeline_binds,
+            r.stats.descriptor_binds,
+            r.stats.upload_bytes,
+            to_json(summarise(r.cpu_ms)),
+            to_json(summarise(r.gpu_ms)),
+            to_json(summarise(r.frame_ms)),
+            r.rss_mb,
+            r.peak_rss_mb
+        );
+
+        if (r.stats.has_pipeline_statistics) {
+            json += fmt::format(
+                ",\"vertex_invocations\":{},\"fragment_invocations\":{},\"clipping_primitives\":{}",
+                r.stats.vertex_invocations,
+                r.stats.fragment_invocations,
+                r.stats.clipping_primitives
+            );
+        }
+
+        for (const auto& [key, value] : r.extra) json += fmt::format(",\"{}\":{:.4f}", key, value);
+        json += "}";
+    }
+
+    json += "\n]}\n";
+    return json;
+}
+
+/// ======================================================================
+///  Regression checks
+/// ======================================================================
+/// Two-sided 95% quantile of Student's t distribution with `df` degrees of freedom.
+auto t95(f64 df) -> f64 {
+    static constexpr f64 table[]{
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+
+    if (df < 1) return INFINITY;
+    if (df <= 30) return table[u64(df) - 1];
+    return 1.96 + 2.4 / df;
+}
+
+/// A metric measured over several runs.
+struct sample {
+    f64 mean = 0, stddev = 0;
+    u64 runs = 0;
+
+    /// Half-width of the 95% confidence interval of the mean.
+    auto ci95() const -> f64 { return runs < 2 ? 0 : t95(f64(runs - 1)) * stddev / std::sqrt(f64(runs)); }
+};
+
+auto make_sample(const std::vector<f64>& values) -> sample {
+    sample s{ .runs = values.size() };
+    for (auto v : values) s.mean += v;
+    s.mean /= f64(values.size());
+    if (values.size() < 2) return s;
+    for (auto v : values) s.stddev += (v - s.mean) * (v - s.mean);
+    s.stddev = std::sqrt(s.stddev / f64(values.size() - 1));
+    return s;
+}
+
+/// Whether lower values of a metric are better (1), higher ones (-1), or it
+/// isn't something we check at all (0), going by its name.
+auto direction(std::string_view metric) -> int {
+    if (metric.ends_with("_ms") || metric.starts_with("ns_")) return 1;
+    if (metric.ends_with("_per_s")) return -1;
+    return 0;
+}
+
+/// The metrics of a single run that the regression check compares.
+auto metrics(const scene_result& r) -> std::vector<std::pair<std::string, f64>> {
+    std::vector<std::pair<std::string, f64>> res;
+    if (!r.cpu_ms.empty()) {
+        auto p = summarise(r.cpu_ms);
+        res.emplace_back("cpu_ms", p.mean);
+        res.emplace_back("cpu_p95_ms", p.p95);
+    }
+
+    if (!r.gpu_ms.empty()) res.emplace_back("gpu_ms", summarise(r.gpu_ms).mean);
+    if (!r.frame_ms.empty()) res.emplace_back("frame_ms", summarise(r.frame_ms).mean);
+    for (const auto& [key, value] : r.extra)
+        if (direction(key) != 0 && key.find(' ') == std::string::npos)
+            res.emplace_back(key, value);
+    return res;
+}
+
+/// Samples of every metric of every scene, keyed by scene and metric.
+///
+/// A baseline file contains the same: one metric per line, with the scene,
+/// the metric, its mean and standard deviation, and the number of runs, all
+/// separated by tabs. Lines that start with '#' are comments.
+using samples = std::map<std::pair<std::string, std::string>, sample>;
+
+auto collect_samples(const bench& b) -> samples {
+    std::map<std::pair<std::string, std::string>, std::vector<f64>> values;
+    for (const auto& r : b.results)
+        for (const auto& [key, value] : metrics(r))
+            values[{ r.name, key }].push_back(value);
+
+    samples res;
+    for (const auto& [key, v] : values) res[key] = make_sample(v);
+    return res;
+}
+
+auto read_baseline(const std::string& path) -> samples {
+    std::ifstream file{ path };
+    if (!file) die("[Bench] Could not open baseline \"{}\": {}", path, ::strerror(errno));
+
+    auto parse = [&](std::string_view text, auto& value, u64 line) {
+        auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (ec != std::errc{} || ptr != text.data() + text.size()) die("[Bench] {}:{}: Invalid number \"{}\"", path, line, text);
+    };
+
+    samples res;
+    u64 line_number = 0;
+    for (std::string line; std::getline(file, line);) {
+        line_number++;
+        if (line.empty() || line.starts_with('#')) continue;
+
+        std::vector<std::string_view> fields;
+        for (auto field : std::views::split(std::string_view{ line }, '\t')) fields.emplace_back(field.begin(), field.end());
+        if (fields.size() != 5) die("[Bench] {}:{}: Expected 5 fields, got {}", path, line_number, fields.size());
+
+        sample s;
+        parse(fields[2], s.mean, line_number);
+        parse(fields[3], s.stddev, line_number);
+        parse(fields[4], s.runs, line_number);
+        res[{ std::string{ fields[0] }, std::string{ fields[1] } }] = s;
+    }
+
+    return res;
+}
+
+void write_baseline(const std::string& path, const samples& current, std::string_view label, std::string_view device) {
+    std::string out = fmt::format("# label: {}\n# device: {}\n# scene\tmetric\tmean\tstddev\truns\n", label, device);
+    for (const auto& [key, s] : current) fmt::format_to(std::back_inserter(out), "{}\t{}\t{}\t{}\t{}\n", key.first, key.second, s.mean, s.stddev, s.runs);
+    if (!write_file_atomic(path, out.data(), out.size())) die("[Bench] Could not write \"{}\": {}", path, ::strerror(errno));
+}
+
+/// Compare the results against a baseline and return the number of regressions.
+///
+/// A metric has regressed if it got worse by more than `threshold` (relative
+/// to the baseline) and Welch's t-test says the difference is significant at
+/// the 95% level. With a single run on either side, we can't tell noise from a
+/// change, so only the threshold applies.
+auto compare(const samples& baseline, const samples& current, f64 threshold) -> u64 {
+    u64 regressions = 0, improvements = 0, compared = 0;
+    std::string out = fmt::format(
+        "[Bench] Comparison against baseline (threshold {:.1f}%):\n  {:<28} {:<20} {:>22} {:>22} {:>9}\n",
+        threshold * 100,
+        "Scene",
+        "Metric",
+        "Baseline",
+        "Current",
+        "Change"
+    );
+
+    for (const auto& [key, c] : current) {
+        auto it = baseline.find(key);
+        if (it == baseline.end()) continue;
+        const auto& b = it->second;
+        if (b.mean == 0 || b.runs == 0) continue;
+        compared++;
+
+        /// Positive if things got worse.
+        auto diff = c.mean - b.mean;
+        auto change = diff / b.mean * direction(key.second);
+
+        /// Welch's t-test.
+        auto vb = b.stddev * b.stddev / f64(b.runs);
+        auto vc = c.stddev * c.stddev / f64(c.runs);
+        auto se = std::sqrt(vb + vc);
+        bool significant = true;
+        if (se > 0) {
+            f64 denom = 0;
+            if (b.runs > 1) denom += vb * vb / f64(b.runs - 1);
+            if (c.runs > 1) denom += vc * vc / f64(c.runs - 1);
+            auto df = (vb + vc) * (vb + vc) / denom;
+            significant = std::abs(diff) > t95(df) * se;
+        }
+
+        std::string_view verdict;
+        if (significant && change > threshold) {
+            verdict = "REGRESSED";
+            regressions++;
+        } else if (significant && change < -threshold) {
+            verdict = "improved";
+            improvements++;
+        } else {
+            continue;
+        }
+
+        fmt::format_to(
+            std::back_inserter(out),
+            "  {:<28} {:<20} {:>12.4f} ± {:<7.4f} {:>12.4f} ± {:<7.4f} {:>+8.1f}% {}\n",
+            key.first,
+            key.second,
+            b.mean,
+            b.ci95(),
+            c.mean,
+            c.ci95(),
+            diff / b.mean * 100,
+            verdict
+        );
+    }
+
+    fmt::format_to(
+        std::back_inserter(out),
+        "[Bench] Compared {} metrics: {} regressed, {} improved, {} unchanged",
+        compared,
+        regressions,
+        improvements,
+        compared - regressions - improvements
+    );
+
+    if (regressions) warn("{}", out);
+    else info("{}", out);
+    return regressions;
+}
+} // namespace
+
+int main(int argc, char** argv) {
+    auto opts = options::parse(argc, argv);
+    auto* replay = opts.get<"--replay">();
+    auto scenes = replay ? std::vector{ replay_scene(*replay) } : all_scenes();
+
+    if (opts.get<"--list">()) {
+        for (const auto& s : scenes) fmt::print("{}\n", s.name);
+        return 0;
+    }
+
+    /// Don't read or write the user's pipeline cache: whatever state earlier runs
+    /// or the app left it in would change the results. Only the startup scene
+    /// uses a cache, which it creates from scratch.
+    ::setenv("VULKAN_ENGINE_PIPELINE_CACHE", "", 1);
+
+    bench b;
+    if (auto* dir = opts.get<"--shaders">()) b.shader_dir = *dir;
+    if (auto* frames = opts.get<"--frames">()) b.frames = u32(std::max<i64>(*frames, 1));
+    if (auto* warmup = opts.get<"--warmup">()) b.warmup = u32(std::max<i64>(*warmup, 0));
+
+    /// Go through all scenes once per run rather than running each scene several
+    /// times in a row, so that anything that slows down the machine for a while
+    /// affects all scenes alike.
+    auto* filter = opts.get<"--scene">();
+    auto* runs = opts.get<"--runs">();
+    auto run_count = u32(std::max<i64>(runs ? *runs : 1, 1));
+    for (u32 run = 0; run < run_count; run++) {
+        for (auto& s : scenes) {
+            if (filter && s.name.find(*filter) == std::string::npos) continue;
+            info("[Bench] Running {} ({}/{})", s.name, run + 1, run_count);
+
+            auto& res = b.results.emplace_back();
+            res.name = s.name;
+            res.run = run;
+            s.run(b, res);
+        }
+    }
+
+    auto* label = opts.get<"--label">();
+    auto json = to_json(b, label ? *label : "");
+    if (auto* path = opts.get<"--output">()) {
+        if (!write_file_atomic(*path, json.data(), json.size())) die("[Bench] Could not write \"{}\": {}", *path, ::strerror(errno));
+    } else {
+        fmt::print("{}", json);
+    }
+
+    auto current = collect_samples(b);
+    if (auto* path = opts.get<"--write-baseline">()) write_baseline(*path, current, label ? *label : "", b.device_name);
+    if (auto* path = opts.get<"--baseline">()) {
+        auto* threshold = opts.get<"--threshold">();
+        auto regressions = compare(read_baseline(*path), current, f64(threshold ? *threshold : 5) / 100.);
+        if (regressions) return 1;
+    }
+}
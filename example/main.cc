@@ -4,16 +4,26 @@
 #include "../lib/renderer.hh"
 #include "../lib/vertex.hh"
 
+#include <cerrno>
 #include <chrono>
+#include <cstring>
 
 using namespace command_line_options;
 using options = clopts< // clang-format off
-    positional<"filename", "The image to load.", std::string, false>
+    positional<"filename", "The image to load.", std::string, false>,
+    option<"--log-file", "Write log messages to this file instead of stderr", std::string>,
+    flag<"--startup-report", "Print how long each phase of startup took">
 >; // clang-format on
 
 int main(int argc, char** argv) {
     auto opts = options::parse(argc, argv);
+    if (auto* log_file = opts.get<"--log-file">(); log_file && !vk::logger::set_output(*log_file))
+        die("Could not open log file \"{}\": {}", *log_file, ::strerror(errno));
+
     vk::context ctx{ 1280, 720, "Vulkan Template" };
+    ctx.startup.print_report = opts.get<"--startup-report">();
+    ctx.enable_gpu_profiling();
+    ctx.enable_stutter_capture();
 
     ctx.on_key_pressed = [](vk::context* ctx, int key, int scancode, int action, int mods) {
         (void) scancode;
@@ -23,19 +33,15 @@ int main(int argc, char** argv) {
         if (key == GLFW_KEY_SPACE && action == GLFW_PRESS) ctx->paused = !ctx->paused;
     };
 
-    vk::texture_renderer renderer(&ctx, "out/tex_shader_vert.spv", "out/tex_shader_frag.spv");
+    /// Compile both pipelines concurrently.
+    vk::pipeline_builder builder{ &ctx };
+    vk::texture_renderer renderer(&ctx, "out/tex_shader_vert.spv", "out/tex_shader_frag.spv", &builder);
     vk::model room_model(&renderer, "assets/viking_room.png", "assets/viking_room.obj");
     vk::model_instance room1{ &room_model, { glm::scale(glm::translate(glm::mat4{ 1.0f }, glm::vec3(-.5f, 0.f, 0.f)), glm::vec3(.5f)) } };
     vk::model_instance room2{ &room_model, { glm::scale(glm::translate(glm::mat4{ 1.0f }, glm::vec3(.5f, 0.f, 0.f)), glm::vec3(.5f)) } };
 
-    vk::geometric_renderer geom_renderer(&ctx, "out/geom_shader_vert.spv", "out/geom_shader_frag.spv");
-    vk::geometry rects[5] = {
-        geom_renderer.build_geometry().rect({ -.9f, -.9f }, { -.8f, -.8f }),
-        geom_renderer.build_geometry().rect({ -.9f, -.7f }, { -.8f, -.6f }),
-        geom_renderer.build_geometry().rect({ -.9f, -.5f }, { -.8f, -.4f }),
-        geom_renderer.build_geometry().rect({ -.9f, -.3f }, { -.8f, -.2f }),
-        geom_renderer.build_geometry().rect({ -.9f, -.1f }, { -.8f, -0.f }),
-    };
+    vk::geometric_renderer geom_renderer(&ctx, "out/geom_shader_vert.spv", "out/geom_shader_frag.spv", &builder);
+    builder.build();
 
     ctx.run_forever([&](VkCommandBuffer command_buffer) {
         /// Update uniforms.
@@ -55,18 +61,28 @@ int main(int argc, char** argv) {
         ubo->proj[1][1] *= -1;
         vkUnmapMemory(ctx.device, renderer.uniform_buffers_memory[ctx.current_frame]);
 
-        renderer.draw(command_buffer, room1);
-        renderer.draw(command_buffer, room2);
+        {
+            vk::gpu_scope scope{ &ctx, command_buffer, "Rooms" };
+            renderer.draw(command_buffer, room1);
+            renderer.draw(command_buffer, room2);
+        }
 
+        /// Animated 2D shapes are drawn in immediate mode.
         static u64 rect_idx = 0;
-        if (!ctx.paused) rect_idx = u64(time * 2) % (sizeof rects / sizeof *rects);
-        geom_renderer.draw(command_buffer, rects[rect_idx]);
+        if (!ctx.paused) rect_idx = u64(time * 2) % 5;
+        f32 y = -.9f + .2f * f32(rect_idx);
+        geom_renderer.rect({ -.9f, y }, { -.8f, y + .1f });
+        geom_renderer.circle({ .8f, -.8f }, .08f + .02f * std::sin(time * 4), { 1.f, .5f, 0.f });
+        geom_renderer.line({ -.7f, .9f }, { -.7f + .3f * std::cos(time), .9f - .3f * std::sin(time) }, .01f, { 0.f, 1.f, 1.f });
+        {
+            vk::gpu_scope scope{ &ctx, command_buffer, "Shapes" };
+            geom_renderer.flush(command_buffer);
+        }
 
-        ImGui_ImplVulkan_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
+        /// The context has started the ImGui frame already and draws the UI on
+        /// top of everything once the scene has been resolved.
         ImGui::ShowDemoWindow();
-        ImGui::Render();
-        ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), command_buffer);
+        ctx.gpu_profile->draw_ui();
+        ctx.monitor.draw_ui();
     });
 }
\ No newline at end of file
@@ -0,0 +1,521 @@
+#include "command_capture.hh"
+
+#include "context.hh"
+#include "renderer.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+
+using op = vk::command_capture::op;
+
+namespace {
+/// Copy something that lives in device memory back to host memory. This waits
+/// for the copy to finish, so only do it once per resource, and only on the main
+/// thread, which owns the command pool.
+template <typename callable>
+auto download(vk::context* ctx, VkDeviceSize size, callable&& record_copy) -> std::vector<char> {
+    std::vector<char> out(size);
+    if (size == 0) return out;
+
+    VkBuffer staging_buffer;
+    VkDeviceMemory staging_buffer_memory;
+    ctx->create_buffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        staging_buffer, staging_buffer_memory);
+    defer {
+        vkDestroyBuffer(ctx->device, staging_buffer, nullptr);
+        vkFreeMemory(ctx->device, staging_buffer_memory, nullptr);
+    };
+
+    auto command_buffer = ctx->begin_single_time_commands();
+    std::forward<callable>(record_copy)(command_buffer, staging_buffer);
+    ctx->end_single_time_commands(command_buffer);
+
+    void* data;
+    assert_success(vkMapMemory(ctx->device, staging_buffer_memory, 0, size, 0, &data), "failed to map capture staging buffer");
+    std::memcpy(out.data(), data, size);
+    vkUnmapMemory(ctx->device, staging_buffer_memory);
+    return out;
+}
+
+auto download_buffer(vk::context* ctx, VkBuffer buffer, VkDeviceSize size) -> std::vector<char> {
+    return download(ctx, size, [&](VkCommandBuffer command_buffer, VkBuffer staging_buffer) {
+        VkBufferCopy region{};
+        region.size = size;
+        vkCmdCopyBuffer(command_buffer, buffer, staging_buffer, 1, &region);
+    });
+}
+
+/// Read back the first mip level of a texture.
+auto download_texture(vk::context* ctx, const vk::model& m) -> std::vector<char> {
+    auto wd = u32(m.tex_width), ht = u32(m.tex_height);
+    return download(ctx, VkDeviceSize(wd) * ht * 4, [&](VkCommandBuffer command_buffer, VkBuffer staging_buffer) {
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = m.texture_image;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = 1;
+
+        barrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+        VkBufferImageCopy region{};
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = 0;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageExtent = { wd, ht, 1 };
+        vkCmdCopyImageToBuffer(command_buffer, m.texture_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, staging_buffer, 1, &region);
+
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    });
+}
+
+/// Cursor into a capture.
+struct reader {
+    const std::vector<char>& data;
+    u64 pos = 0;
+
+    void read(void* out, u64 size) {
+        if (size > data.size() - pos) die("[Capture] Capture is truncated");
+        std::memcpy(out, data.data() + pos, size);
+        pos += size;
+    }
+
+    void skip(u64 size) {
+        if (size > data.size() - pos) die("[Capture] Capture is truncated");
+        pos += size;
+    }
+
+    template <typename type>
+    auto get() -> type {
+        type value;
+        read(&value, sizeof value);
+        return value;
+    }
+
+    template <typename type>
+    void array(std::vector<type>& out) {
+        out.resize(get<u32>());
+        read(out.data(), out.size() * sizeof(type));
+    }
+
+    template <typename type>
+    void skip_array() { skip(u64(get<u32>()) * sizeof(type)); }
+
+    auto string() -> std::string {
+        std::string s(get<u32>(), '\0');
+        read(s.data(), s.size());
+        return s;
+    }
+
+    /// Read a pipeline state into `out`, if there is one. Returns whether there was.
+    bool state(vk::pipeline_state& out) {
+        if (!get<u8>()) return false;
+        out.topology = get<VkPrimitiveTopology>();
+        out.polygon_mode = get<VkPolygonMode>();
+        out.cull_mode = get<VkCullModeFlags>();
+        out.front_face = get<VkFrontFace>();
+        out.depth_test = get<u8>();
+        out.depth_write = get<u8>();
+        out.depth_compare = get<VkCompareOp>();
+        out.alpha_blend = get<u8>();
+        array(out.specialisation_constants);
+        return true;
+    }
+
+    /// Skip the operands of a record.
+    void skip_record(op o) {
+        vk::pipeline_state ignored;
+        switch (o) {
+            case op::renderer:
+                skip(sizeof(u32) + sizeof(vk::renderer_kind));
+                skip_array<char>();
+                skip_array<char>();
+                return;
+
+            case op::model: {
+                skip(2 * sizeof(u32));
+                auto wd = get<u32>(), ht = get<u32>();
+                skip(u64(wd) * ht * 4);
+                skip_array<vertex>();
+                skip_array<u32>();
+                return;
+            }
+
+            case op::geometry:
+                skip(sizeof(u32));
+                skip_array<vertex>();
+                skip_array<u32>();
+                return;
+
+            case op::frame:
+            case op::end:
+                return;
+
+            case op::uniforms:
+                skip(sizeof(u32) + sizeof(uniform_buffer_object));
+                return;
+
+            case op::draw_model:
+            case op::draw_geometry:
+                skip(2 * sizeof(u32) + sizeof(push_constant));
+                state(ignored);
+                return;
+
+            case op::batch:
+                skip(sizeof(u32));
+                skip_array<vertex>();
+                skip_array<u32>();
+                skip(sizeof(push_constant));
+                state(ignored);
+                return;
+        }
+
+        die("[Capture] Invalid record type {}", u8(o));
+    }
+};
+
+template <typename map_type>
+auto find(map_type& map, u32 id, std::string_view what) {
+    auto it = map.find(id);
+    if (it == map.end()) die("[Capture] Capture refers to unknown {} {}", what, id);
+    return it->second.get();
+}
+} // namespace
+
+/// ======================================================================
+///  Capture
+/// ======================================================================
+vk::command_capture::command_capture(context* ctx, std::string path_, u64 frames)
+    : ctx(ctx), path(std::move(path_)), frames_left(frames) {
+    file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        err("[Capture] Could not open \"{}\": {}", path, ::strerror(errno));
+        frames_left = 0;
+        return;
+    }
+
+    std::setvbuf(file, nullptr, _IOFBF, 1 << 20);
+    write(magic, sizeof magic);
+    write(version);
+    write(ctx->swap_chain_extent.width);
+    write(ctx->swap_chain_extent.height);
+    write(u8(ctx->textures != nullptr));
+}
+
+vk::command_capture::~command_capture() {
+    if (!file) return;
+    write(op::end);
+
+    bool failed = std::ferror(file);
+    if (std::fclose(file) || failed) err("[Capture] Could not write \"{}\": {}", path, ::strerror(errno));
+    else info("[Capture] Wrote {} frames ({:.1f} MiB) to \"{}\"", frames_recorded, f64(bytes_written) / (1024. * 1024.), path);
+}
+
+void vk::command_capture::begin_frame() {
+    std::unique_lock lock{ mutex };
+    if (frames_left == 0) return;
+    frames_left--;
+    recording = true;
+    write(op::frame);
+}
+
+void vk::command_capture::end_frame() {
+    std::unique_lock lock{ mutex };
+    if (!recording) return;
+    write_pending_resources();
+    recording = false;
+    frames_recorded++;
+}
+
+void vk::command_capture::uniforms(pipeline* p, const uniform_buffer_object& ubo) {
+    std::unique_lock lock{ mutex };
+    if (!recording) return;
+    auto r = id(p);
+    write(op::uniforms);
+    write(r);
+    write(ubo);
+}
+
+void vk::command_capture::draw(texture_renderer* r, const model_instance& ti, const pipeline_state* state) {
+    std::unique_lock lock{ mutex };
+    if (!recording) return;
+    auto renderer = id(r);
+    auto m = id(ti.m);
+    write(op::draw_model);
+    write(renderer);
+    write(m);
+    write(ti.constant);
+    write_state(state);
+}
+
+void vk::command_capture::draw(geometric_renderer* r, const geometry& g, const pipeline_state* state) {
+    std::unique_lock lock{ mutex };
+    if (!recording) return;
+    auto renderer = id(r);
+    auto geom = id(g);
+    write(op::draw_geometry);
+    write(renderer);
+    write(geom);
+    write(g.constant);
+    write_state(state);
+}
+
+void vk::command_capture::batch(geometric_renderer* r, const push_constant& constant, const pipeline_state* state) {
+    std::unique_lock lock{ mutex };
+    if (!recording) return;
+    auto renderer = id(r);
+
+    /// Everything since the last flush. Shapes only refer to their own vertices,
+    /// so the indices can be made relative to the first unflushed vertex.
+    auto& b = r->batch_buffers[ctx->current_frame];
+    auto* verts = static_cast<const vertex*>(b.mapped);
+    auto* batch_indices = reinterpret_cast<const u32*>(verts + b.vertex_capacity);
+    indices.clear();
+    for (u32 i = r->batch_flushed_index; i < r->batch_index_count; i++) indices.push_back(batch_indices[i] - r->batch_flushed_vertex);
+
+    write(op::batch);
+    write(renderer);
+    write_array(verts + r->batch_flushed_vertex, r->batch_vertex_count - r->batch_flushed_vertex);
+    write_array(indices.data(), indices.size());
+    write(constant);
+    write_state(state);
+}
+
+void vk::command_capture::forget(const void* resource) {
+    std::unique_lock lock{ mutex };
+    ids.erase(resource);
+    std::erase_if(pending_models, [&](auto& p) { return p.m == resource; });
+    std::erase_if(pending_geometries, [&](auto& g) { return g.vertex_buffer == resource; });
+}
+
+auto vk::command_capture::id(pipeline* p) -> u32 {
+    if (auto it = ids.find(p); it != ids.end()) return it->second;
+    auto new_id = ids[p] = next_id++;
+
+    const auto& desc = p->variants->description;
+    write(op::renderer);
+    write(new_id);
+    write(p->kind);
+    write_array(desc.vert_path.data(), desc.vert_path.size());
+    write_array(desc.frag_path.data(), desc.frag_path.size());
+    return new_id;
+}
+
+auto vk::command_capture::id(model* m) -> u32 {
+    if (auto it = ids.find(m); it != ids.end()) return it->second;
+    auto renderer = id(m->r);
+    auto new_id = ids[m] = next_id++;
+    pending_models.push_back({ new_id, renderer, m });
+    return new_id;
+}
+
+auto vk::command_capture::id(const geometry& g) -> u32 {
+    /// Geometries are moved around by value, so go by their vertex buffer.
+    const void* key = g.verts.vk_vertbuf;
+    if (auto it = ids.find(key); it != ids.end()) return it->second;
+    auto new_id = ids[key] = next_id++;
+    pending_geometries.push_back({ new_id, g.verts.vk_vertbuf, g.verts.vk_idxbuf, g.verts.vertex_count, g.verts.index_count });
+    return new_id;
+}
+
+void vk::command_capture::write_pending_resources() {
+    for (auto [model_id, renderer, m] : pending_models) {
+        auto pixels = download_texture(ctx, *m);
+        auto verts = download_buffer(ctx, m->verts.vk_vertbuf, m->verts.vertex_count * sizeof(vertex));
+        auto indices = download_buffer(ctx, m->verts.vk_idxbuf, m->verts.index_count * sizeof(u32));
+
+        write(op::model);
+        write(model_id);
+        write(renderer);
+        write(u32(m->tex_width));
+        write(u32(m->tex_height));
+        write(pixels.data(), pixels.size());
+        write(u32(m->verts.vertex_count));
+        write(verts.data(), verts.size());
+        write(u32(m->verts.index_count));
+        write(indices.data(), indices.size());
+    }
+
+    for (const auto& g : pending_geometries) {
+        auto verts = download_buffer(ctx, g.vertex_buffer, g.vertex_count * sizeof(vertex));
+        auto indices = download_buffer(ctx, g.index_buffer, g.index_count * sizeof(u32));
+
+        write(op::geometry);
+        write(g.id);
+        write(u32(g.vertex_count));
+        write(verts.data(), verts.size());
+        write(u32(g.index_count));
+        write(indices.data(), indices.size());
+    }
+
+    pending_models.clear();
+    pending_geometries.clear();
+}
+
+void vk::command_capture::write(const void* data, u64 size) {
+    std::fwrite(data, 1, size, file);
+    bytes_written += size;
+}
+
+void vk::command_capture::write_state(const pipeline_state* state) {
+    write(u8(state != nullptr));
+    if (!state) return;
+    write(state->topology);
+    write(state->polygon_mode);
+    write(state->cull_mode);
+    write(state->front_face);
+    write(u8(state->depth_test));
+    write(u8(state->depth_write));
+    write(state->depth_compare);
+    write(u8(state->alpha_blend));
+    write_array(state->specialisation_constants.data(), state->specialisation_constants.size());
+}
+
+/// ======================================================================
+///  Replay
+/// ======================================================================
+vk::command_replay::command_replay(std::string_view path) : data(map_file(path)) {
+    reader in{ data };
+    char m[sizeof command_capture::magic];
+    in.read(m, sizeof m);
+    if (std::memcmp(m, command_capture::magic, sizeof m) != 0) die("[Capture] \"{}\" is not a capture", path);
+    if (auto v = in.get<u32>(); v != command_capture::version) die("[Capture] \"{}\" has version {}, but only version {} is supported", path, v, command_capture::version);
+    width = in.get<u32>();
+    height = in.get<u32>();
+    bindless = in.get<u8>();
+
+    /// Captures that were cut short don't have an end record.
+    while (in.pos < data.size()) {
+        auto at = in.pos;
+        auto o = in.get<op>();
+        if (o == op::end) break;
+        if (o == op::frame) frames.push_back(in.pos);
+        else if (o == op::renderer || o == op::model || o == op::geometry) resources.push_back(at);
+        in.skip_record(o);
+    }
+}
+
+vk::command_replay::~command_replay() {
+    if (ctx) vkDeviceWaitIdle(ctx->device);
+}
+
+void vk::command_replay::load(context* c) {
+    ctx = c;
+    if (bindless && !ctx->textures) ctx->enable_bindless_textures();
+
+    std::vector<vertex> verts;
+    std::vector<u32> indices;
+    for (auto offset : resources) {
+        reader in{ data, offset };
+        switch (in.get<op>()) {
+            case op::renderer: {
+                auto id = in.get<u32>();
+                auto kind = in.get<renderer_kind>();
+                auto vert = shader(in.string());
+                auto frag = shader(in.string());
+                if (kind == renderer_kind::geometric) geometric_renderers[id] = std::make_unique<geometric_renderer>(ctx, vert, frag);
+                else texture_renderers[id] = std::make_unique<texture_renderer>(ctx, vert, frag);
+            } break;
+
+            case op::model: {
+                auto id = in.get<u32>();
+                auto* r = find(texture_renderers, in.get<u32>(), "texture renderer");
+                auto wd = in.get<u32>(), ht = in.get<u32>();
+                auto* pixels = data.data() + in.pos;
+                in.skip(u64(wd) * ht * 4);
+                in.array(verts);
+                in.array(indices);
+                models[id] = std::make_unique<model>(r, pixels, wd, ht, verts, indices);
+            } break;
+
+            case op::geometry: {
+                auto id = in.get<u32>();
+                in.array(verts);
+                in.array(indices);
+                geometries[id] = std::make_unique<geometry>(geometry{ .constant = {}, .verts = vertex_buffer(ctx, verts, indices) });
+            } break;
+
+            default: die("[Capture] Invalid resource record at offset {}", offset);
+        }
+    }
+}
+
+void vk::command_replay::play(VkCommandBuffer command_buffer, u64 frame) {
+    if (frames.empty()) return;
+
+    reader in{ data, frames[frame % frames.size()] };
+    pipeline_state state;
+    for (;;) {
+        if (in.pos == data.size()) return;
+        switch (auto o = in.get<op>()) {
+            case op::frame:
+            case op::end:
+                return;
+
+            /// Already created by load().
+            case op::renderer:
+            case op::model:
+            case op::geometry:
+                in.skip_record(o);
+                break;
+
+            case op::uniforms: {
+                auto* p = renderer(in.get<u32>());
+                auto ubo = in.get<uniform_buffer_object>();
+                p->update_uniform_buffers([&](uniform_buffer_object& u) { u = ubo; });
+            } break;
+
+            case op::draw_model: {
+                auto* r = find(texture_renderers, in.get<u32>(), "texture renderer");
+                auto* m = find(models, in.get<u32>(), "model");
+                model_instance inst{ m, in.get<push_constant>() };
+                bool has_state = in.state(state);
+                r->draw(command_buffer, inst, has_state ? &state : nullptr);
+            } break;
+
+            case op::draw_geometry: {
+                auto* r = find(geometric_renderers, in.get<u32>(), "geometric renderer");
+                auto* g = find(geometries, in.get<u32>(), "geometry");
+                g->constant = in.get<push_constant>();
+                bool has_state = in.state(state);
+                r->draw(command_buffer, *g, has_state ? &state : nullptr);
+            } break;
+
+            case op::batch: {
+                auto* r = find(geometric_renderers, in.get<u32>(), "geometric renderer");
+                in.array(batch_vertices);
+                in.array(batch_indices);
+                auto constant = in.get<push_constant>();
+                bool has_state = in.state(state);
+                r->append(batch_vertices, batch_indices);
+                r->flush(command_buffer, constant, has_state ? &state : nullptr);
+            } break;
+
+            default: die("[Capture] Invalid record type {}", u8(o));
+        }
+    }
+}
+
+auto vk::command_replay::renderer(u32 id) -> pipeline* {
+    if (auto it = texture_renderers.find(id); it != texture_renderers.end()) return it->second.get();
+    return find(geometric_renderers, id, "renderer");
+}
+
+auto vk::command_replay::shader(const std::string& path) const -> std::string {
+    if (shader_dir.empty()) return path;
+    return (std::filesystem::path(shader_dir) / std::filesystem::path(path).filename()).string();
+}
@@ -0,0 +1,194 @@
+#ifndef VULKAN_TEMPLATE_COMMAND_CAPTURE_HH
+#define VULKAN_TEMPLATE_COMMAND_CAPTURE_HH
+#include "utils.hh"
+#include "vertex.hh"
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace vk {
+struct context;
+struct geometric_renderer;
+struct geometry;
+struct model;
+struct model_instance;
+struct pipeline;
+struct pipeline_state;
+struct texture_renderer;
+
+/// Records the renderer-level calls of a number of frames to a file, so they can
+/// be replayed later without the application that made them; see command_replay.
+///
+/// A capture is a header followed by a stream of records, each of which is an
+/// opcode and its operands, in native byte order:
+///
+///   header:   "VKCAPTR\0", version, width, height, bindless
+///   renderer: id, kind, vertex shader path, fragment shader path
+///   model:    id, renderer, texture width and height, RGBA8 pixels, vertices, indices
+///   geometry: id, vertices, indices
+///   frame:    start of a frame
+///   uniforms: renderer, uniform buffer object
+///   draw:     renderer, model or geometry, push constant, pipeline state
+///   batch:    renderer, vertices, indices, push constant, pipeline state
+///   end:      end of the capture
+///
+/// Resources get an id the first time a frame refers to them and are written at
+/// the end of that frame; replays load all resources up front, so they needn't
+/// come before the draws that use them. Textures and vertex buffers live in
+/// device memory, so writing them means copying them back, which stalls the
+/// queue once per resource; this happens on the main thread once the frame has
+/// been recorded, never on a recording thread. Shaders are referenced by path.
+///
+/// Draws may come from several recording threads; they're written in the order
+/// in which they were recorded, which need not be the order in which they end
+/// up in the command buffer.
+struct command_capture {
+    static constexpr char magic[8] = "VKCAPTR";
+    static constexpr u32 version = 1;
+
+    enum struct op : u8 {
+        renderer,
+        model,
+        geometry,
+        frame,
+        uniforms,
+        draw_model,
+        draw_geometry,
+        batch,
+        end,
+    };
+
+    context* ctx;
+    std::string path;
+    std::FILE* file = nullptr;
+
+    /// Frames that are still to be recorded, and whether we're in one right now.
+    u64 frames_left;
+    bool recording = false;
+
+    /// Progress.
+    u64 frames_recorded = 0;
+    u64 bytes_written = 0;
+
+    /// A resource that has been given an id, but hasn't been written yet.
+    struct pending_model {
+        u32 id;
+        u32 renderer;
+        model* m;
+    };
+
+    /// Geometries are copied by value, so remember where their data lives.
+    struct pending_geometry {
+        u32 id;
+        VkBuffer vertex_buffer;
+        VkBuffer index_buffer;
+        u64 vertex_count;
+        u64 index_count;
+    };
+
+    /// Resources that have been given an id, by address.
+    std::unordered_map<const void*, u32> ids;
+    u32 next_id = 0;
+    std::mutex mutex;
+
+    /// Resources that were first used in the current frame and have yet to be written.
+    std::vector<pending_model> pending_models;
+    std::vector<pending_geometry> pending_geometries;
+
+    /// Scratch space for batch indices.
+    std::vector<u32> indices;
+
+    /// Start a capture of the next `frames` frames. If the file can't be
+    /// opened, `file` is null and nothing is recorded.
+    command_capture(context* ctx, std::string path, u64 frames);
+    ~command_capture();
+
+    nocopy(command_capture);
+    nomove(command_capture);
+
+    /// Whether all frames have been recorded.
+    bool done() const { return frames_left == 0 && !recording; }
+
+    /// INTERNAL:
+    void begin_frame();
+    void end_frame();
+    void uniforms(pipeline* p, const uniform_buffer_object& ubo);
+    void draw(texture_renderer* r, const model_instance& ti, const pipeline_state* state);
+    void draw(geometric_renderer* r, const geometry& g, const pipeline_state* state);
+    void batch(geometric_renderer* r, const push_constant& constant, const pipeline_state* state);
+    void forget(const void* resource);
+    auto id(pipeline* p) -> u32;
+    auto id(model* m) -> u32;
+    auto id(const geometry& g) -> u32;
+    void write_pending_resources();
+    void write(const void* data, u64 size);
+    void write_state(const pipeline_state* state);
+
+    template <typename type>
+    void write(const type& value) { write(&value, sizeof value); }
+
+    template <typename type>
+    void write_array(const type* data, u64 count) {
+        write(u32(count));
+        write(data, count * sizeof(type));
+    }
+};
+
+/// Replays a capture as fast as possible. The resources of the capture are
+/// created up front by load(); play() then records the calls of one frame.
+struct command_replay {
+    /// The capture.
+    std::vector<char> data;
+    u32 width = 0, height = 0;
+    bool bindless = false;
+
+    /// Offsets of the first record of every frame, and of every resource record.
+    std::vector<u64> frames;
+    std::vector<u64> resources;
+
+    /// If set, shaders are loaded from this directory instead of the one they
+    /// were recorded with.
+    std::string shader_dir;
+
+    /// Resources, by id. Models have to go before their renderers.
+    context* ctx = nullptr;
+    std::unordered_map<u32, std::unique_ptr<texture_renderer>> texture_renderers;
+    std::unordered_map<u32, std::unique_ptr<geometric_renderer>> geometric_renderers;
+    std::unordered_map<u32, std::unique_ptr<model>> models;
+    std::unordered_map<u32, std::unique_ptr<geometry>> geometries;
+
+    /// Scratch space for batches.
+    std::vector<vertex> batch_vertices;
+    std::vector<u32> batch_indices;
+
+    /// Read a capture. This does not need a context yet.
+    explicit command_replay(std::string_view path);
+    ~command_replay();
+
+    nocopy(command_replay);
+    nomove(command_replay);
+
+    /// Create all resources of the capture on a context. The context should be
+    /// `width` by `height`. This enables bindless textures if the capture used them,
+    /// in which case the context must have been created with CONTEXT_FEATURE_BINDLESS_TEXTURES.
+    void load(context* ctx);
+
+    /// Record the calls of frame `frame % frame_count()`.
+    void play(VkCommandBuffer command_buffer, u64 frame);
+
+    /// Number of frames in the capture.
+    auto frame_count() const -> u64 { return frames.size(); }
+
+    /// INTERNAL:
+    auto renderer(u32 id) -> pipeline*;
+    auto shader(const std::string& path) const -> std::string;
+};
+
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_COMMAND_CAPTURE_HH
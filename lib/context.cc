@@ -8,6 +8,7 @@
 #include "vertex.hh"
 
 #include <algorithm>
+#include <filesystem>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <map>
@@ -17,6 +18,7 @@
 
 using namespace vk;
 defer_type_operator_lhs defer_type_operator_lhs::instance;
+thread_local VkPipeline vk::context::bound_pipeline = VK_NULL_HANDLE;
 
 /// ======================================================================
 ///  Utilities
@@ -25,6 +27,14 @@ namespace {
 /// How many contexts are currently alive.
 u64 context_count = 0;
 
+/// Number of frames to draw after an input event in on-demand mode. ImGui
+/// sometimes needs a frame or two to settle, e.g. to update hover state.
+constexpr u32 input_redraw_frames = 3;
+
+/// How long to block waiting for events in on-demand mode before checking
+/// again whether we should terminate.
+constexpr f64 idle_timeout_seconds = .5;
+
 #ifdef ENABLE_VALIDATION_LAYERS
 const std::vector<const char*> validation_layers = {
     "VK_LAYER_KHRONOS_validation",
@@ -73,6 +83,146 @@ VkExtent2D choose_swap_extent(const VkSurfaceCapabilitiesKHR& capabilities, GLFW
     return actual_extent;
 }
 
+/// Check whether a device supports dynamic rendering, either as part of
+/// Vulkan 1.3 or through VK_KHR_dynamic_rendering.
+bool phys_supports_dynamic_rendering(VkPhysicalDevice dev, u32 instance_api_version) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(dev, &props);
+    if (props.apiVersion < VK_API_VERSION_1_2) return false;
+
+    /// Before 1.3, the extension has to be present.
+    if (std::min(props.apiVersion, instance_api_version) < VK_API_VERSION_1_3) {
+        u32 extension_count = 0;
+        vkEnumerateDeviceExtensionProperties(dev, nullptr, &extension_count, nullptr);
+        std::vector<VkExtensionProperties> extensions(extension_count);
+        vkEnumerateDeviceExtensionProperties(dev, nullptr, &extension_count, extensions.data());
+        if (std::none_of(extensions.begin(), extensions.end(), [](const VkExtensionProperties& e) {
+                return std::string_view{ e.extensionName } == VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME;
+            })) return false;
+    }
+
+    VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamic_rendering_features{};
+    dynamic_rendering_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+
+    VkPhysicalDeviceFeatures2 features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &dynamic_rendering_features;
+    vkGetPhysicalDeviceFeatures2(dev, &features);
+    return dynamic_rendering_features.dynamicRendering;
+}
+
+/// Record a layout transition of an image that is used as an attachment.
+void attachment_barrier(VkCommandBuffer command_buffer, VkImage image, VkImageAspectFlags aspect,
+    VkImageLayout old_layout, VkImageLayout new_layout,
+    VkPipelineStageFlags src_stage, VkAccessFlags src_access,
+    VkPipelineStageFlags dst_stage, VkAccessFlags dst_access) {
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = old_layout;
+    barrier.newLayout = new_layout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange = { aspect, 0, 1, 0, 1 };
+    barrier.srcAccessMask = src_access;
+    barrier.dstAccessMask = dst_access;
+    vkCmdPipelineBarrier(command_buffer, src_stage, dst_stage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+/// Whether a depth format also has a stencil component.
+bool has_stencil_component(VkFormat format) {
+    return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
+}
+
+/// Check whether a device supports VK_KHR_present_id and VK_KHR_present_wait.
+bool phys_supports_present_wait(VkPhysicalDevice dev) {
+    u32 extension_count = 0;
+    vkEnumerateDeviceExtensionProperties(dev, nullptr, &extension_count, nullptr);
+    std::vector<VkExtensionProperties> extensions(extension_count);
+    vkEnumerateDeviceExtensionProperties(dev, nullptr, &extension_count, extensions.data());
+
+    auto has = [&](std::string_view name) {
+        return std::any_of(extensions.begin(), extensions.end(), [&](const VkExtensionProperties& e) { return e.extensionName == name; });
+    };
+    if (!has(VK_KHR_PRESENT_ID_EXTENSION_NAME) || !has(VK_KHR_PRESENT_WAIT_EXTENSION_NAME)) return false;
+
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features{};
+    present_wait_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+
+    VkPhysicalDevicePresentIdFeaturesKHR present_id_features{};
+    present_id_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    present_id_features.pNext = &present_wait_features;
+
+    VkPhysicalDeviceFeatures2 features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &present_id_features;
+    vkGetPhysicalDeviceFeatures2(dev, &features);
+    return present_id_features.presentId && present_wait_features.presentWait;
+}
+
+/// Get the newest API version that both the loader and we support. We need
+/// at least 1.2 for timeline semaphores; asking for more than the loader
+/// knows about fails on older loaders.
+u32 loader_api_version() {
+    auto enumerate_version = (PFN_vkEnumerateInstanceVersion) vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion");
+    u32 version = VK_API_VERSION_1_0;
+    if (enumerate_version) enumerate_version(&version);
+    if (version < VK_API_VERSION_1_2) die("[Vulkan] Vulkan 1.2 is required, but the loader only supports {}.{}", VK_API_VERSION_MAJOR(version), VK_API_VERSION_MINOR(version));
+    return std::min(version, VK_API_VERSION_1_3);
+}
+
+/// Create a timeline semaphore with an initial value of 0.
+auto create_timeline_semaphore(VkDevice device) -> VkSemaphore {
+    VkSemaphoreTypeCreateInfo type_info{};
+    type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    type_info.initialValue = 0;
+
+    VkSemaphoreCreateInfo create_info{};
+    create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    create_info.pNext = &type_info;
+
+    VkSemaphore semaphore;
+    assert_success(vkCreateSemaphore(device, &create_info, nullptr, &semaphore), "failed to create timeline semaphore");
+    return semaphore;
+}
+
+/// Check whether a device supports timeline semaphores.
+bool phys_supports_timeline_semaphores(VkPhysicalDevice dev) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(dev, &props);
+    if (props.apiVersion < VK_API_VERSION_1_2) return false;
+
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features{};
+    timeline_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+
+    VkPhysicalDeviceFeatures2 features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &timeline_features;
+    vkGetPhysicalDeviceFeatures2(dev, &features);
+    return timeline_features.timelineSemaphore;
+}
+
+/// Check whether a device supports everything we need for bindless textures.
+bool phys_supports_descriptor_indexing(VkPhysicalDevice dev) {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(dev, &props);
+    if (props.apiVersion < VK_API_VERSION_1_2) return false;
+
+    VkPhysicalDeviceDescriptorIndexingFeatures indexing_features{};
+    indexing_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+
+    VkPhysicalDeviceFeatures2 features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &indexing_features;
+    vkGetPhysicalDeviceFeatures2(dev, &features);
+
+    return indexing_features.runtimeDescriptorArray
+        && indexing_features.descriptorBindingPartiallyBound
+        && indexing_features.descriptorBindingSampledImageUpdateAfterBind
+        && indexing_features.descriptorBindingUpdateUnusedWhilePending;
+}
+
 VkSampleCountFlagBits phys_max_usable_sample_count(VkPhysicalDevice dev) {
     VkPhysicalDeviceProperties props;
     vkGetPhysicalDeviceProperties(dev, &props);
@@ -95,25 +245,101 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL vulkan_debug_callback(
     VkDebugUtilsMessageTypeFlagsEXT message_type,
     const VkDebugUtilsMessengerCallbackDataEXT* callback_data,
     void*) {
-    static const auto prefix = [](std::string_view sv = "") { fmt::print(stderr, "{}[{}] Vulkan: ", sv, current_time()); };
-
+    auto level = log_level::debug;
     switch (message_severity) {
-        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT: prefix(); break;
-        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT: prefix(); break;
-        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT:
-            if (message_type == VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT) prefix("\033[34m");
-            else prefix("\033[33m");
-            break;
-        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT: prefix("\033[31m"); break;
-        default: prefix(); break;
+        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT: level = log_level::info; break;
+        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT: level = log_level::warning; break;
+        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT: level = log_level::fatal; break;
+        default: break;
     }
 
-    fmt::print(stderr, "{}\033[m\n", callback_data->pMessage);
-    if (message_severity == VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT) std::exit(1);
+    if (!logger::enabled(level)) return VK_FALSE;
+    auto& buf = logger::scratch();
+    buf.clear();
+    fmt::format_to(
+        std::back_inserter(buf),
+        "[Vulkan] {}{}",
+        message_type == VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT ? "Performance: " : "",
+        callback_data->pMessage
+    );
+
+    if (level == log_level::fatal) logger::fatal({ buf.data(), buf.size() });
+
+    /// This is called from inside driver calls, possibly every draw, so rate-limit
+    /// by message id rather than by call site. Bit 63 keeps these apart from the
+    /// addresses of format strings.
+    auto site = u64(u32(callback_data->messageIdNumber)) | u64(1) << 63;
+    logger::write(level, site, { buf.data(), buf.size() });
     return VK_FALSE;
 }
 #endif
 
+/// Header that we prepend to the pipeline cache data so we never hand
+/// a driver a cache that was created by a different device or driver.
+struct pipeline_cache_header {
+    char magic[8];
+    u32 version;
+    u32 vendor_id;
+    u32 device_id;
+    u32 driver_version;
+    u8 pipeline_cache_uuid[VK_UUID_SIZE];
+    u8 device_uuid[VK_UUID_SIZE];
+    u8 driver_uuid[VK_UUID_SIZE];
+    u64 data_size;
+    u64 checksum;
+};
+
+constexpr char pipeline_cache_magic[8] = { 'V', 'K', 'E', 'P', 'C', 'A', 'C', 'H' };
+constexpr u32 pipeline_cache_version = 1;
+
+/// FNV-1a.
+u64 checksum(const char* data, u64 size) {
+    u64 hash = 0xcbf29ce484222325;
+    for (u64 i = 0; i < size; i++) {
+        hash ^= u8(data[i]);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+/// Build the header that a cache for this device should have.
+pipeline_cache_header make_pipeline_cache_header(VkPhysicalDevice dev) {
+    VkPhysicalDeviceIDProperties id_props{};
+    id_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+
+    VkPhysicalDeviceProperties2 props{};
+    props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props.pNext = &id_props;
+    vkGetPhysicalDeviceProperties2(dev, &props);
+
+    pipeline_cache_header header{};
+    std::memcpy(header.magic, pipeline_cache_magic, sizeof header.magic);
+    header.version = pipeline_cache_version;
+    header.vendor_id = props.properties.vendorID;
+    header.device_id = props.properties.deviceID;
+    header.driver_version = props.properties.driverVersion;
+    std::memcpy(header.pipeline_cache_uuid, props.properties.pipelineCacheUUID, VK_UUID_SIZE);
+    std::memcpy(header.device_uuid, id_props.deviceUUID, VK_UUID_SIZE);
+    std::memcpy(header.driver_uuid, id_props.driverUUID, VK_UUID_SIZE);
+    return header;
+}
+
+/// Determine where to store the pipeline cache. Setting VULKAN_ENGINE_PIPELINE_CACHE
+/// to an empty string disables it.
+std::string default_pipeline_cache_path() {
+    if (auto* path = std::getenv("VULKAN_ENGINE_PIPELINE_CACHE")) return path;
+
+    std::filesystem::path dir;
+    if (auto* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) dir = xdg;
+    else if (auto* home = std::getenv("HOME"); home && *home) dir = std::filesystem::path(home) / ".cache";
+    else return "pipeline_cache.bin";
+
+    dir /= "vulkan-engine";
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    return (dir / "pipeline_cache.bin").string();
+}
+
 /// Initialise Vulkan.
 void vulkan_init() {
     /// Initialise GLFW.
@@ -132,22 +358,36 @@ void vulkan_fini() {
 ///  Context
 /// ======================================================================
 vk::context::~context() {
+#ifdef ENABLE_VK_CALL_TRACING
+    info("{}", vk_calls::report());
+#endif
+
     for (auto it = cleanup_callbacks.rbegin(); it != cleanup_callbacks.rend(); ++it) (*it)(this);
 
+    cleanup_parallel_recording();
+    vkDeviceWaitIdle(device);
+    flush_deletion_queue(true);
+    capture.reset();
+    readback.reset();
+    gpu_profile.reset();
+    stats.set_pipeline_statistics(false);
+    textures.reset();
+    descriptors.reset();
+
     ImGui_ImplVulkan_Shutdown();
-    ImGui_ImplGlfw_Shutdown();
+    if (!is_headless) ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
     vkDestroyDescriptorPool(device, imgui_descriptor_pool, nullptr);
 
+    save_pipeline_cache();
+    vkDestroyPipelineCache(device, pipeline_cache, nullptr);
+
     cleanup_swap_chain();
     vkDestroyRenderPass(device, render_pass, nullptr);
 
-    for (u64 i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-        vkDestroySemaphore(device, render_finished_semaphores[i], nullptr);
-        vkDestroySemaphore(device, image_available_semaphores[i], nullptr);
-        vkDestroyFence(device, in_flight_fences[i], nullptr);
-    }
-
+    destroy_sync_objects();
+    vkDestroySemaphore(device, frame_timeline, nullptr);
+    vkDestroySemaphore(device, upload_timeline, nullptr);
     vkDestroyCommandPool(device, command_pool, nullptr);
 
     vkDestroyDevice(device, nullptr);
@@ -162,18 +402,20 @@ vk::context::~context() {
     vkDestroySurfaceKHR(instance, surface, nullptr);
     vkDestroyInstance(instance, nullptr);
 
+    /// Headless contexts never touch GLFW.
+    if (is_headless) return;
     glfwDestroyWindow(window);
 
     context_count--;
     if (context_count == 0) vulkan_fini();
 }
 
-vk::context::context(int wd, int ht, std::string_view title) {
-    if (context_count == 0) vulkan_init();
+vk::context::context(int wd, int ht, std::string_view title, u32 features) : requested_features(features) {
+    if (context_count == 0) startup.time("vulkan_init", vulkan_init);
     context_count++;
 
     /// Create the window
-    window = glfwCreateWindow(wd, ht, title.data(), nullptr, nullptr);
+    startup.time("create_window", [&] { window = glfwCreateWindow(wd, ht, title.data(), nullptr, nullptr); });
     if (window == nullptr) {
         const char* err = nullptr;
         glfwGetError(&err);
@@ -185,13 +427,59 @@ vk::context::context(int wd, int ht, std::string_view title) {
     glfwSetFramebufferSizeCallback(window, [](GLFWwindow* w, int, int) {
         auto* ctx = (vk::context*) glfwGetWindowUserPointer(w);
         ctx->resized = true;
+        ctx->request_redraw(input_redraw_frames);
     });
 
     glfwSetKeyCallback(window, [](GLFWwindow* w, int key, int scancode, int action, int mods) {
         auto* ctx = (vk::context*) glfwGetWindowUserPointer(w);
+        ctx->request_redraw(input_redraw_frames);
+#ifdef ENABLE_CPU_PROFILING
+        if (key == ctx->cpu_trace_key && action == GLFW_PRESS && cpu_profiler::write_chrome_trace(ctx->cpu_trace_path, ctx->cpu_trace_frames))
+            info("[Profiler] Wrote CPU trace to \"{}\"", ctx->cpu_trace_path);
+#endif
+        if (key == ctx->capture_key && action == GLFW_PRESS) ctx->capture_frames(ctx->capture_path, ctx->capture_frame_count);
         ctx->on_key_pressed(ctx, key, scancode, action, mods);
     });
 
+    /// Any other input also needs to be drawn in on-demand mode. ImGui installs its
+    /// own callbacks later on, and those call ours.
+    glfwSetCharCallback(window, [](GLFWwindow* w, unsigned) {
+        ((vk::context*) glfwGetWindowUserPointer(w))->request_redraw(input_redraw_frames);
+    });
+
+    glfwSetCursorPosCallback(window, [](GLFWwindow* w, double, double) {
+        ((vk::context*) glfwGetWindowUserPointer(w))->request_redraw(input_redraw_frames);
+    });
+
+    glfwSetMouseButtonCallback(window, [](GLFWwindow* w, int, int, int) {
+        ((vk::context*) glfwGetWindowUserPointer(w))->request_redraw(input_redraw_frames);
+    });
+
+    glfwSetScrollCallback(window, [](GLFWwindow* w, double, double) {
+        ((vk::context*) glfwGetWindowUserPointer(w))->request_redraw(input_redraw_frames);
+    });
+
+    glfwSetWindowRefreshCallback(window, [](GLFWwindow* w) {
+        ((vk::context*) glfwGetWindowUserPointer(w))->request_redraw();
+    });
+
+    startup.time("create_instance", [&] { create_instance(); });
+
+    /// Create the surface.
+    startup.time("create_surface", [&] {
+        assert_success(glfwCreateWindowSurface(instance, window, nullptr, &surface), "failed to create surface");
+    });
+    init_vulkan();
+}
+
+vk::context::context(headless_t, u32 wd, u32 ht, u32 features) : is_headless(true), requested_features(features) {
+    if (wd == 0 || ht == 0) die("[Vulkan] Headless context must not be empty: {}x{}", wd, ht);
+    swap_chain_extent = headless_extent = { wd, ht };
+    startup.time("create_instance", [&] { create_instance(); });
+    init_vulkan();
+}
+
+void vk::context::create_instance() {
     /// Make sure all required layers are available.
 #ifdef ENABLE_VALIDATION_LAYERS
     u32 layer_count = 0;
@@ -219,12 +507,15 @@ vk::context::context(int wd, int ht, std::string_view title) {
     app_info.applicationVersion = VK_MAKE_API_VERSION(1, 0, 0, 0);
     app_info.pEngineName = "No Engine";
     app_info.engineVersion = VK_MAKE_API_VERSION(1, 0, 0, 0);
-    app_info.apiVersion = VK_API_VERSION_1_0;
-
-    /// Determine the extensions we need to enable.
-    u32 exts{};
-    const char** exts_ptr = glfwGetRequiredInstanceExtensions(&exts);
-    std::vector<const char*> extensions(exts_ptr, exts_ptr + exts);
+    app_info.apiVersion = instance_api_version = loader_api_version();
+
+    /// Determine the extensions we need to enable. Without a window, we don't need any.
+    std::vector<const char*> extensions;
+    if (!is_headless) {
+        u32 exts{};
+        const char** exts_ptr = glfwGetRequiredInstanceExtensions(&exts);
+        extensions.assign(exts_ptr, exts_ptr + exts);
+    }
 
     /// Add the validation layers if requested.
 #ifdef ENABLE_VALIDATION_LAYERS
@@ -270,26 +561,32 @@ vk::context::context(int wd, int ht, std::string_view title) {
         assert_success(func(instance, &debug_create_info, nullptr, &debug_messenger), "failed to create debug messenger");
     }
 #endif
+}
 
-    /// Create the surface.
-    assert_success(glfwCreateWindowSurface(instance, window, nullptr, &surface), "failed to create surface");
-
-    /// Window.
-    pick_physical_device();
-    create_logical_device();
-    create_command_pool();
-    create_command_buffers();
-
-    /// Swap chain
-    create_swap_chain();
-    create_image_views();
-    create_render_pass();
-    create_colour_resources();
-    create_depth_resources();
-    create_framebuffers();
-    create_sync_objects();
+void vk::context::init_vulkan() {
+#ifdef ENABLE_CPU_PROFILING
+    cpu_profiler::set_thread_name("Main");
+#endif
 
-    init_imgui();
+    /// Device.
+    startup.time("pick_physical_device", [&] { pick_physical_device(); });
+    startup.time("create_logical_device", [&] { create_logical_device(); });
+    startup.time("create_descriptor_allocator", [&] { descriptors = std::make_unique<descriptor_allocator>(this); });
+    startup.time("create_pipeline_cache", [&] { create_pipeline_cache(); });
+    startup.time("create_command_pool", [&] { create_command_pool(); });
+    startup.time("create_command_buffers", [&] { create_command_buffers(); });
+
+    /// Swap chain, or the offscreen image that takes its place.
+    if (is_headless) startup.time("create_offscreen_target", [&] { create_offscreen_target(); });
+    else startup.time("create_swap_chain", [&] { create_swap_chain(); });
+    startup.time("create_image_views", [&] { create_image_views(); });
+    if (!dynamic_rendering) startup.time("create_render_pass", [&] { create_render_pass(); });
+    startup.time("create_colour_resources", [&] { create_colour_resources(); });
+    startup.time("create_depth_resources", [&] { create_depth_resources(); });
+    if (!dynamic_rendering) startup.time("create_framebuffers", [&] { create_framebuffers(); });
+    startup.time("create_sync_objects", [&] { create_sync_objects(); });
+
+    startup.time("init_imgui", [&] { init_imgui(); });
 }
 
 void vk::context::pick_physical_device() {
@@ -307,6 +604,18 @@ void vk::context::pick_physical_device() {
     if (devices_by_score.rbegin()->first == 0) die("[Vulkan] No suitable devices available");
     physical_device = devices_by_score.rbegin()->second;
     msaa_samples = phys_max_usable_sample_count(physical_device);
+    descriptor_indexing_enabled = (requested_features & CONTEXT_FEATURE_BINDLESS_TEXTURES) && phys_supports_descriptor_indexing(physical_device);
+
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures(physical_device, &features);
+    pipeline_statistics_supported = features.pipelineStatisticsQuery;
+    inherited_queries_supported = features.inheritedQueries;
+    depth_format = find_depth_format();
+
+    /// Use dynamic rendering if we can, unless the user asks for the render pass path.
+    auto* force_render_pass = std::getenv("VULKAN_ENGINE_FORCE_RENDER_PASS");
+    dynamic_rendering = (!force_render_pass || !*force_render_pass) && phys_supports_dynamic_rendering(physical_device, instance_api_version);
+    present_wait_supported = !is_headless && phys_supports_present_wait(physical_device);
 }
 
 void vk::context::create_logical_device() {
@@ -328,15 +637,67 @@ void vk::context::create_logical_device() {
     VkPhysicalDeviceFeatures device_features{};
     device_features.samplerAnisotropy = VK_TRUE;
     device_features.sampleRateShading = VK_TRUE;
+    device_features.pipelineStatisticsQuery = pipeline_statistics_supported;
+    device_features.inheritedQueries = inherited_queries_supported;
+
+    /// Descriptor indexing is only needed for bindless textures, so we
+    /// don't ask for it unless the user requested them.
+    VkPhysicalDeviceDescriptorIndexingFeatures indexing_features{};
+    indexing_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+    indexing_features.runtimeDescriptorArray = VK_TRUE;
+    indexing_features.descriptorBindingPartiallyBound = VK_TRUE;
+    indexing_features.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+    indexing_features.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+
+    /// Frames are synchronised using a timeline semaphore.
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features{};
+    timeline_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+    timeline_features.pNext = descriptor_indexing_enabled ? &indexing_features : nullptr;
+    timeline_features.timelineSemaphore = VK_TRUE;
+
+    VkPhysicalDeviceFeatures2 features{};
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &timeline_features;
+    features.features = device_features;
+
+    /// Dynamic rendering is core in 1.3; before that, we need the extension.
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(physical_device, &props);
+    auto extensions = is_headless ? std::vector<const char*>{} : required_device_extensions;
+    bool dynamic_rendering_is_core = std::min(props.apiVersion, instance_api_version) >= VK_API_VERSION_1_3;
+    if (dynamic_rendering && !dynamic_rendering_is_core) extensions.push_back(VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME);
+
+    VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamic_rendering_features{};
+    dynamic_rendering_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+    dynamic_rendering_features.pNext = features.pNext;
+    dynamic_rendering_features.dynamicRendering = VK_TRUE;
+    if (dynamic_rendering) features.pNext = &dynamic_rendering_features;
+
+    /// Present wait is optional and only used for frame pacing.
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features{};
+    present_wait_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    present_wait_features.pNext = features.pNext;
+    present_wait_features.presentWait = VK_TRUE;
+
+    VkPhysicalDevicePresentIdFeaturesKHR present_id_features{};
+    present_id_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    present_id_features.pNext = &present_wait_features;
+    present_id_features.presentId = VK_TRUE;
+
+    if (present_wait_supported) {
+        features.pNext = &present_id_features;
+        extensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+        extensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+    }
 
     /// Create the logical device.
     VkDeviceCreateInfo create_info_device{};
     create_info_device.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    create_info_device.pNext = &features;
     create_info_device.pQueueCreateInfos = queue_create_infos.data();
     create_info_device.queueCreateInfoCount = u32(queue_create_infos.size());
-    create_info_device.pEnabledFeatures = &device_features;
-    create_info_device.enabledExtensionCount = u32(required_device_extensions.size());
-    create_info_device.ppEnabledExtensionNames = required_device_extensions.data();
+    create_info_device.enabledExtensionCount = u32(extensions.size());
+    create_info_device.ppEnabledExtensionNames = extensions.data();
 #ifdef ENABLE_VALIDATION_LAYERS
     create_info_device.enabledLayerCount = u32(validation_layers.size());
     create_info_device.ppEnabledLayerNames = validation_layers.data();
@@ -346,6 +707,18 @@ void vk::context::create_logical_device() {
     /// Get the queues.
     vkGetDeviceQueue(device, indices.graphics_family.value(), 0, &graphics_queue);
     vkGetDeviceQueue(device, indices.present_family.value(), 0, &present_queue);
+
+    /// Load the dynamic rendering entry points.
+    if (dynamic_rendering) {
+        cmd_begin_rendering = (PFN_vkCmdBeginRenderingKHR) vkGetDeviceProcAddr(device, dynamic_rendering_is_core ? "vkCmdBeginRendering" : "vkCmdBeginRenderingKHR");
+        cmd_end_rendering = (PFN_vkCmdEndRenderingKHR) vkGetDeviceProcAddr(device, dynamic_rendering_is_core ? "vkCmdEndRendering" : "vkCmdEndRenderingKHR");
+        if (!cmd_begin_rendering || !cmd_end_rendering) die("[Vulkan] Failed to load dynamic rendering entry points");
+    }
+
+    if (present_wait_supported) {
+        wait_for_present = (PFN_vkWaitForPresentKHR) vkGetDeviceProcAddr(device, "vkWaitForPresentKHR");
+        if (!wait_for_present) present_wait_supported = false;
+    }
 }
 
 void vk::context::create_swap_chain() {
@@ -357,7 +730,10 @@ void vk::context::create_swap_chain() {
 
     /// Determine the number of images in the swap chain.
     /// Make sure not to exceeed the maximum number of images.
-    u32 image_count = swap_chain_support.capabilities.minImageCount + 1;
+    /// Use the requested number if there is one, but don't go below the minimum.
+    u32 image_count = swap_chain_image_count
+                        ? std::max(swap_chain_image_count, swap_chain_support.capabilities.minImageCount)
+                        : swap_chain_support.capabilities.minImageCount + 1;
     if (swap_chain_support.capabilities.maxImageCount > 0 && image_count > swap_chain_support.capabilities.maxImageCount)
         image_count = swap_chain_support.capabilities.maxImageCount;
 
@@ -372,6 +748,10 @@ void vk::context::create_swap_chain() {
     create_info_swap_chain.imageArrayLayers = 1;
     create_info_swap_chain.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
 
+    /// Allow copying from the images for readback if we can.
+    swap_chain_readable = swap_chain_support.capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    if (swap_chain_readable) create_info_swap_chain.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+
     /// If the graphics and present queues are different, we need to specify the sharing mode.
     auto indices = find_queue_families(physical_device);
     u32 queue_families[] = { indices.graphics_family.value(), indices.present_family.value() };
@@ -391,8 +771,9 @@ void vk::context::create_swap_chain() {
     create_info_swap_chain.presentMode = present_mode;
     create_info_swap_chain.clipped = VK_TRUE;
 
-    /// There is no old swap chain.
-    create_info_swap_chain.oldSwapchain = VK_NULL_HANDLE;
+    /// Hand over the old swap chain, if any, so the driver can reuse its resources
+    /// and we can keep presenting without waiting for the device to go idle.
+    create_info_swap_chain.oldSwapchain = swap_chain;
 
     /// Finally, create the swap chain.
     assert_success(vkCreateSwapchainKHR(device, &create_info_swap_chain, nullptr, &swap_chain), "failed to create swap chain");
@@ -407,6 +788,19 @@ void vk::context::create_swap_chain() {
     swap_chain_image_format = surface_format.format;
 }
 
+void vk::context::create_offscreen_target() {
+    /// This is one of the formats that every implementation must support as a colour
+    /// attachment, and its byte order is what image writers generally expect.
+    swap_chain_image_format = VK_FORMAT_R8G8B8A8_SRGB;
+
+    VkImage image;
+    create_image(swap_chain_extent.width, swap_chain_extent.height, 1, VK_SAMPLE_COUNT_1_BIT, swap_chain_image_format,
+        VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, offscreen_image_memory);
+    swap_chain_images = { image };
+    swap_chain_readable = true;
+}
+
 void vk::context::create_image_views() {
     swap_chain_image_views.resize(swap_chain_images.size());
 
@@ -428,7 +822,7 @@ void vk::context::create_render_pass() {
 
     /// Depth attachment.
     VkAttachmentDescription depth_attachment{};
-    depth_attachment.format = find_depth_format();
+    depth_attachment.format = depth_format;
     depth_attachment.samples = msaa_samples;
     depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
     depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
@@ -446,7 +840,7 @@ void vk::context::create_render_pass() {
     resolve_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     resolve_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     resolve_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    resolve_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    resolve_attachment.finalLayout = present_layout();
 
     /// Attachment references.
     VkAttachmentReference color_attachment_ref{};
@@ -469,11 +863,14 @@ void vk::context::create_render_pass() {
     subpass.pDepthStencilAttachment = &depth_attachment_ref;
     subpass.pResolveAttachments = &resolve_attachment_ref;
 
-    /// Subpass dependencies.
+    /// Subpass dependencies. The previous frame may still be copying the image
+    /// (in headless mode or for readback), which has to finish before we overwrite
+    /// it. Readback can be enabled after the render pass is created, so always
+    /// include the transfer stage; it costs nothing if there are no copies.
     VkSubpassDependency dependency{};
     dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
     dependency.dstSubpass = 0;
-    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
     dependency.srcAccessMask = 0;
     dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
     dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
@@ -516,6 +913,7 @@ void vk::context::create_command_pool() {
     pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
     pool_info.queueFamilyIndex = indices.graphics_family.value();
     assert_success(vkCreateCommandPool(device, &pool_info, nullptr, &command_pool), "failed to create command pool");
+    upload_timeline = create_timeline_semaphore(device);
 }
 
 void vk::context::create_colour_resources() {
@@ -526,7 +924,6 @@ void vk::context::create_colour_resources() {
 }
 
 void vk::context::create_depth_resources() {
-    auto depth_format = find_depth_format();
     create_image(swap_chain_extent.width, swap_chain_extent.height, 1, msaa_samples, depth_format, VK_IMAGE_TILING_OPTIMAL,
         VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
         depth_image, depth_image_memory);
@@ -534,7 +931,7 @@ void vk::context::create_depth_resources() {
 }
 
 void vk::context::create_command_buffers() {
-    command_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    command_buffers.resize(frames_in_flight);
 
     VkCommandBufferAllocateInfo alloc_info{};
     alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -545,22 +942,51 @@ void vk::context::create_command_buffers() {
 }
 
 void vk::context::create_sync_objects() {
-    image_available_semaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    render_finished_semaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    in_flight_fences.resize(MAX_FRAMES_IN_FLIGHT);
+    image_available_semaphores.resize(frames_in_flight);
+    render_finished_semaphores.resize(frames_in_flight);
 
     VkSemaphoreCreateInfo semaphore_info{};
     semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-    VkFenceCreateInfo fence_info{};
-    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT; /// We want to start with a fence in the signaled state.
-
-    for (u64 i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    for (u64 i = 0; i < frames_in_flight; i++) {
         assert_success(vkCreateSemaphore(device, &semaphore_info, nullptr, &image_available_semaphores[i]), "failed to create semaphore");
         assert_success(vkCreateSemaphore(device, &semaphore_info, nullptr, &render_finished_semaphores[i]), "failed to create semaphore");
-        assert_success(vkCreateFence(device, &fence_info, nullptr, &in_flight_fences[i]), "failed to create fence");
     }
+
+    /// The timeline outlives changes to the number of frames in flight
+    /// since its value has to keep increasing.
+    if (frame_timeline == VK_NULL_HANDLE) frame_timeline = create_timeline_semaphore(device);
+}
+
+void vk::context::create_pipeline_cache() {
+    pipeline_cache_path = default_pipeline_cache_path();
+
+    /// Load the cache from disk, but only if it was created for this exact device and driver.
+    std::vector<char> data;
+    if (!pipeline_cache_path.empty() && std::filesystem::exists(pipeline_cache_path)) {
+        auto file = map_file(pipeline_cache_path);
+        auto expected = make_pipeline_cache_header(physical_device);
+
+        pipeline_cache_header header{};
+        if (file.size() >= sizeof header) std::memcpy(&header, file.data(), sizeof header);
+        const char* cache_data = file.data() + sizeof header;
+        u64 cache_size = file.size() >= sizeof header ? file.size() - sizeof header : 0;
+
+        if (file.size() < sizeof header
+            || std::memcmp(&header, &expected, offsetof(pipeline_cache_header, data_size)) != 0
+            || header.data_size != cache_size
+            || header.checksum != checksum(cache_data, cache_size)) {
+            info("[Vulkan] Ignoring pipeline cache \"{}\" since it is stale or corrupt", pipeline_cache_path);
+        } else {
+            data.assign(cache_data, cache_data + cache_size);
+        }
+    }
+
+    VkPipelineCacheCreateInfo create_info{};
+    create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    create_info.initialDataSize = data.size();
+    create_info.pInitialData = data.empty() ? nullptr : data.data();
+    assert_success(vkCreatePipelineCache(device, &create_info, nullptr, &pipeline_cache), "failed to create pipeline cache");
 }
 
 void vk::context::init_imgui() {
@@ -591,7 +1017,7 @@ void vk::context::init_imgui() {
     ImGui::CreateContext();
     ImGui::StyleColorsDark();
 
-    ImGui_ImplGlfw_InitForVulkan(window, true);
+    if (!is_headless) ImGui_ImplGlfw_InitForVulkan(window, true);
     ImGui_ImplVulkan_InitInfo init_info = {};
     init_info.Instance = instance;
     init_info.PhysicalDevice = physical_device;
@@ -601,22 +1027,79 @@ void vk::context::init_imgui() {
     init_info.QueueFamily = indices.graphics_family.value();
     init_info.Queue = graphics_queue;
 
-    init_info.PipelineCache = VK_NULL_HANDLE;
+    init_info.PipelineCache = pipeline_cache;
     init_info.DescriptorPool = imgui_descriptor_pool;
     init_info.Subpass = 0;
-    init_info.MinImageCount = MAX_FRAMES_IN_FLIGHT;
+
+    /// ImGui keeps one set of buffers per 'image'; allocate enough for the
+    /// largest number of frames in flight so we can change it at any time.
+    init_info.MinImageCount = 2;
     init_info.ImageCount = MAX_FRAMES_IN_FLIGHT;
-    init_info.MSAASamples = msaa_samples;
+    init_info.MSAASamples = dynamic_rendering ? VK_SAMPLE_COUNT_1_BIT : msaa_samples;
     init_info.Allocator = VK_NULL_HANDLE;
     init_info.CheckVkResultFn = [](VkResult err) {
         if (err != VK_SUCCESS) {
-            fmt::print(stderr, "[ImGui] Vulkan Error: {}\n", err);
-            std::exit(1);
+            die("[ImGui] Vulkan Error: {}", i32(err));
         }
     };
+
+    /// With dynamic rendering, the UI is drawn in a render pass instance of its own
+    /// that only has the resolved, single-sampled image; see begin_overlay().
+    init_info.UseDynamicRendering = dynamic_rendering;
+    init_info.ColorAttachmentFormat = swap_chain_image_format;
     ImGui_ImplVulkan_Init(&init_info, render_pass);
 }
 
+auto vk::context::begin_secondary_command_buffer(secondary_command_pool& pool) -> VkCommandBuffer {
+    /// Allocate a new buffer if we've used up all the ones we have.
+    if (pool.used == pool.buffers.size()) {
+        VkCommandBufferAllocateInfo alloc_info{};
+        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        alloc_info.commandPool = pool.pool;
+        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        alloc_info.commandBufferCount = 1;
+
+        VkCommandBuffer command_buffer;
+        assert_success(vkAllocateCommandBuffers(device, &alloc_info, &command_buffer), "failed to allocate secondary command buffer");
+        pool.buffers.push_back(command_buffer);
+    }
+
+    auto command_buffer = pool.buffers[pool.used++];
+
+    /// Secondary command buffers continue the render pass of the primary one.
+    VkCommandBufferInheritanceInfo inheritance_info{};
+    inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance_info.subpass = 0;
+
+    /// Secondary command buffers must inherit the pipeline statistics query, if any.
+    if (stats.query_active) inheritance_info.pipelineStatistics = render_stats::query_flags;
+
+    /// With dynamic rendering, they are described by their attachment formats instead.
+    VkCommandBufferInheritanceRenderingInfoKHR inheritance_rendering_info{};
+    if (dynamic_rendering) {
+        inheritance_rendering_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO_KHR;
+        inheritance_rendering_info.colorAttachmentCount = 1;
+        inheritance_rendering_info.pColorAttachmentFormats = &swap_chain_image_format;
+        inheritance_rendering_info.depthAttachmentFormat = depth_format;
+        inheritance_rendering_info.rasterizationSamples = msaa_samples;
+        inheritance_info.pNext = &inheritance_rendering_info;
+    } else {
+        inheritance_info.renderPass = render_pass;
+        inheritance_info.framebuffer = swap_chain_framebuffers[current_image_index];
+    }
+
+    VkCommandBufferBeginInfo begin_info{};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    begin_info.pInheritanceInfo = &inheritance_info;
+    assert_success(vkBeginCommandBuffer(command_buffer, &begin_info), "failed to begin secondary command buffer");
+
+    /// Dynamic state is not inherited.
+    set_viewport_and_scissor(command_buffer);
+    bound_pipeline = VK_NULL_HANDLE;
+    return command_buffer;
+}
+
 auto vk::context::begin_single_time_commands() -> VkCommandBuffer {
     VkCommandBufferAllocateInfo alloc_info{};
     alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -635,6 +1118,22 @@ auto vk::context::begin_single_time_commands() -> VkCommandBuffer {
     return command_buffer;
 }
 
+void vk::context::cleanup_parallel_recording() {
+    if (!recording_threads) return;
+    vkDeviceWaitIdle(device);
+
+    /// Join the workers before destroying the pools they record into.
+    recording_threads.reset();
+    for (auto& pools : worker_command_pools)
+        for (auto& p : pools) vkDestroyCommandPool(device, p.pool, nullptr);
+    for (auto& p : main_command_pools) vkDestroyCommandPool(device, p.pool, nullptr);
+
+    worker_command_pools.clear();
+    main_command_pools.clear();
+    pending_secondary_command_buffers.clear();
+    main_secondary_command_buffer = VK_NULL_HANDLE;
+}
+
 void vk::context::cleanup_swap_chain() {
     vkDestroyImageView(device, colour_image_view, nullptr);
     vkDestroyImage(device, colour_image, nullptr);
@@ -647,7 +1146,13 @@ void vk::context::cleanup_swap_chain() {
     for (auto* framebuffer : swap_chain_framebuffers) vkDestroyFramebuffer(device, framebuffer, nullptr);
     for (auto* image_view : swap_chain_image_views) vkDestroyImageView(device, image_view, nullptr);
 
-    vkDestroySwapchainKHR(device, swap_chain, nullptr);
+    /// The offscreen image is ours, unlike the swap chain images.
+    if (is_headless) {
+        vkDestroyImage(device, swap_chain_images.front(), nullptr);
+        vkFreeMemory(device, offscreen_image_memory, nullptr);
+    } else {
+        vkDestroySwapchainKHR(device, swap_chain, nullptr);
+    }
 }
 
 void vk::context::copy_buffer(VkBuffer dest, VkBuffer src, VkDeviceSize size) {
@@ -658,6 +1163,10 @@ void vk::context::copy_buffer(VkBuffer dest, VkBuffer src, VkDeviceSize size) {
     vkCmdCopyBuffer(command_buffer, src, dest, 1, &copy_region);
 
     end_single_time_commands(command_buffer);
+    stats.upload(size);
+
+    /// Make sure the new data shows up in on-demand mode.
+    request_redraw();
 }
 
 void vk::context::copy_buffer_to_image(VkImage image, VkBuffer buffer, u32 width, u32 height) {
@@ -676,6 +1185,9 @@ void vk::context::copy_buffer_to_image(VkImage image, VkBuffer buffer, u32 width
 
     vkCmdCopyBufferToImage(command_buffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
     end_single_time_commands(command_buffer);
+
+    /// Textures are always RGBA8.
+    stats.upload(u64(width) * height * 4);
 }
 
 void vk::context::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
@@ -749,46 +1261,162 @@ auto vk::context::create_image_view(VkImage image, VkFormat format, VkImageAspec
     return image_view;
 }
 
+void vk::context::destroy_sync_objects() {
+    for (u64 i = 0; i < image_available_semaphores.size(); i++) {
+        vkDestroySemaphore(device, render_finished_semaphores[i], nullptr);
+        vkDestroySemaphore(device, image_available_semaphores[i], nullptr);
+    }
+
+    render_finished_semaphores.clear();
+    image_available_semaphores.clear();
+}
+
 void vk::context::draw_frame(const render_callback& tick) {
-    /// Wait for the previous frame to finish.
-    vkWaitForFences(device, 1, &in_flight_fences[current_frame], VK_TRUE, UINT64_MAX);
+    CPU_FRAME_MARK();
+    CPU_ZONE("draw_frame");
+
+    /// Wait for the frame that last used this slot to finish. That's not part of
+    /// the CPU time of the frame.
+    wait_for_slot();
+    auto cpu_start = std::chrono::steady_clock::now();
+    auto ended = [&, frame = frame_number] {
+        stats.end_present();
+        monitor.end_frame(frame, std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - cpu_start).count());
+        if (!startup.finished()) {
+            startup.finish();
+
+            /// Only count the calls of the frames after startup.
+#ifdef ENABLE_VK_CALL_TRACING
+            vk_calls::reset();
+#endif
+        }
+
+        VK_CALL_FRAME_MARK();
+        if (capture) {
+            capture->end_frame();
+            if (capture->done()) capture.reset();
+        }
+    };
+
+    /// Hand out any frames whose copies have finished by now.
+    if (readback) readback->collect();
+
+    /// Headless contexts are resized between frames; see resize().
+    if (is_headless && resized) {
+        resized = false;
+        recreate_swap_chain();
+    }
 
-    /// Acquire an image from the swap chain.
-    u32 image_index;
-    auto res = vkAcquireNextImageKHR(device, swap_chain, UINT64_MAX, image_available_semaphores[current_frame], VK_NULL_HANDLE, &image_index);
+    /// Acquire an image from the swap chain. Headless contexts only have the one image.
+    auto res = VK_SUCCESS;
+    if (!is_headless) res = vkAcquireNextImageKHR(device, swap_chain, UINT64_MAX, image_available_semaphores[current_frame], VK_NULL_HANDLE, &current_image_index);
 
     /// If the swap chain is out of date, recreate it.
     if (res == VK_ERROR_OUT_OF_DATE_KHR) {
         recreate_swap_chain();
+        ended();
         return;
     } else if (res != VK_SUBOPTIMAL_KHR) assert_success(res);
 
-    /// Reset the fence if we are submitting work.
-    vkResetFences(device, 1, &in_flight_fences[current_frame]);
+    flush_deletion_queue();
+    descriptors->reset_transient(current_frame);
 
     /// Record the command buffer.
-    vkResetCommandBuffer(command_buffers[current_frame], 0);
-    begin_recording_command_buffer(command_buffers[current_frame], image_index);
-    ImGui_Begin();
-    tick(command_buffers[current_frame]);
-    ImGui_End(command_buffers[current_frame]);
-    end_recording_command_buffer(command_buffers[current_frame]);
+    auto command_buffer = command_buffers[current_frame];
+    vkResetCommandBuffer(command_buffer, 0);
+    if (capture) capture->begin_frame();
+    begin_recording_command_buffer(command_buffer, current_image_index);
+    bool ui_recorded = false;
+    if (recording_threads) {
+        /// The GPU is done with this frame's secondary command buffers, so we can reuse them.
+        for (auto& p : worker_command_pools[current_frame]) {
+            vkResetCommandPool(device, p.pool, 0);
+            p.used = 0;
+        }
+
+        auto& main_pool = main_command_pools[current_frame];
+        vkResetCommandPool(device, main_pool.pool, 0);
+        main_pool.used = 0;
+
+        /// Everything the main thread records goes into a secondary command
+        /// buffer too since we can't mix those with inline commands.
+        /// record_parallel() may swap this out for a new one, so don't hold on to it.
+        main_secondary_command_buffer = begin_secondary_command_buffer(main_pool);
+        ImGui_Begin();
+        {
+            CPU_ZONE("tick");
+            tick(main_secondary_command_buffer);
+        }
+
+        /// The UI has its own render pass instance with dynamic rendering; otherwise
+        /// we can't record anything inline anymore, so it has to go here too.
+        auto secondary = main_secondary_command_buffer;
+        if (!dynamic_rendering) {
+            gpu_scope scope{ this, secondary, "ImGui" };
+            ImGui_End(secondary);
+            ui_recorded = true;
+        }
+
+        assert_success(vkEndCommandBuffer(secondary), "failed to record secondary command buffer");
+        main_secondary_command_buffer = VK_NULL_HANDLE;
+
+        pending_secondary_command_buffers.push_back(secondary);
+        vkCmdExecuteCommands(command_buffer, u32(pending_secondary_command_buffers.size()), pending_secondary_command_buffers.data());
+        pending_secondary_command_buffers.clear();
+    } else {
+        ImGui_Begin();
+        CPU_ZONE("tick");
+        tick(command_buffer);
+    }
+
+    /// Draw the UI on top of everything else.
+    if (!ui_recorded) {
+        begin_overlay(command_buffer);
+        gpu_scope scope{ this, command_buffer, "ImGui" };
+        ImGui_End(command_buffer);
+    }
+    end_recording_command_buffer(command_buffer);
 
     /// Submit the command buffer.
+    /// Frame N signals N + 1 on the timeline, so that 0 means 'nothing has completed yet'.
+    /// Headless contexts have nothing to acquire or present, so they only signal the timeline.
     VkSemaphore wait_semaphores[] = { image_available_semaphores[current_frame] };
-    VkSemaphore signal_semaphores[] = { render_finished_semaphores[current_frame] };
+    VkSemaphore signal_semaphores[] = { render_finished_semaphores[current_frame], frame_timeline };
     VkPipelineStageFlags wait_stages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
+    u64 wait_values[] = { 0 };
+    u64 signal_values[] = { 0, frame_number + 1 };
+    u32 first_signal = is_headless ? 1 : 0;
+
+    VkTimelineSemaphoreSubmitInfo timeline_submit_info{};
+    timeline_submit_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_submit_info.waitSemaphoreValueCount = is_headless ? 0 : 1;
+    timeline_submit_info.pWaitSemaphoreValues = wait_values;
+    timeline_submit_info.signalSemaphoreValueCount = 2 - first_signal;
+    timeline_submit_info.pSignalSemaphoreValues = signal_values + first_signal;
 
     VkSubmitInfo submit_info{};
     submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit_info.waitSemaphoreCount = 1;
+    submit_info.pNext = &timeline_submit_info;
+    submit_info.waitSemaphoreCount = is_headless ? 0 : 1;
     submit_info.pWaitSemaphores = wait_semaphores;
     submit_info.pWaitDstStageMask = wait_stages;
     submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &command_buffers[current_frame];
-    submit_info.signalSemaphoreCount = 1;
-    submit_info.pSignalSemaphores = signal_semaphores;
-    assert_success(vkQueueSubmit(graphics_queue, 1, &submit_info, in_flight_fences[current_frame]), "failed to submit command buffer");
+    submit_info.pCommandBuffers = &command_buffer;
+    submit_info.signalSemaphoreCount = 2 - first_signal;
+    submit_info.pSignalSemaphores = signal_semaphores + first_signal;
+    {
+        CPU_ZONE("submit");
+        assert_success(vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE), "failed to submit command buffer");
+    }
+
+    if (is_headless) {
+        pacer.on_present(frame_pacer::clock::now());
+        ended();
+        current_frame = (current_frame + 1) % frames_in_flight;
+        frame_number++;
+        bound_pipeline = VK_NULL_HANDLE;
+        return;
+    }
 
     /// Present the image to the swap chain.
     VkPresentInfoKHR present_info{};
@@ -799,9 +1427,24 @@ void vk::context::draw_frame(const render_callback& tick) {
     VkSwapchainKHR swap_chains[] = { swap_chain };
     present_info.swapchainCount = 1;
     present_info.pSwapchains = swap_chains;
-    present_info.pImageIndices = &image_index;
+    present_info.pImageIndices = &current_image_index;
 
-    res = vkQueuePresentKHR(present_queue, &present_info);
+    /// Tag the present so the pacer can wait for it to reach the screen.
+    u64 present_id = frame_number + 1;
+    VkPresentIdKHR present_id_info{};
+    present_id_info.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+    present_id_info.swapchainCount = 1;
+    present_id_info.pPresentIds = &present_id;
+    if (present_wait_supported) present_info.pNext = &present_id_info;
+
+    {
+        CPU_ZONE("present");
+        res = vkQueuePresentKHR(present_queue, &present_info);
+    }
+    last_present_id = present_id;
+
+    /// Without present wait, returning from vkQueuePresentKHR is the best we've got.
+    if (!present_wait_supported || !pacer.enabled()) pacer.on_present(frame_pacer::clock::now());
 
     /// If the swap chain is out of date, recreate it.
     if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR || resized) {
@@ -809,20 +1452,38 @@ void vk::context::draw_frame(const render_callback& tick) {
         recreate_swap_chain();
     } else assert_success(res);
 
-    current_frame = (current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
+    ended();
+    current_frame = (current_frame + 1) % frames_in_flight;
+    frame_number++;
     bound_pipeline = VK_NULL_HANDLE;
 }
 
 void vk::context::end_single_time_commands(VkCommandBuffer command_buffer) {
     vkEndCommandBuffer(command_buffer);
 
+    /// Only wait for this submission; waiting for the queue to go idle would
+    /// also wait for every frame that is still in flight.
+    u64 value = ++upload_count;
+    VkTimelineSemaphoreSubmitInfo timeline_submit_info{};
+    timeline_submit_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_submit_info.signalSemaphoreValueCount = 1;
+    timeline_submit_info.pSignalSemaphoreValues = &value;
+
     VkSubmitInfo submit_info{};
     submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_submit_info;
     submit_info.commandBufferCount = 1;
     submit_info.pCommandBuffers = &command_buffer;
-
-    vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE);
-    vkQueueWaitIdle(graphics_queue);
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &upload_timeline;
+    assert_success(vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE), "failed to submit upload");
+
+    VkSemaphoreWaitInfo wait_info{};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &upload_timeline;
+    wait_info.pValues = &value;
+    assert_success(vkWaitSemaphores(device, &wait_info, UINT64_MAX), "failed to wait for upload");
     vkFreeCommandBuffers(device, command_pool, 1, &command_buffer);
 }
 
@@ -862,6 +1523,13 @@ auto vk::context::find_queue_families(VkPhysicalDevice dev) -> queue_family_indi
         /// Check if the queue family supports graphics.
         if (queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) indices.graphics_family = i;
 
+        /// Without a surface, the graphics queue doubles as the 'present' queue.
+        if (is_headless) {
+            indices.present_family = indices.graphics_family;
+            if (indices.is_complete()) break;
+            continue;
+        }
+
         /// Check if the queue family supports presentation.
         VkBool32 present_support = false;
         vkGetPhysicalDeviceSurfaceSupportKHR(dev, i, surface, &present_support);
@@ -887,6 +1555,16 @@ auto vk::context::find_supported_format(const std::vector<VkFormat>& candidates,
     die("[Vulkan] Failed to find supported format");
 }
 
+void vk::context::flush_deletion_queue(bool all) {
+    std::unique_lock lock{ deletion_queue_mutex };
+    auto completed = completed_frames();
+    std::erase_if(deletion_queue, [&](deferred_deletion& d) {
+        if (!all && d.frame >= completed) return false;
+        d.destroy();
+        return true;
+    });
+}
+
 void vk::context::generate_mipmaps(VkImage image, VkFormat image_format, u32 wd, u32 ht, u32 mip_lvls) {
     VkFormatProperties format_props;
     vkGetPhysicalDeviceFormatProperties(physical_device, image_format, &format_props);
@@ -990,16 +1668,20 @@ u64 vk::context::phys_dev_score(VkPhysicalDevice dev) {
     vkEnumerateDeviceExtensionProperties(dev, nullptr, &extension_count, available_extensions.data());
 
     /// If the device doesn't have all the required extensions, it's not suitable.
-    std::set<std::string> required_extensions(required_device_extensions.begin(), required_device_extensions.end());
-    for (auto& ext : available_extensions) required_extensions.erase(ext.extensionName);
-    if (!required_extensions.empty()) return 0;
-
-    /// Make sure the device supports a swap chain that is compatible with the surface.
-    auto swap_chain_support = query_swap_chain_support(dev);
-    if (swap_chain_support.formats.empty() || swap_chain_support.present_modes.empty()) return 0;
+    /// Headless contexts don't need a swap chain, so they don't need any.
+    if (!is_headless) {
+        std::set<std::string> required_extensions(required_device_extensions.begin(), required_device_extensions.end());
+        for (auto& ext : available_extensions) required_extensions.erase(ext.extensionName);
+        if (!required_extensions.empty()) return 0;
+
+        /// Make sure the device supports a swap chain that is compatible with the surface.
+        auto swap_chain_support = query_swap_chain_support(dev);
+        if (swap_chain_support.formats.empty() || swap_chain_support.present_modes.empty()) return 0;
+    }
 
     /// The device has to support the required features.
     if (!features.samplerAnisotropy) return 0;
+    if (!phys_supports_timeline_semaphores(dev)) return 0;
 
     /// Compute a score for this device.
     u64 score = 0;
@@ -1028,6 +1710,10 @@ u64 vk::context::phys_dev_score(VkPhysicalDevice dev) {
     return score;
 }
 
+auto vk::context::present_layout() const -> VkImageLayout {
+    return is_headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+}
+
 auto vk::context::query_swap_chain_support(VkPhysicalDevice device) -> swap_chain_support_details {
     swap_chain_support_details details{};
 
@@ -1058,6 +1744,14 @@ void vk::context::begin_recording_command_buffer(VkCommandBuffer command_buffer,
     VkCommandBufferBeginInfo begin_info{};
     begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     assert_success(vkBeginCommandBuffer(command_buffer, &begin_info));
+    if (gpu_profile) gpu_profile->begin_frame(command_buffer);
+    stats.begin_frame(command_buffer);
+
+    if (dynamic_rendering) {
+        begin_dynamic_rendering(command_buffer, img_index);
+        if (!recording_threads) set_viewport_and_scissor(command_buffer);
+        return;
+    }
 
     /// Start a render pass.
     VkRenderPassBeginInfo render_pass_begin_info{};
@@ -1074,8 +1768,119 @@ void vk::context::begin_recording_command_buffer(VkCommandBuffer command_buffer,
     render_pass_begin_info.clearValueCount = sizeof clear_values / sizeof *clear_values;
     render_pass_begin_info.pClearValues = clear_values;
 
+    /// When recording in parallel, the render pass only executes secondary command buffers.
+    if (recording_threads) {
+        vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        return;
+    }
+
     vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+    set_viewport_and_scissor(command_buffer);
+}
+
+void vk::context::begin_dynamic_rendering(VkCommandBuffer command_buffer, u32 img_index) {
+    /// None of the attachments need their previous contents. The previous frame
+    /// may still be copying from the final image though, if we're headless or
+    /// reading frames back, so wait for that before writing to it.
+    auto depth_aspect = VkImageAspectFlags(VK_IMAGE_ASPECT_DEPTH_BIT | (has_stencil_component(depth_format) ? VK_IMAGE_ASPECT_STENCIL_BIT : 0));
+    auto final_src_stage = VkPipelineStageFlags(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | (is_headless || readback ? VK_PIPELINE_STAGE_TRANSFER_BIT : 0));
+    attachment_barrier(command_buffer, swap_chain_images[img_index], VK_IMAGE_ASPECT_COLOR_BIT,
+        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        final_src_stage, 0,
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+    attachment_barrier(command_buffer, colour_image, VK_IMAGE_ASPECT_COLOR_BIT,
+        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0,
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+    attachment_barrier(command_buffer, depth_image, depth_aspect,
+        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, 0,
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT);
+
+    /// The scene is resolved into the swap chain image at the end of the pass and
+    /// the UI is drawn on top of that, so the multisampled image is never stored.
+    VkRenderingAttachmentInfoKHR colour_attachment{};
+    colour_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+    colour_attachment.imageView = colour_image_view;
+    colour_attachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    colour_attachment.resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT;
+    colour_attachment.resolveImageView = swap_chain_image_views[img_index];
+    colour_attachment.resolveImageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    colour_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    colour_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    colour_attachment.clearValue.color = { { 0.018f, 0.016f, 0.018f, 1.0f } };
+
+    VkRenderingAttachmentInfoKHR depth_attachment{};
+    depth_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+    depth_attachment.imageView = depth_image_view;
+    depth_attachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.clearValue.depthStencil = { 1.0f, 0 };
+
+    VkRenderingInfoKHR rendering_info{};
+    rendering_info.sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR;
+    rendering_info.renderArea = { { 0, 0 }, swap_chain_extent };
+    rendering_info.layerCount = 1;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachments = &colour_attachment;
+    rendering_info.pDepthAttachment = &depth_attachment;
+
+    /// When recording in parallel, the scene only executes secondary command buffers.
+    if (recording_threads) rendering_info.flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT_KHR;
+    cmd_begin_rendering(command_buffer, &rendering_info);
+}
 
+void vk::context::begin_overlay(VkCommandBuffer command_buffer) {
+    /// With a render pass, the UI is simply drawn after the scene.
+    if (!dynamic_rendering) return;
+    cmd_end_rendering(command_buffer);
+
+    /// Wait for the scene to be resolved before drawing on top of it.
+    attachment_barrier(command_buffer, swap_chain_images[current_image_index], VK_IMAGE_ASPECT_COLOR_BIT,
+        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+
+    /// Draw the UI directly into the resolved image. This only loads and stores
+    /// a single-sampled image instead of the multisampled one.
+    VkRenderingAttachmentInfoKHR colour_attachment{};
+    colour_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+    colour_attachment.imageView = swap_chain_image_views[current_image_index];
+    colour_attachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    colour_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    colour_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+
+    VkRenderingInfoKHR rendering_info{};
+    rendering_info.sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR;
+    rendering_info.renderArea = { { 0, 0 }, swap_chain_extent };
+    rendering_info.layerCount = 1;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachments = &colour_attachment;
+    cmd_begin_rendering(command_buffer, &rendering_info);
+    set_viewport_and_scissor(command_buffer);
+}
+
+void vk::context::save_pipeline_cache() {
+    if (pipeline_cache_path.empty()) return;
+
+    /// Get the cache data and put our header in front of it.
+    size_t size = 0;
+    assert_success(vkGetPipelineCacheData(device, pipeline_cache, &size, nullptr), "failed to get pipeline cache size");
+    std::vector<char> file(sizeof(pipeline_cache_header) + size);
+    assert_success(vkGetPipelineCacheData(device, pipeline_cache, &size, file.data() + sizeof(pipeline_cache_header)), "failed to get pipeline cache data");
+    file.resize(sizeof(pipeline_cache_header) + size);
+
+    auto header = make_pipeline_cache_header(physical_device);
+    header.data_size = size;
+    header.checksum = checksum(file.data() + sizeof header, size);
+    std::memcpy(file.data(), &header, sizeof header);
+
+    if (!write_file_atomic(pipeline_cache_path, file.data(), file.size()))
+        info("[Vulkan] Could not write pipeline cache \"{}\": {}", pipeline_cache_path, ::strerror(errno));
+}
+
+void vk::context::set_viewport_and_scissor(VkCommandBuffer command_buffer) {
     VkViewport viewport{};
     viewport.x = 0.0f;
     viewport.y = 0.0f;
@@ -1092,27 +1897,89 @@ void vk::context::begin_recording_command_buffer(VkCommandBuffer command_buffer,
 }
 
 void vk::context::end_recording_command_buffer(VkCommandBuffer command_buffer) {
-    vkCmdEndRenderPass(command_buffer);
+    if (dynamic_rendering) {
+        cmd_end_rendering(command_buffer);
+
+        /// Hand the image over to the presentation engine, or make it available
+        /// for copies if we're headless.
+        attachment_barrier(command_buffer, swap_chain_images[current_image_index], VK_IMAGE_ASPECT_COLOR_BIT,
+            VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, present_layout(),
+            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+            is_headless ? VK_PIPELINE_STAGE_TRANSFER_BIT : VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            is_headless ? VK_ACCESS_TRANSFER_READ_BIT : 0);
+    } else {
+        vkCmdEndRenderPass(command_buffer);
+    }
+
+    stats.end_frame(command_buffer);
+    if (gpu_profile) gpu_profile->end_frame(command_buffer);
+    if (readback) readback->record(command_buffer);
     assert_success(vkEndCommandBuffer(command_buffer), "failed to record command buffer");
 }
 
 void vk::context::recreate_swap_chain() {
-    /// If the window has been minimised, pause rendering.
-    int wd, ht;
-    glfwGetFramebufferSize(window, &wd, &ht);
-    while (wd == 0 || ht == 0) {
+    /// If the window has been minimised, pause rendering. The offscreen image
+    /// never goes out of date; it only changes size if resize() is called.
+    if (is_headless) {
+        swap_chain_extent = headless_extent;
+    } else {
+        int wd, ht;
         glfwGetFramebufferSize(window, &wd, &ht);
-        glfwWaitEvents();
+        while (wd == 0 || ht == 0) {
+            glfwGetFramebufferSize(window, &wd, &ht);
+            glfwWaitEvents();
+        }
     }
 
-    vkDeviceWaitIdle(device);
-    cleanup_swap_chain();
-
-    create_swap_chain();
+    /// Everything else (render pass, pipelines, sync objects, command buffers) does
+    /// not depend on the size of the swap chain and is kept as is.
+    stats.swap_chain_recreate();
+    retire_swap_chain();
+    if (is_headless) create_offscreen_target();
+    else create_swap_chain();
     create_image_views();
     create_colour_resources();
     create_depth_resources();
-    create_framebuffers();
+    if (!dynamic_rendering) create_framebuffers();
+}
+
+void vk::context::retire_swap_chain() {
+    /// The frames in flight may still be using these, so destroy them once they're done.
+    defer_delete([this,
+                     swap_chain = swap_chain,
+                     offscreen_image = is_headless ? swap_chain_images.front() : VK_NULL_HANDLE,
+                     offscreen_image_memory = offscreen_image_memory,
+                     image_views = std::move(swap_chain_image_views),
+                     framebuffers = std::move(swap_chain_framebuffers),
+                     colour_image = colour_image,
+                     colour_image_memory = colour_image_memory,
+                     colour_image_view = colour_image_view,
+                     depth_image = depth_image,
+                     depth_image_memory = depth_image_memory,
+                     depth_image_view = depth_image_view] {
+        vkDestroyImageView(device, colour_image_view, nullptr);
+        vkDestroyImage(device, colour_image, nullptr);
+        vkFreeMemory(device, colour_image_memory, nullptr);
+
+        vkDestroyImageView(device, depth_image_view, nullptr);
+        vkDestroyImage(device, depth_image, nullptr);
+        vkFreeMemory(device, depth_image_memory, nullptr);
+
+        for (auto* framebuffer : framebuffers) vkDestroyFramebuffer(device, framebuffer, nullptr);
+        for (auto* image_view : image_views) vkDestroyImageView(device, image_view, nullptr);
+
+        /// The offscreen image is ours, unlike the swap chain images.
+        vkDestroyImage(device, offscreen_image, nullptr);
+        vkFreeMemory(device, offscreen_image_memory, nullptr);
+        vkDestroySwapchainKHR(device, swap_chain, nullptr);
+    });
+
+    swap_chain_image_views.clear();
+    swap_chain_framebuffers.clear();
+    offscreen_image_memory = VK_NULL_HANDLE;
+
+    /// Present IDs are per swap chain.
+    last_present_id = 0;
 }
 
 void vk::context::transition_image_layout(VkImage image, VkFormat, VkImageLayout old_layout,
@@ -1159,12 +2026,37 @@ void vk::context::transition_image_layout(VkImage image, VkFormat, VkImageLayout
     end_single_time_commands(command_buffer);
 }
 
+void vk::context::wait_for_last_present() {
+    if (!present_wait_supported || last_present_id == 0) return;
+
+    /// Don't wait forever if e.g. the window is hidden.
+    static constexpr u64 timeout_ns = 100'000'000;
+    auto res = wait_for_present(device, swap_chain, last_present_id, timeout_ns);
+    if (res == VK_SUCCESS) pacer.on_present(frame_pacer::clock::now());
+}
+
+void vk::context::wait_for_slot() {
+    CPU_ZONE("wait_for_slot");
+
+    /// The first few frames don't have a predecessor in their slot.
+    if (frame_number >= frames_in_flight) wait_for_frame(frame_number - frames_in_flight);
+}
+
 /// ======================================================================
 ///  API
 /// ======================================================================
 void vk::context::ImGui_Begin() {
     ImGui_ImplVulkan_NewFrame();
-    ImGui_ImplGlfw_NewFrame();
+
+    /// Without a window, there is no platform backend to do this for us.
+    if (is_headless) {
+        auto& io = ImGui::GetIO();
+        io.DisplaySize = ImVec2(f32(swap_chain_extent.width), f32(swap_chain_extent.height));
+        io.DeltaTime = 1.f / 60.f;
+    } else {
+        ImGui_ImplGlfw_NewFrame();
+    }
+
     ImGui::NewFrame();
 
     if (main_font) ImGui::PushFont(main_font);
@@ -1173,6 +2065,9 @@ void vk::context::ImGui_Begin() {
 void vk::context::ImGui_End(VkCommandBuffer command_buffer) {
     if (main_font) ImGui::PopFont();
 
+    /// Keep drawing while the user is interacting with a widget.
+    if (ImGui::IsAnyItemActive() || ImGui::GetIO().WantTextInput) request_redraw();
+
     ImGui::Render();
     ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), command_buffer);
 }
@@ -1204,28 +2099,297 @@ void vk::context::init_fonts(const std::vector<font_create_info>& fonts) {
             die("Failed to load font \"{}\" for the requested range", font.path);
 }
 
+auto vk::context::completed_frames() -> u64 {
+    u64 value;
+    assert_success(vkGetSemaphoreCounterValue(device, frame_timeline, &value), "failed to query frame timeline");
+    return value;
+}
+
+bool vk::context::frame_completed(u64 frame) {
+    return completed_frames() > frame;
+}
+
+void vk::context::wait_for_frame(u64 frame) {
+    u64 value = frame + 1;
+    VkSemaphoreWaitInfo wait_info{};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &frame_timeline;
+    wait_info.pValues = &value;
+    assert_success(vkWaitSemaphores(device, &wait_info, UINT64_MAX), "failed to wait for frame");
+}
+
+void vk::context::defer_delete(std::function<void()> destroy) {
+    std::unique_lock lock{ deletion_queue_mutex };
+    deletion_queue.push_back({ .frame = frame_number, .destroy = std::move(destroy) });
+}
+
+void vk::context::enable_bindless_textures(u32 capacity) {
+    if (!(requested_features & CONTEXT_FEATURE_BINDLESS_TEXTURES)) die("[Vulkan] Bindless textures must be requested when the context is created");
+    if (!descriptor_indexing_enabled) die("[Vulkan] Bindless textures require descriptor indexing, which this device does not support");
+    if (textures) die("[Vulkan] Bindless textures are already enabled");
+    textures = std::make_unique<texture_table>(this, capacity);
+}
+
+void vk::context::enable_readback(frame_readback::callback on_frame) {
+    /// Frames that are still in flight record copies into the old buffers.
+    if (readback) {
+        vkDeviceWaitIdle(device);
+        readback->collect();
+        readback.reset();
+    }
+
+    if (!on_frame) return;
+    if (!swap_chain_readable) die("[Vulkan] Readback requires swap chain images that can be copied from, which this surface does not support");
+    readback = std::make_unique<frame_readback>(this, std::move(on_frame));
+}
+
+void vk::context::enable_gpu_profiling(u32 max_zones_per_frame) {
+    /// Frames in flight are still writing to the old query pool.
+    if (gpu_profile) {
+        vkDeviceWaitIdle(device);
+        gpu_profile.reset();
+    }
+
+    if (max_zones_per_frame) gpu_profile = std::make_unique<gpu_profiler>(this, max_zones_per_frame);
+}
+
+void vk::context::enable_pipeline_statistics(bool enable) {
+    if (enable && !pipeline_statistics_supported) {
+        info("[Vulkan] Pipeline statistics are not available: the device does not support pipeline statistics queries");
+        return;
+    }
+
+    /// Frames in flight are still using the old query pool.
+    if (stats.query_pool != VK_NULL_HANDLE) vkDeviceWaitIdle(device);
+    stats.set_pipeline_statistics(enable);
+}
+
+void vk::context::enable_parallel_recording(u32 thread_count) {
+    cleanup_parallel_recording();
+    if (thread_count == 0) return;
+
+    auto indices = find_queue_families(physical_device);
+    VkCommandPoolCreateInfo pool_info{};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    pool_info.queueFamilyIndex = indices.graphics_family.value();
+
+    /// Command pools must be externally synchronised, so every worker gets its
+    /// own pool per frame in flight. The main thread needs one as well.
+    worker_command_pools.resize(frames_in_flight);
+    main_command_pools.resize(frames_in_flight);
+    for (u64 i = 0; i < frames_in_flight; i++) {
+        worker_command_pools[i].resize(thread_count);
+        for (auto& p : worker_command_pools[i])
+            assert_success(vkCreateCommandPool(device, &pool_info, nullptr, &p.pool), "failed to create worker command pool");
+        assert_success(vkCreateCommandPool(device, &pool_info, nullptr, &main_command_pools[i].pool), "failed to create command pool");
+    }
+
+    recording_threads = std::make_unique<thread_pool>(thread_count);
+}
+
 void vk::context::poll() {
-    glfwPollEvents();
+    CPU_ZONE("poll");
+    if (!is_headless) glfwPollEvents();
+}
+
+void vk::context::record_parallel(VkCommandBuffer& command_buffer, u64 draw_count, const record_callback& record) {
+    if (!recording_threads) {
+        record(command_buffer, 0, draw_count);
+        return;
+    }
+
+    /// Split the draws into one contiguous range per worker.
+    auto& pools = worker_command_pools[current_frame];
+    u64 workers = std::min<u64>(pools.size(), draw_count);
+    if (workers == 0) return;
+    u64 per_worker = draw_count / workers;
+    u64 remainder = draw_count % workers;
+
+    /// Whatever the main thread has recorded so far has to run first.
+    if (command_buffer != main_secondary_command_buffer) die("[Vulkan] record_parallel() must be passed the command buffer of the render callback");
+    assert_success(vkEndCommandBuffer(command_buffer), "failed to record secondary command buffer");
+    pending_secondary_command_buffers.push_back(command_buffer);
+
+    /// GPU zones opened by the workers belong to whatever zone is open here.
+    auto depth = gpu_profiler::current_depth();
+    std::vector<VkCommandBuffer> recorded(workers);
+    std::vector<std::future<void>> futures;
+    futures.reserve(workers);
+    for (u64 i = 0, begin = 0; i < workers; i++) {
+        u64 end = begin + per_worker + (i < remainder ? 1 : 0);
+        futures.push_back(recording_threads->submit([&, i, begin, end, depth] {
+            CPU_ZONE("record_parallel");
+            gpu_zone_parent parent{ depth };
+            auto secondary = begin_secondary_command_buffer(pools[i]);
+            record(secondary, begin, end);
+            assert_success(vkEndCommandBuffer(secondary), "failed to record secondary command buffer");
+            recorded[i] = secondary;
+        }));
+        begin = end;
+    }
+
+    for (auto& f : futures) f.get();
+    pending_secondary_command_buffers.insert(pending_secondary_command_buffers.end(), recorded.begin(), recorded.end());
+
+    /// And whatever it records next runs after the workers' draws.
+    command_buffer = main_secondary_command_buffer = begin_secondary_command_buffer(main_command_pools[current_frame]);
 }
 
 void vk::context::run_forever(render_callback tick) {
     while (!should_terminate()) {
+        /// In on-demand mode, sleep until something changes.
+        if (on_demand_rendering && redraw_frames == 0) {
+            glfwWaitEventsTimeout(idle_timeout_seconds);
+            continue;
+        }
+
+        /// Wait for the GPU before sampling input so that it's as fresh as possible
+        /// by the time the frame is rendered.
+        if (wait_before_input) wait_for_slot();
+
+        /// Throttle to the target frame rate. If we can, wait for the last frame to
+        /// reach the screen first so that the presentation queue stays short.
+        if (pacer.enabled()) {
+            wait_for_last_present();
+            pacer.wait();
+        }
+
+        poll();
+
+        /// Use up one of the requested frames.
+        if (on_demand_rendering) {
+            u32 frames = redraw_frames;
+            while (frames && !redraw_frames.compare_exchange_weak(frames, frames - 1)) {}
+        }
+
+        draw_frame(tick);
+    }
+
+    vkDeviceWaitIdle(device);
+    if (readback) readback->collect();
+}
+
+void vk::context::run_for(u64 frames, render_callback tick) {
+    for (u64 i = 0; i < frames && !should_terminate(); i++) {
+        if (pacer.enabled()) pacer.wait();
         poll();
         draw_frame(tick);
     }
 
+    if (frame_number) wait_for_frame(frame_number - 1);
+    if (readback) readback->collect();
+}
+
+void vk::context::set_frames_in_flight(u32 count) {
+    count = std::clamp(count, 1u, u32(MAX_FRAMES_IN_FLIGHT));
+    if (count == frames_in_flight) return;
+
+    /// Nothing may be in flight while we replace the per-frame resources.
     vkDeviceWaitIdle(device);
+    flush_deletion_queue(true);
+
+    vkFreeCommandBuffers(device, command_pool, u32(command_buffers.size()), command_buffers.data());
+    destroy_sync_objects();
+
+    frames_in_flight = count;
+    current_frame = 0;
+    create_command_buffers();
+    create_sync_objects();
+    if (readback) readback->set_slot_count(count);
+
+    /// The recording threads have command pools per frame as well.
+    if (recording_threads) enable_parallel_recording(recording_threads->size());
+}
+
+void vk::context::set_latency_mode(latency_mode mode) {
+    switch (mode) {
+        case LATENCY_MODE_LOW:
+            wait_before_input = true;
+            set_swap_chain_image_count(2);
+            set_frames_in_flight(1);
+            break;
+
+        case LATENCY_MODE_BALANCED:
+            wait_before_input = false;
+            set_swap_chain_image_count(0);
+            set_frames_in_flight(2);
+            break;
+
+        case LATENCY_MODE_THROUGHPUT:
+            wait_before_input = false;
+            set_swap_chain_image_count(3);
+            set_frames_in_flight(3);
+            break;
+    }
+}
+
+void vk::context::set_on_demand_rendering(bool enable) {
+    /// There are no events to wait for without a window.
+    on_demand_rendering = enable && !is_headless;
+    request_redraw();
+}
+
+void vk::context::set_swap_chain_image_count(u32 count) {
+    if (count == swap_chain_image_count) return;
+    swap_chain_image_count = count;
+    if (!is_headless) recreate_swap_chain();
+}
+
+void vk::context::resize(u32 wd, u32 ht) {
+    if (!is_headless) die("[Vulkan] Only headless contexts can be resized; windowed contexts follow their window");
+    if (wd == 0 || ht == 0) die("[Vulkan] Headless context must not be empty: {}x{}", wd, ht);
+    headless_extent = { wd, ht };
+    resized = true;
+}
+
+auto vk::context::pacing_stats() const -> frame_pacing_stats {
+    return pacer.stats();
+}
+
+auto vk::context::frame_statistics() const -> const frame_stats& {
+    return stats.latest();
+}
+
+void vk::context::enable_stutter_capture(std::string_view dir) {
+    monitor.dump_dir = std::string{ dir };
+}
+
+void vk::context::capture_frames(std::string_view path, u64 frames) {
+    if (capture) {
+        err("[Capture] A capture is already in progress");
+        return;
+    }
+
+    capture = std::make_unique<command_capture>(this, std::string{ path }, frames);
+    if (!capture->file) capture.reset();
+    else info("[Capture] Capturing {} frames to \"{}\"", frames, path);
+}
+
+void vk::context::request_redraw(u32 frames) {
+    u32 current = redraw_frames;
+    while (current < frames && !redraw_frames.compare_exchange_weak(current, frames)) {}
+
+    /// Wake up the main loop if it's waiting for events.
+    if (on_demand_rendering && !is_headless) glfwPostEmptyEvent();
+}
+
+void vk::context::set_frame_rate_limit(f64 fps) {
+    pacer.set_target_fps(fps);
 }
 
 bool vk::context::should_terminate() {
+    if (is_headless) return terminate_requested;
     return glfwWindowShouldClose(window);
 }
 
 void vk::context::terminate() {
-    glfwSetWindowShouldClose(window, true);
+    if (is_headless) terminate_requested = true;
+    else glfwSetWindowShouldClose(window, true);
 }
 
 void vk::context::toggle_vsync(bool enable_vsync) {
     vsync = enable_vsync;
-    recreate_swap_chain();
+    if (!is_headless) recreate_swap_chain();
 }
\ No newline at end of file
@@ -2,12 +2,28 @@
 #define VULKAN_TEMPLATE_CONTEXT_HH
 #define GLFW_INCLUDE_VULKAN
 
+#include "command_capture.hh"
+#include "cpu_profiler.hh"
+#include "descriptor_allocator.hh"
+#include "frame_monitor.hh"
+#include "frame_pacer.hh"
+#include "frame_readback.hh"
+#include "gpu_profiler.hh"
+#include "logger.hh"
 #include "model.hh"
+#include "render_stats.hh"
+#include "startup_timeline.hh"
+#include "texture_table.hh"
+#include "thread_pool.hh"
 #include "utils.hh"
 #include "vertex.hh"
 
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <GLFW/glfw3.h>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <vulkan/vulkan.h>
 
@@ -18,7 +34,10 @@
 #include "../imgui/imgui.h"
 #pragma GCC diagnostic pop
 
-#define MAX_FRAMES_IN_FLIGHT 2
+/// Upper bound for the number of frames in flight. Per-frame resources owned by
+/// renderers are allocated for this many frames so that the actual number can be
+/// changed at runtime; see context::set_frames_in_flight().
+#define MAX_FRAMES_IN_FLIGHT 3
 
 namespace vk {
 struct queue_family_indices {
@@ -36,6 +55,28 @@ struct swap_chain_support_details {
     std::vector<VkPresentModeKHR> present_modes;
 };
 
+/// Presets for the number of frames in flight and swap chain images.
+enum latency_mode {
+    /// One frame in flight, as few swap chain images as possible, and input is
+    /// only sampled once the previous frame is done.
+    LATENCY_MODE_LOW,
+
+    /// Two frames in flight and the default number of swap chain images.
+    LATENCY_MODE_BALANCED,
+
+    /// Three frames in flight and three swap chain images.
+    LATENCY_MODE_THROUGHPUT,
+};
+
+/// Optional features. These have to be requested when the context is
+/// created since they need to be enabled on the device.
+enum context_feature : u32 {
+    CONTEXT_FEATURE_NONE = 0,
+
+    /// Enable descriptor indexing so that enable_bindless_textures() can be used.
+    CONTEXT_FEATURE_BINDLESS_TEXTURES = 1 << 0,
+};
+
 enum font_create_info_type {
     FONT_CREATE_INFO_TTF_TYPE
 };
@@ -48,9 +89,33 @@ struct font_create_info {
     std::vector<ImWchar> ranges = { 0x20, 0xfffd, 0 };
 };
 
+/// An object that is destroyed once no frame in flight can be using it anymore.
+struct deferred_deletion {
+    /// The frame during which the object was retired.
+    u64 frame;
+    std::function<void()> destroy;
+};
+
+/// Command pool that a single thread records secondary command buffers from.
+struct secondary_command_pool {
+    VkCommandPool pool = VK_NULL_HANDLE;
+
+    /// Buffers allocated from the pool; these are reused every frame.
+    std::vector<VkCommandBuffer> buffers;
+    u32 used = 0;
+};
+
+/// Tag for creating a context without a window.
+struct headless_t {
+    explicit headless_t() = default;
+};
+
+inline constexpr headless_t headless{};
+
 /// The Vulkan context.
 struct context {
     using render_callback = std::function<void(VkCommandBuffer)>;
+    using record_callback = std::function<void(VkCommandBuffer, u64, u64)>;
     using kb_callback = std::function<void(context*, int, int, int, int)>;
     using cleanup_callback = std::function<void(context*)>;
 
@@ -59,32 +124,84 @@ struct context {
     VkDevice device;
     VkInstance instance;
     VkPhysicalDevice physical_device;
-    VkRenderPass render_pass;
-    VkSurfaceKHR surface;
+    VkRenderPass render_pass = VK_NULL_HANDLE;
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
 
     /// Queues.
     VkQueue graphics_queue;
     VkQueue present_queue;
 
     /// Swap chain.
-    VkSwapchainKHR swap_chain;
+    VkSwapchainKHR swap_chain = VK_NULL_HANDLE;
     VkFormat swap_chain_image_format;
     VkExtent2D swap_chain_extent;
     std::vector<VkImage> swap_chain_images;
     std::vector<VkImageView> swap_chain_image_views;
     std::vector<VkFramebuffer> swap_chain_framebuffers;
 
+    /// Whether the swap chain images can be copied from.
+    bool swap_chain_readable = false;
+
+    /// Headless mode. There is no window and no surface; instead of a swap
+    /// chain, we render to a single offscreen image, which is left in
+    /// TRANSFER_SRC_OPTIMAL at the end of every frame so it can be read back.
+    bool is_headless = false;
+    VkDeviceMemory offscreen_image_memory = VK_NULL_HANDLE;
+
     /// Frames.
     std::vector<VkCommandBuffer> command_buffers;
     std::vector<VkSemaphore> image_available_semaphores;
     std::vector<VkSemaphore> render_finished_semaphores;
-    std::vector<VkFence> in_flight_fences;
     u32 current_frame = 0;
-
-    /// The pipeline that is currently bound.
-    VkPipeline bound_pipeline;
+    u32 current_image_index = 0;
+
+    /// Number of frames in flight. Use set_frames_in_flight() to change this.
+    u32 frames_in_flight = 2;
+
+    /// Number of frames that have been recorded so far.
+    u64 frame_number = 0;
+
+    /// Timeline semaphore that frame N signals with value N + 1 once the GPU is
+    /// done with it. Its value is thus the number of frames that have completed.
+    VkSemaphore frame_timeline = VK_NULL_HANDLE;
+
+    /// Timeline semaphore that one-time command buffers (uploads etc.) signal
+    /// with the number of such submissions so far.
+    VkSemaphore upload_timeline = VK_NULL_HANDLE;
+    u64 upload_count = 0;
+
+    /// The pipeline that is currently bound. This is per thread since
+    /// every recording thread has its own command buffer.
+    static thread_local VkPipeline bound_pipeline;
+
+    /// Parallel recording. Indexed by frame, then by worker.
+    std::unique_ptr<thread_pool> recording_threads;
+    std::vector<std::vector<secondary_command_pool>> worker_command_pools;
+    std::vector<secondary_command_pool> main_command_pools;
+    std::vector<VkCommandBuffer> pending_secondary_command_buffers;
+    VkCommandBuffer main_secondary_command_buffer = VK_NULL_HANDLE;
+
+    /// Dynamic rendering. If this is enabled, there is no render pass and there are no
+    /// framebuffers; pipelines are created against the attachment formats instead. It
+    /// is used whenever the device supports it, unless VULKAN_ENGINE_FORCE_RENDER_PASS
+    /// is set in the environment.
+    bool dynamic_rendering = false;
+    PFN_vkCmdBeginRenderingKHR cmd_begin_rendering = nullptr;
+    PFN_vkCmdEndRenderingKHR cmd_end_rendering = nullptr;
+
+    /// Objects waiting to be destroyed. This is flushed every frame.
+    std::vector<deferred_deletion> deletion_queue;
+    std::mutex deletion_queue_mutex;
+
+    /// Frame pacing. If present wait is supported, the pacer waits for the
+    /// previous frame to be displayed before starting the next one.
+    frame_pacer pacer;
+    bool present_wait_supported = false;
+    PFN_vkWaitForPresentKHR wait_for_present = nullptr;
+    u64 last_present_id = 0;
 
     /// Depth buffer.
+    VkFormat depth_format;
     VkImage depth_image;
     VkDeviceMemory depth_image_memory;
     VkImageView depth_image_view;
@@ -95,16 +212,67 @@ struct context {
     VkDeviceMemory colour_image_memory;
     VkImageView colour_image_view;
 
+    /// Pipeline cache shared by all pipelines. This is loaded from and saved to
+    /// `pipeline_cache_path`; an empty path disables persisting the cache.
+    VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+    std::string pipeline_cache_path;
+
+    /// Descriptor sets for all pipelines.
+    std::unique_ptr<descriptor_allocator> descriptors;
+
+    /// Bindless textures. This is null unless enable_bindless_textures() was called. Descriptor
+    /// indexing is only enabled if the context was created with CONTEXT_FEATURE_BINDLESS_TEXTURES.
+    bool descriptor_indexing_enabled = false;
+    std::unique_ptr<texture_table> textures;
+
+    /// Frame readback. This is null unless enable_readback() was called.
+    std::unique_ptr<frame_readback> readback;
+
+    /// GPU profiling. This is null unless enable_gpu_profiling() was called.
+    std::unique_ptr<gpu_profiler> gpu_profile;
+
+    /// Per-frame statistics. Pipeline statistics queries are only used if
+    /// enable_pipeline_statistics() was called.
+    bool pipeline_statistics_supported = false;
+    bool inherited_queries_supported = false;
+    render_stats stats{ this };
+
+    /// Frame time histograms and stutter detection.
+    frame_monitor monitor{ this };
+
+    /// How long each phase of startup took, up to the first frame.
+    startup_timeline startup;
+
+    /// Command capture. This is null unless a capture is in progress; see capture_frames().
+    std::unique_ptr<command_capture> capture;
+
     /// IMGUI.
     VkDescriptorPool imgui_descriptor_pool = VK_NULL_HANDLE;
     ImFont* main_font = nullptr;
 
+    /// CPU profiling. Pressing `cpu_trace_key` writes the last `cpu_trace_frames`
+    /// frames to `cpu_trace_path` as a Chrome trace. This does nothing unless
+    /// ENABLE_CPU_PROFILING is defined.
+    int cpu_trace_key = GLFW_KEY_F12;
+    u32 cpu_trace_frames = 120;
+    std::string cpu_trace_path = "cpu_trace.json";
+
+    /// Pressing `capture_key` captures the next `capture_frame_count` frames to `capture_path`.
+    int capture_key = GLFW_KEY_F11;
+    u32 capture_frame_count = 120;
+    std::string capture_path = "capture.vkcap";
+
     /// Window.
-    GLFWwindow* window;
+    GLFWwindow* window = nullptr;
     kb_callback on_key_pressed = [](context*, int, int, int, int) {};
     bool resized = false;
     bool paused = false;
 
+    /// On-demand rendering. If enabled, run_forever() only draws a frame if
+    /// there was input, or if a redraw was requested; otherwise it sleeps.
+    std::atomic<bool> on_demand_rendering = false;
+    std::atomic<u32> redraw_frames = 1;
+
     /// Cleanup.
     /// Callbacks to call when the context is destroyed.
     /// These are called in the reverse order that they were added.
@@ -113,13 +281,37 @@ struct context {
 private:
     bool vsync = true;
 
+    /// Requested number of swap chain images. 0 means the minimum plus one.
+    u32 swap_chain_image_count = 0;
+
+    /// Whether to wait for the GPU before polling events.
+    bool wait_before_input = false;
+
+    /// Set by terminate() in headless mode.
+    bool terminate_requested = false;
+
+    /// Size that the offscreen image should have; see resize().
+    VkExtent2D headless_extent{};
+
+    /// Optional features that were requested when the context was created.
+    u32 requested_features = CONTEXT_FEATURE_NONE;
+
+    /// The API version the instance was created with.
+    u32 instance_api_version = VK_API_VERSION_1_2;
+
 public:
 #ifdef ENABLE_VALIDATION_LAYERS
     VkDebugUtilsMessengerEXT debug_messenger;
 #endif
 
-    /// Create a new context and initialise Vulkan.
-    context(int wd, int ht, std::string_view title);
+    /// Create a new context and initialise Vulkan. `features` is a
+    /// combination of `context_feature` flags.
+    context(int wd, int ht, std::string_view title, u32 features = CONTEXT_FEATURE_NONE);
+
+    /// Create a context that renders to an offscreen image of the given size
+    /// instead of a window. This does not require GLFW or a display, and it
+    /// works on devices that can't present at all (e.g. lavapipe).
+    context(headless_t, u32 wd, u32 ht, u32 features = CONTEXT_FEATURE_NONE);
 
     /// Destroy the context and cleanup Vulkan if there are no contexts left.
     ~context();
@@ -132,31 +324,132 @@ public:
     void ImGui_Begin();
     void ImGui_End(VkCommandBuffer command_buffer);
 
+    /// Get the number of frames that the GPU has finished.
+    auto completed_frames() -> u64;
+
+    /// Check whether the GPU is done with a frame.
+    bool frame_completed(u64 frame);
+
+    /// Wait until the GPU is done with a frame.
+    void wait_for_frame(u64 frame);
+
+    /// Destroy an object once all frames that are currently in flight have finished.
+    /// This may be called from any thread.
+    void defer_delete(std::function<void()> destroy);
+
     /// Bind a renderer to this context.
     void bind(texture_renderer& r);
 
+    /// Measure GPU time per frame and per gpu_scope. Passing 0 disables profiling.
+    void enable_gpu_profiling(u32 max_zones_per_frame = 256);
+
+    /// Also count shader invocations and primitives on the GPU. The results of a
+    /// frame arrive a few frames late, so frame_statistics() lags behind while
+    /// this is enabled. Does nothing if the device doesn't support it.
+    void enable_pipeline_statistics(bool enable = true);
+
+    /// Create a global texture table with room for `capacity` textures. Texture
+    /// renderers created after this call index into it instead of binding a
+    /// descriptor set per model, and must use shaders that declare the table.
+    ///
+    /// The context must have been created with CONTEXT_FEATURE_BINDLESS_TEXTURES.
+    void enable_bindless_textures(u32 capacity = 1 << 14);
+
+    /// Copy every frame to host memory and pass it to `on_frame` once the GPU is
+    /// done with it, which is usually a couple of frames later. Passing an empty
+    /// callback disables readback.
+    void enable_readback(frame_readback::callback on_frame);
+
+    /// Record frames using secondary command buffers, split across `thread_count`
+    /// worker threads. Passing 0 switches back to recording everything inline.
+    ///
+    /// While this is enabled, the command buffer passed to the render callback
+    /// is a secondary command buffer as well.
+    void enable_parallel_recording(u32 thread_count = std::max(std::thread::hardware_concurrency(), 1u));
+
     /// Add fonts to the context. This may only be called once!
     void init_fonts(const std::vector<font_create_info>& fonts);
 
     /// Poll window events.
     void poll();
 
+    /// Split a draw list of `draw_count` draws into ranges and call `record`
+    /// with a secondary command buffer and [begin, end) for each range on
+    /// the recording threads. Blocks until all ranges have been recorded.
+    ///
+    /// Everything runs on the GPU in the order in which it was recorded: the
+    /// command buffer passed to the render callback is ended here and replaced
+    /// with a fresh one, so anything recorded before this call runs before the
+    /// ranges, and anything recorded after it runs after them. Always pass the
+    /// variable that you record into, and keep using it afterwards; gpu_scopes
+    /// that refer to it carry over. If parallel recording is disabled, this just
+    /// records into `command_buffer`.
+    void record_parallel(VkCommandBuffer& command_buffer, u64 draw_count, const record_callback& record);
+
+    /// Get statistics about frame pacing.
+    auto pacing_stats() const -> frame_pacing_stats;
+
+    /// Get the draw calls, binds, uploads etc. of the most recent complete frame.
+    auto frame_statistics() const -> const frame_stats&;
+
+    /// Write a snapshot of the profilers and frame counters to a subdirectory of
+    /// `dir` whenever a frame stutters. An empty path disables snapshots.
+    void enable_stutter_capture(std::string_view dir = "stutters");
+
+    /// Record the renderer calls of the next `frames` frames to `path` so they can
+    /// be replayed with a command_replay. Does nothing if a capture is already
+    /// in progress.
+    void capture_frames(std::string_view path, u64 frames);
+
+    /// Request that at least the next `frames` frames be drawn in on-demand mode.
+    /// Call this every frame while animating, or after uploading new data. This
+    /// may be called from any thread.
+    void request_redraw(u32 frames = 1);
+
     /// Run the context forever.
     void run_forever(render_callback tick);
 
+    /// Draw `frames` frames and wait for them to finish. This is mainly meant
+    /// for headless contexts and benchmarks, but works with a window too.
+    void run_for(u64 frames, render_callback tick);
+
     /// Whether the main loop should terminate.
     bool should_terminate();
 
     /// Terminate the main loop.
     void terminate();
 
+    /// Limit the frame rate of run_forever(). 0 removes the limit.
+    void set_frame_rate_limit(f64 fps);
+
+    /// Enable or disable on-demand rendering.
+    void set_on_demand_rendering(bool enable);
+
+    /// Set the number of frames in flight, clamped to [1, MAX_FRAMES_IN_FLIGHT].
+    /// This waits for the device to go idle.
+    void set_frames_in_flight(u32 count);
+
+    /// Apply a latency preset.
+    void set_latency_mode(latency_mode mode);
+
+    /// Request a number of swap chain images; 0 means the default. This recreates the swap chain.
+    void set_swap_chain_image_count(u32 count);
+
     /// Toggle vsync.
     void toggle_vsync(bool enable_vsync);
 
+    /// Resize the offscreen image of a headless context. This takes effect at the
+    /// start of the next frame and goes through the same path as recreating the
+    /// swap chain of a window, i.e. it doesn't wait for the frames in flight.
+    void resize(u32 wd, u32 ht);
+
     /// INTERNAL (Setup):
+    void create_instance();
+    void init_vulkan();
     void pick_physical_device();
     void create_logical_device();
     void create_swap_chain();
+    void create_offscreen_target();
     void create_image_views();
     void create_render_pass();
     void create_framebuffers();
@@ -165,10 +458,15 @@ public:
     void create_depth_resources();
     void create_command_buffers();
     void create_sync_objects();
+    void create_pipeline_cache();
     void init_imgui();
 
     /// INTERNAL:
+    void begin_dynamic_rendering(VkCommandBuffer command_buffer, u32 img_index);
+    void begin_overlay(VkCommandBuffer command_buffer);
+    auto begin_secondary_command_buffer(secondary_command_pool& pool) -> VkCommandBuffer;
     auto begin_single_time_commands() -> VkCommandBuffer;
+    void cleanup_parallel_recording();
     void cleanup_swap_chain();
     void copy_buffer(VkBuffer dest, VkBuffer src, VkDeviceSize size);
     void copy_buffer_to_image(VkImage image, VkBuffer buffer, u32 width, u32 height);
@@ -178,6 +476,7 @@ public:
         VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image,
         VkDeviceMemory& image_memory);
     auto create_image_view(VkImage image, VkFormat format, VkImageAspectFlags aspect_flags, u32 mip_lvls) -> VkImageView;
+    void destroy_sync_objects();
     void draw_frame(const render_callback& tick);
     void end_single_time_commands(VkCommandBuffer command_buffer);
     auto find_depth_format() -> VkFormat;
@@ -185,14 +484,21 @@ public:
     auto find_queue_families(VkPhysicalDevice device) -> queue_family_indices;
     auto find_supported_format(const std::vector<VkFormat>& candidates, VkImageTiling tiling,
         VkFormatFeatureFlags features) -> VkFormat;
+    void flush_deletion_queue(bool all = false);
     void generate_mipmaps(VkImage image, VkFormat image_format, u32 wd, u32 ht, u32 mip_levels);
     auto phys_dev_score(VkPhysicalDevice dev) -> u64;
+    auto present_layout() const -> VkImageLayout;
     auto query_swap_chain_support(VkPhysicalDevice device) -> swap_chain_support_details;
     void begin_recording_command_buffer(VkCommandBuffer command_buffer, u32 img_index);
     void end_recording_command_buffer(VkCommandBuffer command_buffer);
     void recreate_swap_chain();
+    void retire_swap_chain();
+    void save_pipeline_cache();
+    void set_viewport_and_scissor(VkCommandBuffer command_buffer);
     void transition_image_layout(VkImage image, VkFormat format, VkImageLayout old_layout,
         VkImageLayout new_layout, u32 mip_lvls);
+    void wait_for_last_present();
+    void wait_for_slot();
 };
 
 } // namespace vk
@@ -0,0 +1,158 @@
+#include "cpu_profiler.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+using namespace vk::cpu_profiler;
+
+/// All thread buffers. The buffer of a thread that has exited is kept so we
+/// can still write out its zones, but only until a new thread needs one; this
+/// way we never hold more buffers than there were threads alive at once.
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<thread_buffer>> registry;
+u32 thread_count = 0;
+
+/// Hands the buffer of the current thread back when it exits.
+struct buffer_owner {
+    thread_buffer* buf = nullptr;
+
+    ~buffer_owner() {
+        if (!buf) return;
+        std::unique_lock lock{ registry_mutex };
+        buf->exited = true;
+    }
+};
+
+/// Start timestamps of the most recent frames.
+constexpr u64 max_frames = 1024;
+std::array<std::atomic<u64>, max_frames> frame_starts;
+std::atomic<u64> frame_count = 0;
+
+/// Reference point for converting timestamps to real time.
+struct calibration {
+    u64 ticks;
+    std::chrono::steady_clock::time_point time;
+};
+
+const calibration epoch{ now(), std::chrono::steady_clock::now() };
+
+/// Determine the number of ticks per microsecond.
+auto ticks_per_us() -> f64 {
+#if defined(__x86_64__) || defined(__i386__)
+    /// Measure against the steady clock over the entire lifetime of the program
+    /// so far, which is far more precise than any short calibration loop; just
+    /// make sure that we have at least a few milliseconds to work with.
+    auto elapsed = std::chrono::steady_clock::now() - epoch.time;
+    if (elapsed < std::chrono::milliseconds(10)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10) - elapsed);
+        elapsed = std::chrono::steady_clock::now() - epoch.time;
+    }
+
+    auto ticks = now() - epoch.ticks;
+    return f64(ticks) / std::chrono::duration<f64, std::micro>(elapsed).count();
+#else
+    return 1000;
+#endif
+}
+} // namespace
+
+thread_local vk::cpu_profiler::thread_buffer* vk::cpu_profiler::current_thread_buffer = nullptr;
+
+auto vk::cpu_profiler::register_thread() -> thread_buffer* {
+    thread_local buffer_owner owner;
+    std::unique_lock lock{ registry_mutex };
+
+    /// Reuse the buffer of a thread that has exited if there is one. Nobody
+    /// writes to it anymore, and readers hold the mutex, so it's safe to reset.
+    auto it = std::ranges::find_if(registry, [](auto& b) { return b->exited; });
+    auto* buf = it != registry.end() ? it->get() : registry.emplace_back(std::make_unique<thread_buffer>()).get();
+    buf->claimed.store(0, std::memory_order_relaxed);
+    buf->head.store(0, std::memory_order_relaxed);
+    buf->exited = false;
+    buf->tid = ++thread_count;
+    buf->name = fmt::format("Thread {}", buf->tid);
+    owner.buf = buf;
+    current_thread_buffer = buf;
+    return buf;
+}
+
+void vk::cpu_profiler::mark_frame() {
+    auto n = frame_count.load(std::memory_order_relaxed);
+    frame_starts[n % max_frames].store(now(), std::memory_order_relaxed);
+    frame_count.store(n + 1, std::memory_order_release);
+}
+
+void vk::cpu_profiler::set_thread_name(std::string_view name) {
+    auto* buf = current_thread_buffer ? current_thread_buffer : register_thread();
+    std::unique_lock lock{ registry_mutex };
+    buf->name = std::string{ name };
+}
+
+bool vk::cpu_profiler::write_chrome_trace(std::string_view path, u32 frames) {
+    /// Only include zones that end after the start of the first frame we want.
+    u64 start = 0;
+    auto n = frame_count.load(std::memory_order_acquire);
+    frames = u32(std::min<u64>({ frames, n, max_frames }));
+    if (frames) start = frame_starts[(n - frames) % max_frames].load(std::memory_order_relaxed);
+
+    auto scale = ticks_per_us();
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    auto append = [&](std::string_view ev) {
+        if (!first) json += ",\n";
+        json += ev;
+        first = false;
+    };
+
+    std::unique_lock lock{ registry_mutex };
+    std::vector<event> events;
+    for (auto& buf : registry) {
+        append(fmt::format(R"({{"name":"thread_name","ph":"M","pid":1,"tid":{},"args":{{"name":"{}"}}}})", buf->tid, json_escape(buf->name)));
+
+        /// Only copy events whose writes have been published. The owning thread
+        /// may keep writing while we copy, so check afterwards which of the events
+        /// we copied may have been overwritten in the meantime.
+        auto head = buf->head.load(std::memory_order_acquire);
+        auto first_event = head > thread_buffer::capacity ? head - thread_buffer::capacity : 0;
+        events.clear();
+        for (auto i = first_event; i < head; i++) {
+            auto& s = buf->events[i % thread_buffer::capacity];
+            events.push_back({
+                s.name.load(std::memory_order_relaxed),
+                s.begin.load(std::memory_order_relaxed),
+                s.end.load(std::memory_order_relaxed),
+            });
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto claimed = buf->claimed.load(std::memory_order_relaxed);
+        auto overwritten = claimed > thread_buffer::capacity ? claimed - thread_buffer::capacity : 0;
+        auto skip = overwritten > first_event ? std::min<u64>(overwritten - first_event, events.size()) : 0;
+
+        for (auto it = events.begin() + i64(skip); it != events.end(); ++it) {
+            if (it->end < start || it->begin < epoch.ticks) continue;
+            append(fmt::format(
+                R"({{"name":"{}","ph":"X","pid":1,"tid":{},"ts":{:.3f},"dur":{:.3f}}})",
+                json_escape(it->name),
+                buf->tid,
+                f64(it->begin - epoch.ticks) / scale,
+                f64(it->end - it->begin) / scale
+            ));
+        }
+    }
+
+    json += "\n]}\n";
+    if (!write_file_atomic(path, json.data(), json.size())) {
+        err("[Profiler] Could not write trace \"{}\": {}", path, ::strerror(errno));
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,132 @@
+#ifndef VULKAN_TEMPLATE_CPU_PROFILER_HH
+#define VULKAN_TEMPLATE_CPU_PROFILER_HH
+#include "utils.hh"
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#    include <x86intrin.h>
+#else
+#    include <time.h>
+#endif
+
+/// Measure the CPU time spent in the enclosing scope. `name` must be a string
+/// literal (or otherwise live forever). This compiles to nothing unless
+/// ENABLE_CPU_PROFILING is defined.
+#ifdef ENABLE_CPU_PROFILING
+#    define CPU_ZONE(name)   ::vk::cpu_zone CAT($$cpu_zone_, __COUNTER__) { name }
+#    define CPU_FRAME_MARK() ::vk::cpu_profiler::mark_frame()
+#else
+#    define CPU_ZONE(name)   static_cast<void>(0)
+#    define CPU_FRAME_MARK() static_cast<void>(0)
+#endif
+
+/// Lightweight CPU profiler.
+///
+/// Every thread records its zones into its own ring buffer, which only that
+/// thread ever writes to, so recording a zone takes no locks and costs two
+/// timestamps and a store. Timestamps come from the TSC on x86 and from
+/// CLOCK_MONOTONIC elsewhere; they are only converted to real time when a
+/// trace is written.
+///
+/// Old zones are overwritten once a ring buffer is full, so traces only ever
+/// cover the last few hundred frames or so.
+namespace vk::cpu_profiler {
+/// A zone that has ended.
+struct event {
+    const char* name;
+    u64 begin;
+    u64 end;
+};
+
+/// Ring buffer of a single thread.
+struct thread_buffer {
+    static constexpr u64 capacity = 1 << 16;
+
+    /// The fields are atomic because the trace writer may copy an event while
+    /// the owning thread is overwriting it; see write_chrome_trace().
+    struct slot {
+        std::atomic<const char*> name;
+        std::atomic<u64> begin;
+        std::atomic<u64> end;
+    };
+
+    std::array<slot, capacity> events;
+
+    /// Number of events the owning thread has started writing, and number of
+    /// events it has finished writing.
+    std::atomic<u64> claimed = 0;
+    std::atomic<u64> head = 0;
+
+    u32 tid;
+    std::string name;
+
+    /// Set once the owning thread has exited so another thread can take the
+    /// buffer over. Protected by the registry mutex.
+    bool exited = false;
+};
+
+/// Ring buffer of the current thread; null until the thread records its first zone.
+extern thread_local thread_buffer* current_thread_buffer;
+
+/// Get a timestamp.
+inline auto now() -> u64 {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return u64(ts.tv_sec) * 1'000'000'000 + u64(ts.tv_nsec);
+#endif
+}
+
+/// Create the ring buffer for the current thread.
+auto register_thread() -> thread_buffer*;
+
+/// Record a zone on the current thread.
+inline void record(const char* name, u64 begin, u64 end) {
+    auto* buf = current_thread_buffer ? current_thread_buffer : register_thread();
+    auto h = buf->head.load(std::memory_order_relaxed);
+
+    /// Announce the write before overwriting the slot so a reader that sees
+    /// any part of the new event also sees that the old one is gone.
+    buf->claimed.store(h + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    auto& s = buf->events[h % thread_buffer::capacity];
+    s.name.store(name, std::memory_order_relaxed);
+    s.begin.store(begin, std::memory_order_relaxed);
+    s.end.store(end, std::memory_order_relaxed);
+    buf->head.store(h + 1, std::memory_order_release);
+}
+
+/// Mark the start of a frame.
+void mark_frame();
+
+/// Set the name of the current thread as shown in traces.
+void set_thread_name(std::string_view name);
+
+/// Write the last `frames` frames as a Chrome trace-event JSON file, which can be
+/// loaded into chrome://tracing or Perfetto. Returns false on error.
+bool write_chrome_trace(std::string_view path, u32 frames);
+} // namespace vk::cpu_profiler
+
+namespace vk {
+/// Records a zone from its construction to its destruction. Use CPU_ZONE() instead
+/// of using this directly so zones can be compiled out.
+struct cpu_zone {
+    const char* name;
+    u64 begin;
+
+    explicit cpu_zone(const char* name) : name(name), begin(cpu_profiler::now()) {}
+    ~cpu_zone() { cpu_profiler::record(name, begin, cpu_profiler::now()); }
+
+    nocopy(cpu_zone);
+    nomove(cpu_zone);
+};
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_CPU_PROFILER_HH
@@ -0,0 +1,167 @@
+#include "descriptor_allocator.hh"
+
+#include "context.hh"
+
+namespace {
+/// Descriptors per set for every type when creating a pool. This is a guess; a pool
+/// that runs out of one type is simply replaced by a new one.
+const std::pair<VkDescriptorType, u32> pool_ratios[] = {
+    { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2 },
+    { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 },
+    { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1 },
+    { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
+    { VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 1 },
+    { VK_DESCRIPTOR_TYPE_SAMPLER, 1 },
+    { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 },
+};
+
+/// Upper bound for the number of sets in a single pool.
+constexpr u32 max_sets_per_pool = 4096;
+
+/// Whether an allocation failed because the pool is full.
+bool pool_exhausted(VkResult res) {
+    return res == VK_ERROR_OUT_OF_POOL_MEMORY || res == VK_ERROR_FRAGMENTED_POOL;
+}
+} // namespace
+
+vk::descriptor_allocator::descriptor_allocator(context* ctx) : ctx(ctx) {
+    transient_pools.resize(MAX_FRAMES_IN_FLIGHT);
+}
+
+vk::descriptor_allocator::~descriptor_allocator() {
+    for (auto pool : pools) vkDestroyDescriptorPool(ctx->device, pool, nullptr);
+    for (auto& frame : transient_pools)
+        for (auto pool : frame.pools) vkDestroyDescriptorPool(ctx->device, pool, nullptr);
+}
+
+auto vk::descriptor_allocator::allocate(VkDescriptorSetLayout layout) -> VkDescriptorSet {
+    std::unique_lock lock{ mutex };
+    return allocate_unlocked(layout);
+}
+
+auto vk::descriptor_allocator::allocate(VkDescriptorSetLayout layout, std::span<const descriptor_write> writes) -> VkDescriptorSet {
+    auto set = allocate(layout);
+
+    std::vector<VkWriteDescriptorSet> descriptor_writes(writes.size());
+    for (u64 i = 0; i < writes.size(); i++) {
+        auto& w = descriptor_writes[i];
+        w.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        w.dstSet = set;
+        w.dstBinding = writes[i].binding;
+        w.dstArrayElement = 0;
+        w.descriptorType = writes[i].type;
+        w.descriptorCount = 1;
+        if (writes[i].buffer.buffer != VK_NULL_HANDLE) w.pBufferInfo = &writes[i].buffer;
+        else w.pImageInfo = &writes[i].image;
+    }
+    vkUpdateDescriptorSets(ctx->device, u32(descriptor_writes.size()), descriptor_writes.data(), 0, nullptr);
+    return set;
+}
+
+void vk::descriptor_allocator::free(VkDescriptorSet set) {
+    std::unique_lock lock{ mutex };
+
+    /// The layout may already have been forgotten.
+    if (!sets.contains(set)) return;
+    retired_sets.push_back({ .frame = ctx->frame_number, .set = set });
+}
+
+auto vk::descriptor_allocator::allocate_transient(VkDescriptorSetLayout layout) -> VkDescriptorSet {
+    std::unique_lock lock{ mutex };
+    auto& frame = transient_pools[ctx->current_frame];
+
+    /// Try the current pool first, then move on to the next one, creating it if need be.
+    VkDescriptorSet set;
+    for (;;) {
+        bool fresh = frame.current == frame.pools.size();
+        if (fresh) frame.pools.push_back(create_pool(max_sets_per_pool, 0));
+        auto res = allocate_from(frame.pools[frame.current], layout, set);
+        if (res == VK_SUCCESS) return set;
+        if (fresh || !pool_exhausted(res)) assert_success(res, "failed to allocate transient descriptor set");
+        frame.current++;
+    }
+}
+
+void vk::descriptor_allocator::reset_transient(u32 frame) {
+    std::unique_lock lock{ mutex };
+    auto& f = transient_pools[frame];
+    for (auto pool : f.pools) vkResetDescriptorPool(ctx->device, pool, 0);
+    f.current = 0;
+
+    /// Sets freed during a frame that has completed can be reused.
+    auto completed = ctx->completed_frames();
+    std::erase_if(retired_sets, [&](const retired_set& r) {
+        if (r.frame >= completed) return false;
+        free_sets[sets.at(r.set).layout].push_back(r.set);
+        return true;
+    });
+}
+
+void vk::descriptor_allocator::forget_layout(VkDescriptorSetLayout layout) {
+    std::unique_lock lock{ mutex };
+    free_sets.erase(layout);
+    std::erase_if(retired_sets, [&](const retired_set& r) { return sets.at(r.set).layout == layout; });
+
+    /// Return the sets to their pools.
+    for (auto it = sets.begin(); it != sets.end();) {
+        if (it->second.layout != layout) {
+            ++it;
+            continue;
+        }
+
+        vkFreeDescriptorSets(ctx->device, it->second.pool, 1, &it->first);
+        it = sets.erase(it);
+    }
+}
+
+auto vk::descriptor_allocator::allocate_from(VkDescriptorPool pool, VkDescriptorSetLayout layout, VkDescriptorSet& set) -> VkResult {
+    VkDescriptorSetAllocateInfo alloc_info{};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = pool;
+    alloc_info.descriptorSetCount = 1;
+    alloc_info.pSetLayouts = &layout;
+    return vkAllocateDescriptorSets(ctx->device, &alloc_info, &set);
+}
+
+auto vk::descriptor_allocator::allocate_unlocked(VkDescriptorSetLayout layout) -> VkDescriptorSet {
+    /// Reuse a set that was freed earlier if possible.
+    if (auto it = free_sets.find(layout); it != free_sets.end() && !it->second.empty()) {
+        auto set = it->second.back();
+        it->second.pop_back();
+        return set;
+    }
+
+    /// Chain a new, larger pool if the current one is full.
+    VkDescriptorSet set;
+    if (!pools.empty()) {
+        auto res = allocate_from(pools.back(), layout, set);
+        if (res == VK_SUCCESS) {
+            sets[set] = { .layout = layout, .pool = pools.back() };
+            return set;
+        }
+
+        if (!pool_exhausted(res)) assert_success(res, "failed to allocate descriptor set");
+        sets_per_pool = std::min(sets_per_pool * 2, max_sets_per_pool);
+    }
+
+    pools.push_back(create_pool(sets_per_pool, VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT));
+    assert_success(allocate_from(pools.back(), layout, set), "failed to allocate descriptor set");
+    sets[set] = { .layout = layout, .pool = pools.back() };
+    return set;
+}
+
+auto vk::descriptor_allocator::create_pool(u32 max_sets, VkDescriptorPoolCreateFlags flags) -> VkDescriptorPool {
+    std::vector<VkDescriptorPoolSize> pool_sizes;
+    for (auto [type, ratio] : pool_ratios) pool_sizes.push_back({ type, ratio * max_sets });
+
+    VkDescriptorPoolCreateInfo pool_info{};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.flags = flags;
+    pool_info.maxSets = max_sets;
+    pool_info.poolSizeCount = u32(pool_sizes.size());
+    pool_info.pPoolSizes = pool_sizes.data();
+
+    VkDescriptorPool pool;
+    assert_success(vkCreateDescriptorPool(ctx->device, &pool_info, nullptr, &pool), "failed to create descriptor pool");
+    return pool;
+}
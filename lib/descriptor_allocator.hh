@@ -0,0 +1,100 @@
+#ifndef VULKAN_TEMPLATE_DESCRIPTOR_ALLOCATOR_HH
+#define VULKAN_TEMPLATE_DESCRIPTOR_ALLOCATOR_HH
+#include "utils.hh"
+
+#include <mutex>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+namespace vk {
+struct context;
+
+/// The contents of a single binding of a descriptor set.
+struct descriptor_write {
+    u32 binding;
+    VkDescriptorType type;
+    VkDescriptorBufferInfo buffer{};
+    VkDescriptorImageInfo image{};
+};
+
+/// Allocates descriptor sets from a growing list of pools.
+///
+/// There are two ways of getting a set:
+///   - allocate() returns a set that is owned by the caller until it is freed.
+///   - allocate_transient() returns a set that is only valid until the current
+///     frame slot is reused; these pools are reset wholesale every frame.
+///
+/// Sets that are freed are kept and handed out again the next time a set with
+/// the same layout is requested, but only once every frame that was in flight
+/// when they were freed has completed.
+struct descriptor_allocator {
+    /// Information about a persistent set.
+    struct set_info {
+        VkDescriptorSetLayout layout = VK_NULL_HANDLE;
+        VkDescriptorPool pool = VK_NULL_HANDLE;
+    };
+
+    /// A set that was freed during `frame`.
+    struct retired_set {
+        u64 frame;
+        VkDescriptorSet set;
+    };
+
+    /// Transient pools for one frame slot.
+    struct frame_pools {
+        std::vector<VkDescriptorPool> pools;
+        u64 current = 0;
+    };
+
+    context* ctx;
+
+    /// Persistent pools. The last pool is the one we're allocating from.
+    std::vector<VkDescriptorPool> pools;
+    u32 sets_per_pool = 64;
+
+    /// Transient pools, indexed by frame.
+    std::vector<frame_pools> transient_pools;
+
+    /// Bookkeeping.
+    std::unordered_map<VkDescriptorSet, set_info> sets;
+    std::unordered_map<VkDescriptorSetLayout, std::vector<VkDescriptorSet>> free_sets;
+    std::vector<retired_set> retired_sets;
+    std::mutex mutex;
+
+    explicit descriptor_allocator(context* ctx);
+    ~descriptor_allocator();
+
+    nocopy(descriptor_allocator);
+    nomove(descriptor_allocator);
+
+    /// Allocate a set that is owned by the caller.
+    auto allocate(VkDescriptorSetLayout layout) -> VkDescriptorSet;
+
+    /// Allocate a set that is owned by the caller and write its contents.
+    auto allocate(VkDescriptorSetLayout layout, std::span<const descriptor_write> writes) -> VkDescriptorSet;
+
+    /// Free a set obtained from allocate(). Frames that are still in flight may
+    /// be using it, so it is only reused once they have completed.
+    void free(VkDescriptorSet set);
+
+    /// Allocate a set that is valid for the current frame only.
+    auto allocate_transient(VkDescriptorSetLayout layout) -> VkDescriptorSet;
+
+    /// Reset the transient pools of a frame slot and recycle freed sets that
+    /// are no longer in use. Only call this once the GPU is done with the frame.
+    void reset_transient(u32 frame);
+
+    /// Free all sets with the given layout. This must be called before a
+    /// layout is destroyed so that we don't hand out sets with a dead layout.
+    void forget_layout(VkDescriptorSetLayout layout);
+
+    /// INTERNAL:
+    auto allocate_from(VkDescriptorPool pool, VkDescriptorSetLayout layout, VkDescriptorSet& set) -> VkResult;
+    auto allocate_unlocked(VkDescriptorSetLayout layout) -> VkDescriptorSet;
+    auto create_pool(u32 max_sets, VkDescriptorPoolCreateFlags flags) -> VkDescriptorPool;
+};
+
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_DESCRIPTOR_ALLOCATOR_HH
@@ -0,0 +1,226 @@
+#include "frame_monitor.hh"
+
+#include "context.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+
+namespace {
+auto source_name(vk::stutter::source s) -> std::string_view {
+    switch (s) {
+        case vk::stutter::source::cpu: return "cpu";
+        case vk::stutter::source::gpu: return "gpu";
+        case vk::stutter::source::present: return "present";
+    }
+
+    return "unknown";
+}
+
+auto stats_json(const vk::stutter& s) -> std::string {
+    auto json = fmt::format(
+        "{{\"frame\":{},\"source\":\"{}\",\"ms\":{:.3f},\"median_ms\":{:.3f},\"causes\":\"{}\"",
+        s.frame,
+        source_name(s.what),
+        s.ms,
+        s.median_ms,
+        s.causes
+    );
+
+    if (s.has_stats) {
+        const auto& f = s.stats;
+        json += fmt::format(
+            ",\"draw_calls\":{},\"triangles\":{},\"pipeline_binds\":{},\"descriptor_binds\":{},\"vertex_binds\":{},"
+            "\"push_constants\":{},\"uploads\":{},\"upload_bytes\":{},\"pipeline_compiles\":{},\"swap_chain_recreates\":{}",
+            f.draw_calls,
+            f.triangles,
+            f.pipeline_binds,
+            f.descriptor_binds,
+            f.vertex_binds,
+            f.push_constants,
+            f.uploads,
+            f.upload_bytes,
+            f.pipeline_compiles,
+            f.swap_chain_recreates
+        );
+    }
+
+    json += "}\n";
+    return json;
+}
+} // namespace
+
+/// ======================================================================
+///  Histogram
+/// ======================================================================
+auto vk::frame_time_histogram::bucket(f64 ms) -> u64 {
+    return std::min(u64(std::max(ms, 0.) / bucket_ms), bucket_count - 1);
+}
+
+void vk::frame_time_histogram::add(f64 ms) {
+    auto& slot = samples[count % window];
+    if (count >= window) buckets[bucket(slot)]--;
+    slot = ms;
+    buckets[bucket(ms)]++;
+    count++;
+}
+
+auto vk::frame_time_histogram::percentile(f64 p) const -> f64 {
+    auto n = size();
+    if (n == 0) return 0;
+
+    std::array<f64, window> sorted;
+    std::copy_n(samples.begin(), n, sorted.begin());
+    auto nth = sorted.begin() + i64(std::min(u64(p * f64(n)), n - 1));
+    std::nth_element(sorted.begin(), nth, sorted.begin() + i64(n));
+    return *nth;
+}
+
+/// ======================================================================
+///  Monitor
+/// ======================================================================
+void vk::frame_monitor::end_frame(u64 frame, f64 cpu_ms) {
+    if (ctx->stats.recorded.frame == frame) recent_stats[frame % recent_stats.size()] = ctx->stats.recorded;
+    check(cpu, stutter::source::cpu, frame, cpu_ms);
+
+    /// Present intervals that have come in since the last frame.
+    const auto& pacer = ctx->pacer;
+    auto first = std::max(last_present_count, pacer.present_count - std::min(pacer.present_count, frame_pacer::window));
+    for (auto i = first; i < pacer.present_count; i++) check(present, stutter::source::present, frame, pacer.present_intervals[i % frame_pacer::window]);
+    last_present_count = pacer.present_count;
+
+    /// GPU times arrive late, and only if the GPU profiler is enabled.
+    if (ctx->gpu_profile) {
+        auto* latest = ctx->gpu_profile->latest();
+        if (latest && latest->frame != last_gpu_frame) {
+            last_gpu_frame = latest->frame;
+            check(gpu, stutter::source::gpu, latest->frame, latest->zones.front().duration_ms);
+        }
+    }
+}
+
+void vk::frame_monitor::check(frame_time_histogram& h, stutter::source what, u64 frame, f64 ms) {
+    /// Compare against the median before this frame.
+    bool warm = h.size() >= min_samples;
+    auto median = warm ? h.percentile(.5) : 0.;
+    h.add(ms);
+    if (!warm || median <= 0 || ms <= stutter_factor * median) return;
+
+    /// A single hitch usually shows up in more than one measurement.
+    if (stutter_count && frame < last_stutter_frame + cooldown_frames) return;
+    last_stutter_frame = frame;
+    stutter_count++;
+
+    stutter s{
+        .frame = frame,
+        .what = what,
+        .ms = ms,
+        .median_ms = median,
+        .stats = {},
+        .has_stats = false,
+        .causes = {},
+        .dump_path = {},
+    };
+
+    if (auto& f = recent_stats[frame % recent_stats.size()]; f.frame == frame) {
+        s.stats = f;
+        s.has_stats = true;
+
+        auto add_cause = [&](std::string_view cause) {
+            if (!s.causes.empty()) s.causes += ", ";
+            s.causes += cause;
+        };
+
+        if (f.pipeline_compiles) add_cause("pipeline compile");
+        if (f.swap_chain_recreates) add_cause("swap chain recreate");
+        if (f.upload_bytes >= upload_threshold_bytes) add_cause("upload");
+    }
+
+    info(
+        "[Vulkan] Stutter in frame {}: {} time {:.2f} ms (median {:.2f} ms){}",
+        frame,
+        source_name(what),
+        ms,
+        median,
+        s.causes.empty() ? "" : fmt::format("; likely cause: {}", s.causes)
+    );
+
+    if (!dump_dir.empty()) dump(s);
+    stutters.push_back(std::move(s));
+    if (stutters.size() > history_size) stutters.pop_front();
+}
+
+void vk::frame_monitor::dump(stutter& s) {
+    auto dir = std::filesystem::path(dump_dir) / fmt::format("frame_{}_{}", s.frame, source_name(s.what));
+    s.dump_path = dir.string();
+
+    /// The GPU profile changes every frame, so copy it now. The CPU trace is
+    /// safe to read from any thread.
+    auto json = stats_json(s);
+    auto gpu_csv = ctx->gpu_profile ? ctx->gpu_profile->csv() : std::string{};
+    if (!dump_thread) dump_thread = std::make_unique<thread_pool>(1);
+    dump_thread->submit([dir = std::move(dir), json = std::move(json), gpu_csv = std::move(gpu_csv), trace_frames = dump_trace_frames] {
+        CPU_ZONE("stutter snapshot");
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec) {
+            err("[Vulkan] Could not create stutter snapshot directory \"{}\": {}", dir.string(), ec.message());
+            return;
+        }
+
+        auto write = [&](std::string_view name, const std::string& data) {
+            auto path = (dir / name).string();
+            if (!write_file_atomic(path, data.data(), data.size())) err("[Vulkan] Could not write \"{}\": {}", path, ::strerror(errno));
+        };
+
+        write("stats.json", json);
+        if (!gpu_csv.empty()) write("gpu_profile.csv", gpu_csv);
+
+#ifdef ENABLE_CPU_PROFILING
+        cpu_profiler::write_chrome_trace((dir / "cpu_trace.json").string(), trace_frames);
+#else
+        static_cast<void>(trace_frames);
+#endif
+    });
+}
+
+void vk::frame_monitor::draw_ui() {
+    if (!ImGui::Begin("Frame Times")) {
+        ImGui::End();
+        return;
+    }
+
+    auto histogram = [&](const char* name, const frame_time_histogram& h) {
+        if (h.size() == 0) {
+            ImGui::TextUnformatted(fmt::format("{}: no samples", name).c_str());
+            return;
+        }
+
+        auto overlay = fmt::format(
+            "{}: p50 {:.2f} / p95 {:.2f} / p99 {:.2f} ms",
+            name,
+            h.percentile(.5),
+            h.percentile(.95),
+            h.percentile(.99)
+        );
+
+        ImGui::PushID(name);
+        ImGui::PlotHistogram("##histogram", h.buckets.data(), int(h.buckets.size()), 0, overlay.c_str(), 0.f, f32(h.size()) / 4.f, ImVec2(-1, 60));
+        ImGui::PopID();
+    };
+
+    histogram("CPU", cpu);
+    histogram("GPU", gpu);
+    histogram("Present", present);
+
+    ImGui::InputDouble("Stutter factor", &stutter_factor, .1, 1., "%.1f");
+    ImGui::TextUnformatted(fmt::format("{} stutters", stutter_count).c_str());
+    for (auto it = stutters.rbegin(); it != stutters.rend(); ++it) {
+        auto line = fmt::format("Frame {}: {} {:.2f} ms (median {:.2f} ms)", it->frame, source_name(it->what), it->ms, it->median_ms);
+        if (!it->causes.empty()) line += fmt::format(" [{}]", it->causes);
+        ImGui::TextUnformatted(line.c_str());
+        if (!it->dump_path.empty() && ImGui::IsItemHovered()) ImGui::SetTooltip("%s", it->dump_path.c_str());
+    }
+
+    ImGui::End();
+}
@@ -0,0 +1,141 @@
+#ifndef VULKAN_TEMPLATE_FRAME_MONITOR_HH
+#define VULKAN_TEMPLATE_FRAME_MONITOR_HH
+#include "render_stats.hh"
+#include "thread_pool.hh"
+#include "utils.hh"
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace vk {
+struct context;
+
+/// Rolling histogram of one kind of frame time.
+struct frame_time_histogram {
+    /// Number of samples that the histogram covers.
+    static constexpr u64 window = 512;
+
+    /// Buckets are half a millisecond wide; the last one also counts everything slower.
+    static constexpr f64 bucket_ms = .5;
+    static constexpr u64 bucket_count = 100;
+
+    std::array<f64, window> samples{};
+    std::array<f32, bucket_count> buckets{};
+    u64 count = 0;
+
+    /// Add a sample, replacing the oldest one if the window is full.
+    void add(f64 ms);
+
+    /// Number of samples in the window.
+    auto size() const -> u64 { return std::min(count, window); }
+
+    /// Get a percentile of the samples in the window, e.g. 0.5 for the median.
+    auto percentile(f64 p) const -> f64;
+
+    /// INTERNAL:
+    static auto bucket(f64 ms) -> u64;
+};
+
+/// A frame that took much longer than usual.
+struct stutter {
+    enum struct source : u8 {
+        cpu,
+        gpu,
+        present,
+    };
+
+    /// The frame and which of its times was too slow.
+    u64 frame;
+    source what;
+    f64 ms;
+    f64 median_ms;
+
+    /// The counters of the frame, if they're still around.
+    frame_stats stats;
+    bool has_stats;
+
+    /// Likely causes, e.g. "pipeline compile"; empty if nothing stood out.
+    std::string causes;
+
+    /// Directory the snapshot is written to; empty if none was written. The
+    /// snapshot is written in the background, so it may not be complete yet.
+    std::string dump_path;
+};
+
+/// Keeps rolling histograms of the CPU time, GPU time, and present-to-present
+/// interval of every frame, and flags frames that are more than `stutter_factor`
+/// times slower than the rolling median.
+///
+/// If a dump directory is set, every stutter also writes a snapshot of the CPU
+/// trace, the GPU profile, and the counters of the frame to a subdirectory; the
+/// counters show whether there was an upload, a swap chain recreation, or a
+/// pipeline compile in that frame. The render thread only copies what's in the
+/// snapshot; the files are written on a background thread so that writing them
+/// doesn't cause a stutter of its own. A single hitch tends to show up in more
+/// than one measurement, so nothing is flagged for `cooldown_frames` frames
+/// after a stutter.
+///
+/// GPU times are only available if GPU profiling is enabled, and they come in a
+/// few frames late, like everything else the GPU profiler measures.
+struct frame_monitor {
+    /// Number of stutters that are kept around.
+    static constexpr u64 history_size = 64;
+
+    context* ctx;
+
+    /// Histograms.
+    frame_time_histogram cpu;
+    frame_time_histogram gpu;
+    frame_time_histogram present;
+
+    /// Detection settings.
+    f64 stutter_factor = 2.5;
+    u64 min_samples = 60;
+    u64 cooldown_frames = 30;
+
+    /// Uploads larger than this are reported as a likely cause.
+    u64 upload_threshold_bytes = 1 << 20;
+
+    /// Where to write snapshots; empty to disable them. See enable_stutter_capture().
+    std::string dump_dir;
+
+    /// Number of frames to include in the CPU trace of a snapshot.
+    u32 dump_trace_frames = 30;
+
+    /// Recent stutters, oldest first, and the number of stutters so far.
+    std::deque<stutter> stutters;
+    u64 stutter_count = 0;
+
+    /// Counters of recent frames, indexed by frame number.
+    std::array<frame_stats, 16> recent_stats{};
+
+    /// Last frame that was flagged, and the last results we've consumed.
+    u64 last_stutter_frame = 0;
+    u64 last_gpu_frame = u64(-1);
+    u64 last_present_count = 0;
+
+    /// Writes snapshots; created when the first one is taken.
+    std::unique_ptr<thread_pool> dump_thread;
+
+    explicit frame_monitor(context* ctx) : ctx(ctx) {}
+
+    nocopy(frame_monitor);
+    nomove(frame_monitor);
+
+    /// Draw the histograms and the recent stutters. Call this between
+    /// ImGui_Begin() and ImGui_End().
+    void draw_ui();
+
+    /// INTERNAL:
+    void end_frame(u64 frame, f64 cpu_ms);
+    void check(frame_time_histogram& h, stutter::source what, u64 frame, f64 ms);
+    void dump(stutter& s);
+};
+
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_FRAME_MONITOR_HH
@@ -0,0 +1,77 @@
+#include "frame_pacer.hh"
+
+#include <cmath>
+#include <thread>
+
+namespace {
+using namespace std::chrono_literals;
+
+/// Bounds for the spin margin.
+constexpr auto min_spin_margin = 200us;
+constexpr auto max_spin_margin = 4ms;
+
+f64 to_ms(vk::frame_pacer::clock::duration d) {
+    return std::chrono::duration<f64, std::milli>(d).count();
+}
+} // namespace
+
+void vk::frame_pacer::set_target_fps(f64 fps) {
+    period = fps > 0 ? std::chrono::duration_cast<clock::duration>(std::chrono::duration<f64>(1 / fps)) : clock::duration::zero();
+    deadline = {};
+}
+
+void vk::frame_pacer::wait() {
+    if (!enabled()) return;
+
+    auto now = clock::now();
+    if (deadline == clock::time_point{}) deadline = now;
+
+    /// Sleep for most of the remaining time, and adjust the margin depending
+    /// on how far we overslept: grow it quickly, shrink it slowly.
+    if (auto sleep_until = deadline - spin_margin; now < sleep_until) {
+        std::this_thread::sleep_until(sleep_until);
+        auto overslept = clock::now() - sleep_until;
+        if (overslept > spin_margin / 2) spin_margin = std::min<clock::duration>(spin_margin * 2, max_spin_margin);
+        else spin_margin = std::max<clock::duration>(spin_margin - spin_margin / 16, min_spin_margin);
+    }
+
+    /// Spin for the rest.
+    while (clock::now() < deadline) std::this_thread::yield();
+
+    now = clock::now();
+    wake_errors[wake_count++ % window] = to_ms(now - deadline);
+
+    /// If we've fallen behind by more than a frame, don't try to catch up.
+    deadline += period;
+    if (deadline < now) deadline = now + period;
+}
+
+void vk::frame_pacer::on_present(clock::time_point when) {
+    if (last_present != clock::time_point{}) present_intervals[present_count++ % window] = to_ms(when - last_present);
+    last_present = when;
+}
+
+auto vk::frame_pacer::stats() const -> frame_pacing_stats {
+    frame_pacing_stats s{};
+    s.target_interval_ms = to_ms(period);
+
+    if (auto n = std::min(present_count, window)) {
+        for (u64 i = 0; i < n; i++) s.mean_interval_ms += present_intervals[i];
+        s.mean_interval_ms /= f64(n);
+
+        f64 variance = 0;
+        for (u64 i = 0; i < n; i++) {
+            auto deviation = present_intervals[i] - s.mean_interval_ms;
+            variance += deviation * deviation;
+            s.max_deviation_ms = std::max(s.max_deviation_ms, std::abs(deviation));
+        }
+        s.jitter_ms = std::sqrt(variance / f64(n));
+    }
+
+    if (auto n = std::min(wake_count, window)) {
+        for (u64 i = 0; i < n; i++) s.mean_wake_error_ms += wake_errors[i];
+        s.mean_wake_error_ms /= f64(n);
+    }
+
+    return s;
+}
@@ -0,0 +1,71 @@
+#ifndef VULKAN_TEMPLATE_FRAME_PACER_HH
+#define VULKAN_TEMPLATE_FRAME_PACER_HH
+#include "utils.hh"
+
+#include <array>
+#include <chrono>
+
+namespace vk {
+
+/// Statistics about how evenly frames are paced. All times are in milliseconds
+/// and refer to the last `frame_pacer::window` frames.
+struct frame_pacing_stats {
+    /// The interval we're aiming for; 0 if there is no limit.
+    f64 target_interval_ms;
+
+    /// Mean time between presents, and its standard deviation.
+    f64 mean_interval_ms;
+    f64 jitter_ms;
+
+    /// Largest deviation of a single interval from the mean.
+    f64 max_deviation_ms;
+
+    /// How late wait() returned after its deadline, on average.
+    f64 mean_wake_error_ms;
+};
+
+/// Limits the frame rate of the main loop.
+///
+/// Sleeping is imprecise, so wait() sleeps until shortly before the deadline
+/// and spins for the rest. The spin margin adapts to how much the OS tends
+/// to oversleep, so we only burn as much CPU time as we have to.
+struct frame_pacer {
+    using clock = std::chrono::steady_clock;
+    static constexpr u64 window = 128;
+
+    /// Time between frames. Zero means no limit.
+    clock::duration period{};
+
+    /// Deadline for the next frame.
+    clock::time_point deadline{};
+
+    /// How long before the deadline we stop sleeping and start spinning.
+    clock::duration spin_margin = std::chrono::milliseconds(1);
+
+    /// Measurements.
+    std::array<f64, window> present_intervals{};
+    std::array<f64, window> wake_errors{};
+    clock::time_point last_present{};
+    u64 present_count = 0;
+    u64 wake_count = 0;
+
+    /// Set the target frame rate. 0 disables the limit.
+    void set_target_fps(f64 fps);
+
+    /// Whether a frame rate limit is set.
+    bool enabled() const { return period != clock::duration::zero(); }
+
+    /// Wait until it's time to start the next frame.
+    void wait();
+
+    /// Record when a frame was presented. This is as precise as the caller's
+    /// knowledge of when the image actually reached the screen.
+    void on_present(clock::time_point when);
+
+    /// Get the current statistics.
+    auto stats() const -> frame_pacing_stats;
+};
+
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_FRAME_PACER_HH
@@ -0,0 +1,210 @@
+#include "frame_readback.hh"
+
+#include "context.hh"
+
+#include <algorithm>
+
+namespace {
+/// Size of a pixel of a format that we might render to.
+auto bytes_per_pixel(VkFormat format) -> VkDeviceSize {
+    switch (format) {
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+        case VK_FORMAT_A8B8G8R8_UNORM_PACK32:
+        case VK_FORMAT_A8B8G8R8_SRGB_PACK32:
+        case VK_FORMAT_A2R10G10B10_UNORM_PACK32:
+        case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+        case VK_FORMAT_B10G11R11_UFLOAT_PACK32:
+            return 4;
+        case VK_FORMAT_R5G6B5_UNORM_PACK16:
+        case VK_FORMAT_B5G6R5_UNORM_PACK16:
+        case VK_FORMAT_A1R5G5B5_UNORM_PACK16:
+            return 2;
+        case VK_FORMAT_R16G16B16A16_UNORM:
+        case VK_FORMAT_R16G16B16A16_SFLOAT:
+            return 8;
+        case VK_FORMAT_R32G32B32A32_SFLOAT:
+            return 16;
+        default:
+            die("[Vulkan] Readback does not support swap chain format {}", i32(format));
+    }
+}
+
+/// Pick a host-visible memory type, preferring cached memory since the CPU reads
+/// every byte of it; uncached reads are painfully slow.
+auto find_readback_memory_type(VkPhysicalDevice dev, u32 type_filter, bool& coherent) -> u32 {
+    VkPhysicalDeviceMemoryProperties mem_properties;
+    vkGetPhysicalDeviceMemoryProperties(dev, &mem_properties);
+
+    const VkMemoryPropertyFlags preferences[] = {
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+    };
+
+    for (auto properties : preferences) {
+        for (u32 i = 0; i < mem_properties.memoryTypeCount; i++) {
+            auto flags = mem_properties.memoryTypes[i].propertyFlags;
+            if ((type_filter & (1 << i)) && (flags & properties) == properties) {
+                coherent = flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+                return i;
+            }
+        }
+    }
+
+    die("[Vulkan] Failed to find host-visible memory for readback");
+}
+
+void image_barrier(VkCommandBuffer command_buffer, VkImage image, VkImageLayout old_layout, VkImageLayout new_layout,
+    VkPipelineStageFlags src_stage, VkAccessFlags src_access, VkPipelineStageFlags dst_stage, VkAccessFlags dst_access) {
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = old_layout;
+    barrier.newLayout = new_layout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    barrier.srcAccessMask = src_access;
+    barrier.dstAccessMask = dst_access;
+    vkCmdPipelineBarrier(command_buffer, src_stage, dst_stage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+} // namespace
+
+vk::frame_readback::frame_readback(context* ctx, callback on_frame) : ctx(ctx), on_frame(std::move(on_frame)) {
+    slots.resize(ctx->frames_in_flight);
+}
+
+vk::frame_readback::~frame_readback() {
+    for (auto& s : slots) release(s);
+}
+
+void vk::frame_readback::collect() {
+    /// Deliver in the order the frames were rendered.
+    std::vector<slot*> ready;
+    for (auto& s : slots)
+        if (s.pending && ctx->frame_completed(s.frame)) ready.push_back(&s);
+    std::ranges::sort(ready, {}, &slot::frame);
+
+    for (auto* s : ready) {
+        auto size = VkDeviceSize(s->extent.width) * s->extent.height * bytes_per_pixel(s->format);
+        if (!coherent) {
+            VkMappedMemoryRange range{};
+            range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+            range.memory = s->memory;
+            range.offset = 0;
+            range.size = VK_WHOLE_SIZE;
+            assert_success(vkInvalidateMappedMemoryRanges(ctx->device, 1, &range), "failed to invalidate readback buffer");
+        }
+
+        s->pending = false;
+        frames_delivered++;
+        bytes_delivered += size;
+        on_frame({
+            .frame = s->frame,
+            .extent = s->extent,
+            .format = s->format,
+            .pixels = { static_cast<const std::byte*>(s->mapped), size },
+        });
+    }
+}
+
+void vk::frame_readback::record(VkCommandBuffer command_buffer) {
+    auto& s = slots[ctx->frame_number % slots.size()];
+
+    /// This only happens if the frame that last used this slot is still running,
+    /// which the frame slots already prevent, but better safe than sorry.
+    if (s.pending) {
+        ctx->wait_for_frame(s.frame);
+        collect();
+    }
+
+    /// The swap chain may have been resized since this slot was last used.
+    auto extent = ctx->swap_chain_extent;
+    auto format = ctx->swap_chain_image_format;
+    auto size = VkDeviceSize(extent.width) * extent.height * bytes_per_pixel(format);
+    if (s.size < size) allocate(s, size);
+
+    /// Make the rendered image available to the copy. The layout at the end of the
+    /// frame is TRANSFER_SRC_OPTIMAL in headless mode, in which case this is just
+    /// an execution and memory dependency.
+    auto image = ctx->swap_chain_images[ctx->current_image_index];
+    auto layout = ctx->present_layout();
+    image_barrier(command_buffer, image, layout, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+
+    VkBufferImageCopy region{};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    region.imageOffset = { 0, 0, 0 };
+    region.imageExtent = { extent.width, extent.height, 1 };
+    vkCmdCopyImageToBuffer(command_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, s.buffer, 1, &region);
+
+    /// Put the image back the way we found it.
+    if (layout != VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
+        image_barrier(command_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, layout,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+    }
+
+    /// And make the copy visible to the host once the frame is done.
+    VkBufferMemoryBarrier host_barrier{};
+    host_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    host_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    host_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    host_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    host_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    host_barrier.buffer = s.buffer;
+    host_barrier.offset = 0;
+    host_barrier.size = size;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &host_barrier, 0, nullptr);
+
+    s.frame = ctx->frame_number;
+    s.extent = extent;
+    s.format = format;
+    s.pending = true;
+}
+
+void vk::frame_readback::set_slot_count(u32 count) {
+    /// The device is idle, so all copies are done and can be delivered
+    /// before the slots move around.
+    collect();
+    for (u64 i = count; i < slots.size(); i++) release(slots[i]);
+    slots.resize(count);
+}
+
+void vk::frame_readback::allocate(slot& s, VkDeviceSize size) {
+    release(s);
+
+    VkBufferCreateInfo buffer_info{};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = size;
+    buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    assert_success(vkCreateBuffer(ctx->device, &buffer_info, nullptr, &s.buffer), "failed to create readback buffer");
+
+    VkMemoryRequirements mem_requirements;
+    vkGetBufferMemoryRequirements(ctx->device, s.buffer, &mem_requirements);
+
+    VkMemoryAllocateInfo alloc_info{};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = mem_requirements.size;
+    alloc_info.memoryTypeIndex = find_readback_memory_type(ctx->physical_device, mem_requirements.memoryTypeBits, coherent);
+    assert_success(vkAllocateMemory(ctx->device, &alloc_info, nullptr, &s.memory), "failed to allocate readback buffer memory");
+    vkBindBufferMemory(ctx->device, s.buffer, s.memory, 0);
+
+    /// The buffer stays mapped for as long as it exists.
+    assert_success(vkMapMemory(ctx->device, s.memory, 0, VK_WHOLE_SIZE, 0, &s.mapped), "failed to map readback buffer");
+    s.size = size;
+}
+
+void vk::frame_readback::release(slot& s) {
+    if (s.buffer == VK_NULL_HANDLE) return;
+    vkUnmapMemory(ctx->device, s.memory);
+    vkDestroyBuffer(ctx->device, s.buffer, nullptr);
+    vkFreeMemory(ctx->device, s.memory, nullptr);
+    s = {};
+}
@@ -0,0 +1,89 @@
+#ifndef VULKAN_TEMPLATE_FRAME_READBACK_HH
+#define VULKAN_TEMPLATE_FRAME_READBACK_HH
+#include "utils.hh"
+
+#include <functional>
+#include <span>
+#include <vector>
+
+namespace vk {
+struct context;
+
+/// A rendered frame that has been copied to host memory.
+struct readback_frame {
+    /// The frame number of the frame that was rendered.
+    u64 frame;
+
+    /// Size and format of the image. Rows are tightly packed.
+    VkExtent2D extent;
+    VkFormat format;
+
+    /// The pixels. These are only valid during the callback.
+    std::span<const std::byte> pixels;
+};
+
+/// Copies the final colour image of every frame into host memory.
+///
+/// The copy is recorded at the end of the frame's command buffer into one of a
+/// ring of host-cached buffers. Once the GPU is done with the frame, the callback
+/// is called with the pixels at the start of a later frame; we never wait for a
+/// copy to finish, so readback does not stall the render loop.
+///
+/// The callback runs on the thread that draws frames. Anything that is expensive,
+/// e.g. encoding, should copy the pixels and do the actual work elsewhere.
+struct frame_readback {
+    using callback = std::function<void(const readback_frame&)>;
+
+    /// A buffer in the ring.
+    struct slot {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        void* mapped = nullptr;
+        VkDeviceSize size = 0;
+
+        /// The frame whose copy is in this buffer, if any.
+        u64 frame = 0;
+        VkExtent2D extent{};
+        VkFormat format{};
+        bool pending = false;
+    };
+
+    context* ctx;
+    callback on_frame;
+
+    /// One buffer per frame in flight, so a slot is always free by the time
+    /// a frame that wants to reuse it is recorded.
+    std::vector<slot> slots;
+
+    /// Whether the buffers' memory is host-coherent; if not, we need to invalidate it.
+    bool coherent = false;
+
+    /// Statistics.
+    u64 frames_delivered = 0;
+    u64 bytes_delivered = 0;
+
+    frame_readback(context* ctx, callback on_frame);
+    ~frame_readback();
+
+    nocopy(frame_readback);
+    nomove(frame_readback);
+
+    /// Deliver all copies that have finished, oldest first.
+    void collect();
+
+    /// Record the copy of the current swap chain image into `command_buffer`. The
+    /// image must be in the layout it is left in at the end of a frame.
+    void record(VkCommandBuffer command_buffer);
+
+    /// Change the number of buffers to match the number of frames in flight.
+    /// This may only be called while the device is idle.
+    void set_slot_count(u32 count);
+
+    /// INTERNAL:
+    void allocate(slot& s, VkDeviceSize size);
+    void release(slot& s);
+};
+
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_FRAME_READBACK_HH
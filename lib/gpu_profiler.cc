@@ -0,0 +1,282 @@
+#include "gpu_profiler.hh"
+
+#include "context.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cfloat>
+#include <cstring>
+
+namespace {
+/// Nesting depth of the zones that are currently open on this thread.
+thread_local u32 zone_depth = 0;
+
+/// Pick a stable colour for a zone so it's easy to follow across frames.
+auto zone_colour(std::string_view name) -> ImU32 {
+    auto h = std::hash<std::string_view>{}(name);
+    return IM_COL32(ImU32(80 + h % 150), ImU32(80 + (h >> 8) % 150), ImU32(80 + (h >> 16) % 150), 255);
+}
+} // namespace
+
+vk::gpu_profiler::gpu_profiler(context* ctx, u32 max_zones_per_frame)
+    : ctx(ctx), queries_per_frame(2 * (max_zones_per_frame + 1)) {
+    frames.resize(MAX_FRAMES_IN_FLIGHT);
+
+    /// Timestamps are only supported if the queue has some valid bits.
+    u32 queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(ctx->physical_device, &queue_family_count, nullptr);
+    std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(ctx->physical_device, &queue_family_count, queue_families.data());
+
+    auto valid_bits = queue_families[ctx->find_queue_families(ctx->physical_device).graphics_family.value()].timestampValidBits;
+    if (valid_bits == 0) {
+        info("[Vulkan] GPU profiling is not available: the graphics queue does not support timestamps");
+        return;
+    }
+
+    /// Only the low `valid_bits` bits of a timestamp mean anything, and they wrap around.
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(ctx->physical_device, &props);
+    ns_per_tick = props.limits.timestampPeriod;
+    timestamp_mask = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+
+    VkQueryPoolCreateInfo pool_info{};
+    pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    pool_info.queryCount = queries_per_frame * MAX_FRAMES_IN_FLIGHT;
+    assert_success(vkCreateQueryPool(ctx->device, &pool_info, nullptr, &query_pool), "failed to create timestamp query pool");
+    supported = true;
+}
+
+vk::gpu_profiler::~gpu_profiler() {
+    vkDestroyQueryPool(ctx->device, query_pool, nullptr);
+}
+
+auto vk::gpu_profiler::begin_zone(VkCommandBuffer command_buffer, std::string_view name) -> u32 {
+    if (!supported) return ~0u;
+
+    /// Reserve both queries now so end_zone() doesn't have to allocate anything.
+    u32 zone, query;
+    {
+        std::unique_lock lock{ mutex };
+        auto& f = frames[ctx->current_frame];
+        if (f.next_query + 2 > queries_per_frame) {
+            dropped_zones++;
+            return ~0u;
+        }
+
+        zone = u32(f.zones.size());
+        query = ctx->current_frame * queries_per_frame + f.next_query;
+        f.zones.push_back({ .name = std::string{ name }, .depth = zone_depth + 1, .begin_query = query, .end_query = query + 1 });
+        f.next_query += 2;
+    }
+
+    zone_depth++;
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pool, query);
+    return zone;
+}
+
+void vk::gpu_profiler::end_zone(VkCommandBuffer command_buffer, u32 zone) {
+    if (zone == ~0u) return;
+
+    u32 query;
+    {
+        std::unique_lock lock{ mutex };
+        query = frames[ctx->current_frame].zones[zone].end_query;
+    }
+
+    zone_depth--;
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pool, query);
+}
+
+void vk::gpu_profiler::begin_frame(VkCommandBuffer command_buffer) {
+    if (!supported) return;
+
+    /// The GPU is done with the frame that last used this slot, so its results are ready.
+    auto& f = frames[ctx->current_frame];
+    collect(f);
+
+    /// Queries have to be reset outside of a render pass.
+    u32 base = ctx->current_frame * queries_per_frame;
+    vkCmdResetQueryPool(command_buffer, query_pool, base, queries_per_frame);
+    f.frame = ctx->frame_number;
+    f.zones.clear();
+
+    /// The first zone is always the entire frame.
+    f.zones.push_back({ .name = "Frame", .depth = 0, .begin_query = base, .end_query = base + 1 });
+    f.next_query = 2;
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pool, base);
+}
+
+void vk::gpu_profiler::end_frame(VkCommandBuffer command_buffer) {
+    if (!supported) return;
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pool, ctx->current_frame * queries_per_frame + 1);
+}
+
+void vk::gpu_profiler::collect(frame_queries& f) {
+    if (f.zones.empty() || paused) return;
+
+    /// Each result is followed by its availability. A zone that was begun but never
+    /// ended simply stays unavailable, so there is no need to wait for anything.
+    std::vector<u64> data(2 * f.next_query);
+    auto res = vkGetQueryPoolResults(ctx->device, query_pool, f.zones.front().begin_query, f.next_query, data.size() * sizeof(u64),
+        data.data(), 2 * sizeof(u64), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if (res != VK_NOT_READY) assert_success(res, "failed to get timestamp query results");
+
+    /// Returns false if the query is not available.
+    u32 base = f.zones.front().begin_query;
+    auto timestamp = [&](u32 query, u64& ts) {
+        auto i = 2 * (query - base);
+        if (data[i + 1] == 0) return false;
+        ts = data[i] & timestamp_mask;
+        return true;
+    };
+
+    u64 frame_start;
+    if (!timestamp(base, frame_start)) return;
+
+    /// Deltas are computed modulo the valid bits to handle wraparound.
+    gpu_frame_result result{ .frame = f.frame, .zones = {} };
+    for (const auto& z : f.zones) {
+        u64 begin, end;
+        if (!timestamp(z.begin_query, begin) || !timestamp(z.end_query, end)) continue;
+        result.zones.push_back({
+            .name = z.name,
+            .depth = z.depth,
+            .start_ms = f64((begin - frame_start) & timestamp_mask) * ns_per_tick / 1e6,
+            .duration_ms = f64((end - begin) & timestamp_mask) * ns_per_tick / 1e6,
+        });
+    }
+
+    /// Keep the frame zone first and the rest in the order they ran.
+    if (result.zones.empty() || result.zones.front().depth != 0) return;
+    std::stable_sort(result.zones.begin() + 1, result.zones.end(), [](auto& a, auto& b) { return a.start_ms < b.start_ms; });
+
+    history.push_back(std::move(result));
+    if (history.size() > history_size) history.pop_front();
+}
+
+auto vk::gpu_profiler::latest() const -> const gpu_frame_result* {
+    return history.empty() ? nullptr : &history.back();
+}
+
+auto vk::gpu_profiler::current_depth() -> u32 {
+    return zone_depth;
+}
+
+bool vk::gpu_profiler::export_csv(std::string_view path) const {
+    auto data = csv();
+    if (!write_file_atomic(path, data.data(), data.size())) {
+        err("[Vulkan] Could not write GPU profile \"{}\": {}", path, ::strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+auto vk::gpu_profiler::csv() const -> std::string {
+    std::string csv = "frame,zone,depth,start_ms,duration_ms\n";
+    for (const auto& f : history) {
+        for (const auto& z : f.zones) {
+            /// Quote the name in case it contains commas.
+            std::string name;
+            for (char c : z.name) {
+                if (c == '"') name += '"';
+                name += c;
+            }
+
+            csv += fmt::format("{},\"{}\",{},{:.6f},{:.6f}\n", f.frame, name, z.depth, z.start_ms, z.duration_ms);
+        }
+    }
+
+    return csv;
+}
+
+void vk::gpu_profiler::draw_ui() {
+    if (!ImGui::Begin("GPU Profiler")) {
+        ImGui::End();
+        return;
+    }
+
+    if (!supported) {
+        ImGui::TextUnformatted("Timestamps are not supported on this device.");
+        ImGui::End();
+        return;
+    }
+
+    ImGui::Checkbox("Pause", &paused);
+    ImGui::SameLine();
+    if (ImGui::Button("Export CSV") && export_csv(csv_path)) info("[Vulkan] Wrote GPU profile to \"{}\"", csv_path);
+    if (dropped_zones) {
+        ImGui::SameLine();
+        ImGui::TextUnformatted(fmt::format("({} zones dropped)", dropped_zones).c_str());
+    }
+
+    auto* last = latest();
+    if (!last) {
+        ImGui::TextUnformatted("Waiting for results...");
+        ImGui::End();
+        return;
+    }
+
+    /// GPU time of the entire frame over time.
+    std::vector<f32> frame_times;
+    for (const auto& f : history) frame_times.push_back(f32(f.zones.front().duration_ms));
+    auto overlay = fmt::format("Frame: {:.3f} ms", last->zones.front().duration_ms);
+    ImGui::PlotLines("##frame_times", frame_times.data(), int(frame_times.size()), 0, overlay.c_str(), 0.f, FLT_MAX, ImVec2(-1, 60));
+
+    /// Flame graph of the latest frame.
+    u32 max_depth = 0;
+    for (const auto& z : last->zones) max_depth = std::max(max_depth, z.depth);
+
+    auto* draw_list = ImGui::GetWindowDrawList();
+    auto origin = ImGui::GetCursorScreenPos();
+    auto width = std::max(ImGui::GetContentRegionAvail().x, 1.f);
+    auto row = ImGui::GetTextLineHeightWithSpacing();
+    auto scale = width / f32(std::max(last->zones.front().duration_ms, 1e-6));
+    ImGui::Dummy(ImVec2(width, row * f32(max_depth + 1)));
+
+    for (const auto& z : last->zones) {
+        ImVec2 min{ origin.x + f32(z.start_ms) * scale, origin.y + f32(z.depth) * row };
+        ImVec2 max{ std::max(min.x + 1.f, min.x + f32(z.duration_ms) * scale), min.y + row - 1.f };
+        draw_list->AddRectFilled(min, max, zone_colour(z.name));
+
+        /// Only draw the name if it fits.
+        auto label = fmt::format("{} {:.3f} ms", z.name, z.duration_ms);
+        if (ImGui::CalcTextSize(label.c_str()).x < max.x - min.x - 4.f)
+            draw_list->AddText(ImVec2(min.x + 2.f, min.y), IM_COL32_BLACK, label.c_str());
+
+        if (ImGui::IsMouseHoveringRect(min, max)) ImGui::SetTooltip("%s", label.c_str());
+    }
+
+    /// And the same as a list.
+    for (const auto& z : last->zones) {
+        auto line = fmt::format("{:{}}{}: {:.3f} ms", "", 2 * z.depth, z.name, z.duration_ms);
+        ImGui::TextUnformatted(line.c_str());
+    }
+
+    ImGui::End();
+}
+
+/// ======================================================================
+///  Scope
+/// ======================================================================
+vk::gpu_scope::gpu_scope(context* ctx, VkCommandBuffer& command_buffer, std::string_view name)
+    : profiler(ctx->gpu_profile.get()), command_buffer(&command_buffer) {
+    zone = profiler ? profiler->begin_zone(command_buffer, name) : ~0u;
+}
+
+vk::gpu_scope::~gpu_scope() {
+    if (profiler) profiler->end_zone(*command_buffer, zone);
+}
+
+/// ======================================================================
+///  Parent
+/// ======================================================================
+vk::gpu_zone_parent::gpu_zone_parent(u32 depth) : saved_depth(zone_depth) {
+    zone_depth = depth;
+}
+
+vk::gpu_zone_parent::~gpu_zone_parent() {
+    zone_depth = saved_depth;
+}
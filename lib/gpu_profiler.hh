@@ -0,0 +1,146 @@
+#ifndef VULKAN_TEMPLATE_GPU_PROFILER_HH
+#define VULKAN_TEMPLATE_GPU_PROFILER_HH
+#include "utils.hh"
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace vk {
+struct context;
+
+/// Timing of a single zone. Times are in milliseconds, relative to the start of the frame.
+struct gpu_zone_result {
+    std::string name;
+    u32 depth;
+    f64 start_ms;
+    f64 duration_ms;
+};
+
+/// Timings of all zones in a frame. The first zone is the whole frame.
+struct gpu_frame_result {
+    u64 frame;
+    std::vector<gpu_zone_result> zones;
+};
+
+/// Measures how long the GPU spends on parts of a frame using timestamp queries.
+///
+/// Every frame slot has its own range of queries in a single query pool. The
+/// queries are reset at the start of the frame, and the results are read once
+/// the GPU is done with the frame, i.e. when the slot is reused; we thus never
+/// wait for a query.
+///
+/// Zones may nest, and they may be recorded from several threads at once, e.g.
+/// in record_parallel(). If the device does not support timestamps on the
+/// graphics queue, all of this does nothing.
+struct gpu_profiler {
+    /// A zone whose timestamps have been recorded, but not read back yet.
+    struct pending_zone {
+        std::string name;
+        u32 depth;
+        u32 begin_query;
+        u32 end_query = ~0u;
+    };
+
+    /// Zones and queries of one frame slot.
+    struct frame_queries {
+        u64 frame = 0;
+        u32 next_query = 0;
+        std::vector<pending_zone> zones;
+    };
+
+    /// Number of frames whose results are kept around.
+    static constexpr u64 history_size = 240;
+
+    context* ctx;
+    VkQueryPool query_pool = VK_NULL_HANDLE;
+
+    /// Whether the device supports timestamps at all.
+    bool supported = false;
+
+    /// Nanoseconds per tick, and the bits of a timestamp that are valid.
+    f64 ns_per_tick = 1;
+    u64 timestamp_mask = ~0ull;
+
+    /// Query state, indexed by frame.
+    u32 queries_per_frame;
+    std::vector<frame_queries> frames;
+    std::mutex mutex;
+
+    /// Results, oldest first.
+    std::deque<gpu_frame_result> history;
+
+    /// Zones that didn't fit into the query pool.
+    u64 dropped_zones = 0;
+
+    /// UI state.
+    bool paused = false;
+    std::string csv_path = "gpu_profile.csv";
+
+    gpu_profiler(context* ctx, u32 max_zones_per_frame);
+    ~gpu_profiler();
+
+    nocopy(gpu_profiler);
+    nomove(gpu_profiler);
+
+    /// Begin a zone. Returns a handle to pass to end_zone().
+    auto begin_zone(VkCommandBuffer command_buffer, std::string_view name) -> u32;
+
+    /// End a zone.
+    void end_zone(VkCommandBuffer command_buffer, u32 zone);
+
+    /// Draw the profiler window. Call this between ImGui_Begin() and ImGui_End().
+    void draw_ui();
+
+    /// Write the frames in the history to a CSV file. Returns false on error.
+    bool export_csv(std::string_view path) const;
+
+    /// Format the frames in the history as CSV.
+    auto csv() const -> std::string;
+
+    /// Get the results of the most recent frame that has finished, if any.
+    auto latest() const -> const gpu_frame_result*;
+
+    /// Nesting depth of the zones that are currently open on this thread.
+    static auto current_depth() -> u32;
+
+    /// INTERNAL:
+    void begin_frame(VkCommandBuffer command_buffer);
+    void end_frame(VkCommandBuffer command_buffer);
+    void collect(frame_queries& f);
+};
+
+/// Makes zones begun on a worker thread nest inside the zones that were open on
+/// the thread that handed it the work, e.g. in record_parallel().
+struct gpu_zone_parent {
+    u32 saved_depth;
+
+    explicit gpu_zone_parent(u32 depth);
+    ~gpu_zone_parent();
+
+    nocopy(gpu_zone_parent);
+    nomove(gpu_zone_parent);
+};
+
+/// Measures the GPU time of everything recorded into a command buffer while it
+/// is alive. This does nothing if GPU profiling is disabled.
+///
+/// The scope refers to the variable that holds the command buffer, so it ends
+/// in whatever command buffer that holds by then; record_parallel() replaces it.
+struct gpu_scope {
+    gpu_profiler* profiler;
+    VkCommandBuffer* command_buffer;
+    u32 zone;
+
+    gpu_scope(context* ctx, VkCommandBuffer& command_buffer, std::string_view name);
+    ~gpu_scope();
+
+    nocopy(gpu_scope);
+    nomove(gpu_scope);
+};
+
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_GPU_PROFILER_HH
@@ -0,0 +1,351 @@
+#include "logger.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+using namespace vk;
+using namespace vk::logger;
+
+/// How often the drain thread checks for rate-limit windows that have run out
+/// while it's waiting; it otherwise only wakes up when there is work to do.
+constexpr auto window_check_interval = std::chrono::milliseconds(250);
+
+struct message {
+    record r;
+    std::string text;
+};
+
+struct state {
+    std::atomic<log_level> level = log_level::info;
+    std::atomic<u32> rate_limit = 20;
+
+    /// All thread buffers. The buffer of a thread that has exited is freed once
+    /// all of its messages have been written.
+    std::mutex registry_mutex;
+    std::vector<std::unique_ptr<thread_buffer>> registry;
+
+    /// Set when there is something for the drain thread to do.
+    std::atomic<bool> pending = false;
+    std::mutex wake_mutex;
+    std::condition_variable wake_cv;
+
+    /// Output. Only one thread drains at a time.
+    std::mutex drain_mutex;
+    std::FILE* output = stderr;
+    bool colour = ::isatty(STDERR_FILENO);
+    std::vector<message> messages;
+
+    /// The current second, formatted, so we only call localtime_r() once per second.
+    i64 last_second = -1;
+    std::string second_prefix;
+
+    /// Difference between the real-time and the monotonic clock, for printing.
+    i64 realtime_offset_ns = [] {
+        timespec real, mono;
+        clock_gettime(CLOCK_REALTIME, &real);
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        return (i64(real.tv_sec) - i64(mono.tv_sec)) * 1'000'000'000 + (i64(real.tv_nsec) - i64(mono.tv_nsec));
+    }();
+};
+
+auto drain(state& s) -> bool;
+
+/// Wake up the drain thread. Only the first call after it has woken up needs
+/// to take the lock; the rest of a burst of messages is picked up anyway.
+void wake(state& s) {
+    if (s.pending.exchange(true)) return;
+    std::unique_lock lock{ s.wake_mutex };
+    s.wake_cv.notify_one();
+}
+
+/// The logger is never destroyed so logging keeps working during static destruction.
+auto get() -> state& {
+    static auto* s = [] {
+        auto* s = new state;
+        std::thread{ [s] {
+            bool suppressing = false;
+            std::unique_lock lock{ s->wake_mutex };
+            for (;;) {
+                /// Windows that are over have to be reported even if nothing else
+                /// is logged, so don't wait indefinitely while there are any.
+                auto woken = [s] { return s->pending.load(); };
+                if (suppressing) s->wake_cv.wait_for(lock, window_check_interval, woken);
+                else s->wake_cv.wait(lock, woken);
+
+                s->pending.store(false);
+                lock.unlock();
+                suppressing = drain(*s);
+                lock.lock();
+            }
+        } }.detach();
+
+        /// Don't lose whatever is still queued when we exit.
+        std::atexit([] { flush(); });
+        return s;
+    }();
+    return *s;
+}
+
+thread_local thread_buffer* current_thread_buffer = nullptr;
+
+/// Tells the drain thread when the current thread exits so it can free its buffer.
+struct buffer_owner {
+    thread_buffer* buf = nullptr;
+
+    ~buffer_owner() {
+        if (!buf) return;
+        current_thread_buffer = nullptr;
+        buf->exited.store(true, std::memory_order_release);
+        wake(get());
+    }
+};
+
+auto current_buffer() -> thread_buffer& {
+    if (current_thread_buffer) return *current_thread_buffer;
+    thread_local buffer_owner owner;
+    auto& s = get();
+    std::unique_lock lock{ s.registry_mutex };
+    owner.buf = current_thread_buffer = s.registry.emplace_back(std::make_unique<thread_buffer>()).get();
+    return *current_thread_buffer;
+}
+
+/// Messages from different threads are put in order by this, so it has to be
+/// precise; it's still served from the vDSO, so it costs no system call.
+auto now_ns() -> u64 {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return u64(ts.tv_sec) * 1'000'000'000 + u64(ts.tv_nsec);
+}
+
+/// Let the drain thread know that a window has suppressed messages. If it's
+/// already keeping track of too many, the next message from the call site will
+/// report them instead.
+void list_window(thread_buffer& buf, thread_buffer::rate_window& w) {
+    if (w.listed.exchange(true)) return;
+    for (auto& slot : buf.suppressing) {
+        thread_buffer::rate_window* expected = nullptr;
+        if (slot.compare_exchange_strong(expected, &w)) {
+            wake(get());
+            return;
+        }
+    }
+
+    w.listed.store(false);
+}
+
+void copy_in(thread_buffer& buf, u64 pos, const void* src, u64 size) {
+    auto offset = pos % thread_buffer::capacity;
+    auto first = std::min(size, thread_buffer::capacity - offset);
+    std::memcpy(buf.data.data() + offset, src, first);
+    std::memcpy(buf.data.data(), static_cast<const char*>(src) + first, size - first);
+}
+
+void copy_out(const thread_buffer& buf, u64 pos, void* dest, u64 size) {
+    auto offset = pos % thread_buffer::capacity;
+    auto first = std::min(size, thread_buffer::capacity - offset);
+    std::memcpy(dest, buf.data.data() + offset, first);
+    std::memcpy(static_cast<char*>(dest) + first, buf.data.data(), size - first);
+}
+
+void push(thread_buffer& buf, log_level level, u64 time_ns, std::string_view text) {
+    text = text.substr(0, thread_buffer::max_message_size);
+    record r{ .time_ns = time_ns, .size = u32(text.size()), .level = level };
+    auto size = sizeof r + text.size();
+
+    auto head = buf.head.load(std::memory_order_relaxed);
+    if (thread_buffer::capacity - (head - buf.tail.load(std::memory_order_acquire)) < size) {
+        buf.dropped.fetch_add(1, std::memory_order_relaxed);
+        wake(get());
+        return;
+    }
+
+    copy_in(buf, head, &r, sizeof r);
+    copy_in(buf, head + sizeof r, text.data(), text.size());
+    buf.head.store(head + size, std::memory_order_release);
+    wake(get());
+}
+
+void format_line(state& s, std::string& out, log_level level, u64 time_ns, std::string_view text) {
+    static constexpr std::string_view names[]{ "Debug", "Info", "Warning", "Error", "Fatal" };
+    static constexpr std::string_view colours[]{ "", "\033[33m", "\033[1;33m", "\033[31m", "\033[1;31m" };
+
+    auto real_ns = u64(i64(time_ns) + s.realtime_offset_ns);
+    auto seconds = i64(real_ns / 1'000'000'000);
+    if (seconds != s.last_second) {
+        auto t = time_t(seconds);
+        tm tm{};
+        localtime_r(&t, &tm);
+        s.last_second = seconds;
+        s.second_prefix = fmt::format("{:02}:{:02}:{:02}", tm.tm_hour, tm.tm_min, tm.tm_sec);
+    }
+
+    auto i = u64(level);
+    fmt::format_to(
+        std::back_inserter(out),
+        "{}[{}.{:03}] {}: {}{}\n",
+        s.colour ? colours[i] : "",
+        s.second_prefix,
+        real_ns / 1'000'000 % 1000,
+        names[i],
+        text,
+        s.colour ? "\033[m" : ""
+    );
+}
+
+void write_out(state& s, const std::string& out) {
+    if (out.empty()) return;
+    std::fwrite(out.data(), 1, out.size(), s.output);
+    std::fflush(s.output);
+}
+
+/// Returns whether there are rate-limit windows left that need to be reported later.
+auto drain(state& s) -> bool {
+    std::unique_lock lock{ s.drain_mutex };
+    s.messages.clear();
+    u64 dropped = 0;
+    bool suppressing = false;
+    {
+        std::unique_lock registry_lock{ s.registry_mutex };
+        auto now = now_ns();
+        for (auto& buf : s.registry) {
+            /// Check this first; once it's set, everything the thread logged is visible.
+            bool exited = buf->exited.load(std::memory_order_acquire);
+            auto tail = buf->tail.load(std::memory_order_relaxed);
+            auto head = buf->head.load(std::memory_order_acquire);
+            while (tail < head) {
+                auto& m = s.messages.emplace_back();
+                copy_out(*buf, tail, &m.r, sizeof m.r);
+                m.text.resize(m.r.size);
+                copy_out(*buf, tail + sizeof m.r, m.text.data(), m.r.size);
+                tail += sizeof m.r + m.r.size;
+            }
+
+            buf->tail.store(tail, std::memory_order_release);
+            dropped += buf->dropped.exchange(0, std::memory_order_relaxed);
+
+            /// Report messages that were suppressed in windows that are over, in
+            /// case nothing else comes from the same call site to report them.
+            for (auto& slot : buf->suppressing) {
+                auto* w = slot.load();
+                if (!w) continue;
+                if (!exited && w->start_ms.load() + 1000 > now / 1'000'000) {
+                    suppressing = true;
+                    continue;
+                }
+
+                slot.store(nullptr);
+                w->listed.store(false);
+                if (auto n = w->suppressed.exchange(0)) {
+                    auto& m = s.messages.emplace_back();
+                    m.text = fmt::format("(Suppressed {} more messages like the previous one)", n);
+                    m.r = { .time_ns = now, .size = u32(m.text.size()), .level = w->level.load() };
+                }
+            }
+        }
+
+        /// Free the buffers of threads that have exited once everything in them has been written.
+        std::erase_if(s.registry, [](auto& buf) {
+            return buf->exited.load(std::memory_order_acquire)
+                && buf->tail.load(std::memory_order_relaxed) == buf->head.load(std::memory_order_relaxed)
+                && std::ranges::none_of(buf->suppressing, [](auto& slot) { return slot.load() != nullptr; });
+        });
+    }
+
+    /// Every thread's messages are in order, but not across threads.
+    std::ranges::stable_sort(s.messages, {}, [](const message& m) { return m.r.time_ns; });
+
+    std::string out;
+    for (const auto& m : s.messages) format_line(s, out, m.r.level, m.r.time_ns, m.text);
+    if (dropped) format_line(s, out, log_level::warning, now_ns(), fmt::format("[Logger] Dropped {} messages because a log buffer was full", dropped));
+    write_out(s, out);
+    return suppressing;
+}
+} // namespace
+
+bool vk::logger::enabled(log_level level) {
+    return level >= get().level.load(std::memory_order_relaxed);
+}
+
+auto vk::logger::scratch() -> fmt::memory_buffer& {
+    return current_buffer().scratch;
+}
+
+void vk::logger::write(log_level level, u64 site, std::string_view text) {
+    auto& buf = current_buffer();
+    auto time = now_ns();
+
+    if (auto limit = get().rate_limit.load(std::memory_order_relaxed)) {
+        auto& w = buf.windows[site];
+        auto ms = time / 1'000'000;
+        if (ms - w.start_ms.load(std::memory_order_relaxed) >= 1000) {
+            /// The drain thread may have reported these already.
+            if (auto n = w.suppressed.exchange(0)) push(buf, level, time, fmt::format("(Suppressed {} more messages like the next one)", n));
+            w.start_ms.store(ms);
+            w.count = 0;
+        }
+
+        if (++w.count > limit) {
+            w.level.store(level, std::memory_order_relaxed);
+            w.suppressed.fetch_add(1);
+            list_window(buf, w);
+            return;
+        }
+    }
+
+    push(buf, level, time, text);
+}
+
+void vk::logger::fatal(std::string_view text) {
+    auto& s = get();
+    flush();
+
+    /// Write this one directly; we're not coming back.
+    {
+        std::unique_lock lock{ s.drain_mutex };
+        std::string out;
+        format_line(s, out, log_level::fatal, now_ns(), text);
+        write_out(s, out);
+    }
+
+    std::exit(1);
+}
+
+void vk::logger::set_level(log_level level) {
+    get().level.store(level, std::memory_order_relaxed);
+}
+
+void vk::logger::set_rate_limit(u32 per_second) {
+    get().rate_limit.store(per_second, std::memory_order_relaxed);
+}
+
+bool vk::logger::set_output(std::string_view path) {
+    std::FILE* file = stderr;
+    if (!path.empty()) {
+        file = std::fopen(std::string{ path }.c_str(), "w");
+        if (!file) return false;
+    }
+
+    /// Write out what's queued to the old output first.
+    auto& s = get();
+    drain(s);
+
+    std::unique_lock lock{ s.drain_mutex };
+    if (s.output != stderr) std::fclose(s.output);
+    s.output = file;
+    s.colour = file == stderr && ::isatty(STDERR_FILENO);
+    return true;
+}
+
+void vk::logger::flush() {
+    drain(get());
+}
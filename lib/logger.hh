@@ -0,0 +1,87 @@
+#ifndef VULKAN_TEMPLATE_LOGGER_HH
+#define VULKAN_TEMPLATE_LOGGER_HH
+#include "utils.hh"
+
+#include <array>
+#include <atomic>
+#include <string_view>
+#include <unordered_map>
+
+/// Asynchronous logger behind info(), warn(), err() and die().
+///
+/// Messages are formatted on the thread that logs them and copied into a ring
+/// buffer that only that thread ever writes to. A background thread sleeps on
+/// a condition variable until there is something to drain, then puts the
+/// messages in order and writes them to stderr or a file. Only the first
+/// message after the drain thread has gone back to sleep takes a lock to wake
+/// it up; the rest of a burst takes no locks and makes no system calls. If a
+/// ring buffer is full, messages are dropped rather than making the thread
+/// wait; the drain thread reports how many were lost.
+///
+/// Messages from the same call site that come in faster than `rate_limit` per
+/// second are suppressed, which keeps e.g. validation layer warnings that fire
+/// every draw from flooding the output. The number of suppressed messages is
+/// reported with the next message from that call site, or by the drain thread
+/// once the flood has stopped. Fatal messages are never suppressed, and they
+/// first flush everything that is still queued.
+///
+/// The buffer of a thread that has exited is freed once it has been drained.
+namespace vk::logger {
+/// Ring buffer of a single thread.
+struct thread_buffer {
+    static constexpr u64 capacity = 1 << 16;
+
+    /// Longer messages are truncated.
+    static constexpr u64 max_message_size = capacity / 4;
+
+    /// Messages that have been suppressed since the start of the last window.
+    /// Only the owning thread changes `count`; the rest is shared with the
+    /// drain thread, which reports suppressed messages once a window is over.
+    struct rate_window {
+        std::atomic<u64> start_ms = 0;
+        u32 count = 0;
+        std::atomic<u32> suppressed = 0;
+        std::atomic<log_level> level = log_level::info;
+        std::atomic<bool> listed = false;
+    };
+
+    /// Number of windows that the drain thread keeps track of at once.
+    static constexpr u64 max_suppressing = 16;
+
+    std::array<char, capacity> data;
+    std::atomic<u64> head = 0;
+    std::atomic<u64> tail = 0;
+    std::atomic<u64> dropped = 0;
+
+    /// Windows that have suppressed messages the drain thread may have to report.
+    std::array<std::atomic<rate_window*>, max_suppressing> suppressing{};
+
+    /// Set once the owning thread has exited.
+    std::atomic<bool> exited = false;
+
+    /// Only used by the owning thread. Windows are never removed, so the drain
+    /// thread can hold on to pointers to them.
+    std::unordered_map<u64, rate_window> windows;
+    fmt::memory_buffer scratch;
+};
+
+/// Header of a message in a ring buffer; the message itself follows it.
+struct record {
+    /// CLOCK_MONOTONIC, in nanoseconds.
+    u64 time_ns;
+    u32 size;
+    log_level level;
+};
+
+/// Only write messages of this level or higher. The default is `info`.
+void set_level(log_level level);
+
+/// Maximum number of messages per second from one call site. 0 disables rate limiting.
+void set_rate_limit(u32 per_second);
+
+/// Write to a file instead of stderr; an empty path switches back to stderr.
+/// Returns false if the file can't be opened.
+bool set_output(std::string_view path);
+} // namespace vk::logger
+
+#endif // VULKAN_TEMPLATE_LOGGER_HH
@@ -14,7 +14,7 @@ vk::model::model(texture_renderer* r, std::string_view texture_path, std::string
     : r(r) {
     load_texture(texture_path);
     load_model(obj_path);
-    r->create_descriptor_sets(descriptor_sets, texture_image_view);
+    create_descriptors();
 }
 
 vk::model::model(texture_renderer* r, std::string_view texture_path, glm::vec3 pos) : r(r) {
@@ -37,97 +37,169 @@ vk::model::model(texture_renderer* r, std::string_view texture_path, glm::vec3 p
     vs.push_back({ { pos.x + wd, pos.y, 1.0f }, {}, {}, { 1.0f, 0.0f } });
     verts = vertex_buffer(r->ctx, vs, QUAD_VERTICES);
 
-    r->create_descriptor_sets(descriptor_sets, texture_image_view);
+    create_descriptors();
+}
+
+vk::model::model(texture_renderer* r, const void* pixels, u32 wd, u32 ht, const std::vector<vertex>& vertices, const std::vector<u32>& indices)
+    : r(r), tex_width(int(wd)), tex_height(int(ht)), tex_channels(4) {
+    upload_texture(pixels);
+    verts = vertex_buffer(r->ctx, vertices, indices);
+    create_descriptors();
 }
 
 vk::model::~model() {
+    if (r->ctx->capture) r->ctx->capture->forget(this);
+    if (r->bindless) r->ctx->textures->remove(texture_index);
+    for (auto set : descriptor_sets) r->ctx->descriptors->free(set);
     vkDestroyImageView(r->ctx->device, texture_image_view, nullptr);
     vkDestroyImage(r->ctx->device, texture_image, nullptr);
     vkFreeMemory(r->ctx->device, texture_image_memory, nullptr);
 }
 
-void vk::model::load_model(std::string_view obj_path) {
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
+void vk::model::create_descriptors() {
+    if (r->bindless) texture_index = r->ctx->textures->add(texture_image_view, r->texture_sampler);
+    else r->create_descriptor_sets(descriptor_sets, texture_image_view);
+}
+
+namespace {
+/// Parse an OBJ file.
+void parse_obj(std::string_view obj_path, tinyobj::attrib_t& attrib, std::vector<tinyobj::shape_t>& shapes) {
     std::vector<tinyobj::material_t> materials;
     std::string warn, err;
 
 #ifdef ENABLE_VALIDATION_LAYERS
-    fmt::print(stderr, "[Loader] Loading model \"{}\"\n", obj_path);
+    info("[Loader] Loading model \"{}\"", obj_path);
 #endif
 
     if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, obj_path.data())) die("[Loader] failed to load model :{}\n{}", obj_path, err);
 
 #ifdef ENABLE_VALIDATION_LAYERS
-    if (!warn.empty()) fmt::print(stderr, "\033[33m[Loader] Warning: {}\n\033[m", warn);
-    if (!err.empty()) fmt::print(stderr, "\033[31m[Loader] Error: {}\n\033[m", err);
+    if (!warn.empty()) ::warn("[Loader] {}", warn);
+    if (!err.empty()) ::err("[Loader] {}", err);
 #endif
+}
+
+/// Number of face corners in an OBJ file, i.e. the number of indices of the mesh.
+auto corner_count(const std::vector<tinyobj::shape_t>& shapes) -> size_t {
+    size_t count = 0;
+    for (const auto& shape : shapes) count += shape.mesh.indices.size();
+    return count;
+}
 
+/// Build the vertex of a face corner.
+auto make_vertex(const tinyobj::attrib_t& attrib, const tinyobj::index_t& index) -> vk::vertex {
+    vk::vertex v{};
+    if (index.vertex_index >= 0) {
+        v.pos = {
+            attrib.vertices[3 * size_t(index.vertex_index) + 0],
+            attrib.vertices[3 * size_t(index.vertex_index) + 1],
+            attrib.vertices[3 * size_t(index.vertex_index) + 2],
+        };
+
+        v.colour = {
+            attrib.colors[3 * size_t(index.vertex_index) + 0],
+            attrib.colors[3 * size_t(index.vertex_index) + 1],
+            attrib.colors[3 * size_t(index.vertex_index) + 2],
+        };
+    }
+
+    if (index.normal_index >= 0) {
+        v.normal = {
+            attrib.normals[3 * size_t(index.normal_index) + 0],
+            attrib.normals[3 * size_t(index.normal_index) + 1],
+            attrib.normals[3 * size_t(index.normal_index) + 2],
+        };
+    }
+
+    if (index.texcoord_index >= 0) {
+        v.tex_coord = {
+            attrib.texcoords[2 * size_t(index.texcoord_index) + 0],
+
+            /// In the .obj format, a vertical coordinate of `0` indicates the bottom
+            /// of the image, whereas in Vulkan `0` is the top of the image. We therefore
+            /// need to invert this.
+            1.0f - attrib.texcoords[2 * size_t(index.texcoord_index) + 1],
+        };
+    }
+
+    return v;
+}
+} // namespace
+
+auto vk::load_obj(std::string_view obj_path) -> mesh_data {
+    CPU_ZONE("load_obj");
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    parse_obj(obj_path, attrib, shapes);
+
+    /// Deduplicate as we go rather than building a vertex per corner first.
+    auto corners = corner_count(shapes);
     std::unordered_map<vertex, u32> unique_vertices{};
-    std::vector<vertex> vertices;
-    std::vector<u32> indices;
+    unique_vertices.reserve(corners);
+    mesh_data res;
+    res.indices.reserve(corners);
 
     for (const auto& shape : shapes) {
         for (auto& index : shape.mesh.indices) {
-            vertex v{};
-
-            if (index.vertex_index >= 0) {
-                v.pos = {
-                    attrib.vertices[3 * size_t(index.vertex_index) + 0],
-                    attrib.vertices[3 * size_t(index.vertex_index) + 1],
-                    attrib.vertices[3 * size_t(index.vertex_index) + 2],
-                };
-
-                v.colour = {
-                    attrib.colors[3 * size_t(index.vertex_index) + 0],
-                    attrib.colors[3 * size_t(index.vertex_index) + 1],
-                    attrib.colors[3 * size_t(index.vertex_index) + 2],
-                };
-            }
-
-            if (index.normal_index >= 0) {
-                v.normal = {
-                    attrib.normals[3 * size_t(index.normal_index) + 0],
-                    attrib.normals[3 * size_t(index.normal_index) + 1],
-                    attrib.normals[3 * size_t(index.normal_index) + 2],
-                };
-            }
-
-            if (index.texcoord_index >= 0) {
-                v.tex_coord = {
-                    attrib.texcoords[2 * size_t(index.texcoord_index) + 0],
-
-                    /// In the .obj format, a vertical coordinate of `0` indicates the bottom
-                    /// of the image, whereas in Vulkan `0` is the top of the image. We therefore
-                    /// need to invert this.
-                    1.0f - attrib.texcoords[2 * size_t(index.texcoord_index) + 1],
-                };
-            }
-
-            /// New vertex.
-            if (unique_vertices.count(v) == 0) {
-                unique_vertices[v] = u32(vertices.size());
-                vertices.push_back(v);
-            }
-
-            indices.push_back(unique_vertices[v]);
+            auto v = make_vertex(attrib, index);
+            auto [it, inserted] = unique_vertices.try_emplace(v, u32(res.vertices.size()));
+            if (inserted) res.vertices.push_back(v);
+            res.indices.push_back(it->second);
         }
     }
 
-    verts = vertex_buffer(r->ctx, vertices, indices);
+    return res;
+}
+
+auto vk::read_obj(std::string_view obj_path) -> std::vector<vertex> {
+    CPU_ZONE("read_obj");
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    parse_obj(obj_path, attrib, shapes);
+
+    std::vector<vertex> vertices;
+    vertices.reserve(corner_count(shapes));
+    for (const auto& shape : shapes)
+        for (auto& index : shape.mesh.indices)
+            vertices.push_back(make_vertex(attrib, index));
+
+    return vertices;
+}
+
+auto vk::deduplicate_vertices(const std::vector<vertex>& vertices) -> mesh_data {
+    CPU_ZONE("deduplicate_vertices");
+    std::unordered_map<vertex, u32> unique_vertices{};
+    mesh_data res;
+    res.indices.reserve(vertices.size());
+
+    for (const auto& v : vertices) {
+        /// New vertex.
+        auto [it, inserted] = unique_vertices.try_emplace(v, u32(res.vertices.size()));
+        if (inserted) res.vertices.push_back(v);
+        res.indices.push_back(it->second);
+    }
+
+    return res;
+}
+
+void vk::model::load_model(std::string_view obj_path) {
+    CPU_ZONE("load_model");
+    startup_scope startup{ r->ctx->startup, fmt::format("load_model {}", obj_path) };
+    auto mesh = load_obj(obj_path);
+    verts = vertex_buffer(r->ctx, mesh.vertices, mesh.indices);
 }
 
 void vk::model::load_texture(std::string_view texture_path) {
+    CPU_ZONE("load_texture");
+    startup_scope startup{ r->ctx->startup, fmt::format("load_texture {}", texture_path) };
     static const stbi_uc default_texture_pixels[4] = { 255, 255, 255, 255 };
-    stbi_uc* pixels;
-    VkDeviceSize image_size;
 
     /// Only load the texture if it exists.
-    bool file_exists = fs::exists(texture_path);
-    if (file_exists) {
-        pixels = stbi_load(texture_path.data(), &tex_width, &tex_height, &tex_channels, STBI_rgb_alpha);
-        image_size = VkDeviceSize(tex_width) * VkDeviceSize(tex_height) * 4;
+    if (fs::exists(texture_path)) {
+        auto* pixels = stbi_load(texture_path.data(), &tex_width, &tex_height, &tex_channels, STBI_rgb_alpha);
         if (!pixels) die("[STB] failed to load texture image \"{}\"", texture_path);
+        upload_texture(pixels);
+        stbi_image_free(pixels);
     }
 
     /// Otherwise, create a dummy texture.
@@ -135,10 +207,12 @@ void vk::model::load_texture(std::string_view texture_path) {
         tex_width = 1;
         tex_height = 1;
         tex_channels = 4;
-        pixels = const_cast<stbi_uc*>(default_texture_pixels);
-        image_size = 4;
+        upload_texture(default_texture_pixels);
     }
+}
 
+void vk::model::upload_texture(const void* pixels) {
+    auto image_size = VkDeviceSize(tex_width) * VkDeviceSize(tex_height) * 4;
     mip_levels = u32(std::floor(std::log2(std::max(tex_width, tex_height)))) + 1;
 
     VkBuffer staging_buffer;
@@ -151,8 +225,6 @@ void vk::model::load_texture(std::string_view texture_path) {
     memcpy(data, pixels, image_size);
     vkUnmapMemory(r->ctx->device, staging_buffer_memory);
 
-    if (file_exists) stbi_image_free(pixels);
-
     r->ctx->create_image(u32(tex_width), u32(tex_height), mip_levels, VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
         VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, texture_image, texture_image_memory);
@@ -166,4 +238,7 @@ void vk::model::load_texture(std::string_view texture_path) {
     vkFreeMemory(r->ctx->device, staging_buffer_memory, nullptr);
 
     texture_image_view = r->ctx->create_image_view(texture_image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_ASPECT_COLOR_BIT, mip_levels);
+
+    /// Make sure the new texture shows up in on-demand mode.
+    r->ctx->request_redraw();
 }
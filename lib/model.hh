@@ -7,6 +7,25 @@ namespace vk {
 struct context;
 struct texture_renderer;
 
+/// Vertices and indices of a mesh.
+struct mesh_data {
+    std::vector<vertex> vertices;
+    std::vector<u32> indices;
+};
+
+/// Read an OBJ file into an indexed mesh, merging identical vertices as they
+/// are read. This is what models use.
+auto load_obj(std::string_view obj_path) -> mesh_data;
+
+/// Read the faces of an OBJ file. Every corner of every face gets a vertex
+/// of its own; deduplicate_vertices() turns that into an indexed mesh. This
+/// does the same as load_obj() in two passes, so that the loader benchmarks
+/// can time both halves separately.
+auto read_obj(std::string_view obj_path) -> std::vector<vertex>;
+
+/// Merge identical vertices and build an index buffer that refers to them.
+auto deduplicate_vertices(const std::vector<vertex>& vertices) -> mesh_data;
+
 struct model {
     texture_renderer* r;
 
@@ -17,14 +36,18 @@ struct model {
     VkImageView texture_image_view;
     u32 mip_levels;
 
-    /// Descriptors.
+    /// Descriptors. Bindless renderers use the texture index instead.
     std::vector<VkDescriptorSet> descriptor_sets;
+    u32 texture_index = 0;
 
     /// Vertices and indices.
     vertex_buffer verts;
 
     model(texture_renderer* r, std::string_view texture_path, std::string_view obj_path);
     model(texture_renderer* r, std::string_view texture_path, glm::vec3 pos);
+
+    /// Create a model from RGBA8 pixels and vertex data, e.g. from a capture.
+    model(texture_renderer* r, const void* pixels, u32 wd, u32 ht, const std::vector<vertex>& vertices, const std::vector<u32>& indices);
     ~model();
 
     /// Don't want to deal w/ this rn.
@@ -32,8 +55,10 @@ struct model {
     nomove(model);
 
     /// INTERNAL:
+    void create_descriptors();
     void load_model(std::string_view obj_path);
     void load_texture(std::string_view texture_path);
+    void upload_texture(const void* pixels);
 };
 
 struct model_instance {
@@ -0,0 +1,226 @@
+#include "pipeline_builder.hh"
+
+#include "context.hh"
+
+namespace {
+auto create_shader_module(VkDevice device, const std::vector<char>& code) -> VkShaderModule {
+    VkShaderModuleCreateInfo create_info{};
+    create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    create_info.codeSize = code.size();
+    create_info.pCode = reinterpret_cast<const u32*>(code.data());
+
+    VkShaderModule shader_module;
+    assert_success(vkCreateShaderModule(device, &create_info, nullptr, &shader_module), "failed to create shader module");
+    return shader_module;
+}
+} // namespace
+
+size_t vk::pipeline_state_hash::operator()(const pipeline_state& s) const {
+    size_t seed = 0;
+    hash_combine(seed, size_t(s.topology));
+    hash_combine(seed, size_t(s.polygon_mode));
+    hash_combine(seed, size_t(s.cull_mode));
+    hash_combine(seed, size_t(s.front_face));
+    hash_combine(seed, size_t(s.depth_test));
+    hash_combine(seed, size_t(s.depth_write));
+    hash_combine(seed, size_t(s.depth_compare));
+    hash_combine(seed, size_t(s.alpha_blend));
+    for (auto c : s.specialisation_constants) hash_combine(seed, c);
+    return seed;
+}
+
+auto vk::build_graphics_pipeline(context* ctx, const pipeline_description& desc) -> VkPipeline {
+    CPU_ZONE("build_graphics_pipeline");
+    startup_scope startup{ ctx->startup, fmt::format("build_graphics_pipeline {}", desc.vert_path) };
+    ctx->stats.pipeline_compile();
+
+    /// Create the shader modules.
+    auto vert_shader_module = create_shader_module(ctx->device, map_file(desc.vert_path));
+    auto frag_shader_module = create_shader_module(ctx->device, map_file(desc.frag_path));
+    defer {
+        vkDestroyShaderModule(ctx->device, vert_shader_module, nullptr);
+        vkDestroyShaderModule(ctx->device, frag_shader_module, nullptr);
+    };
+
+    /// Specialisation constants. Entries for constants that a shader doesn't declare are ignored.
+    const auto& state = desc.state;
+    std::vector<VkSpecializationMapEntry> map_entries(state.specialisation_constants.size());
+    for (u32 i = 0; i < map_entries.size(); i++) map_entries[i] = { i, i * u32(sizeof(u32)), sizeof(u32) };
+
+    VkSpecializationInfo specialisation_info{};
+    specialisation_info.mapEntryCount = u32(map_entries.size());
+    specialisation_info.pMapEntries = map_entries.data();
+    specialisation_info.dataSize = state.specialisation_constants.size() * sizeof(u32);
+    specialisation_info.pData = state.specialisation_constants.data();
+    auto* specialisation = map_entries.empty() ? nullptr : &specialisation_info;
+
+    /// Assign the shaders to their corresponding stages.
+    VkPipelineShaderStageCreateInfo vert_shader_stage_info{};
+    vert_shader_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    vert_shader_stage_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
+    vert_shader_stage_info.module = vert_shader_module;
+    vert_shader_stage_info.pName = "main";
+    vert_shader_stage_info.pSpecializationInfo = specialisation;
+
+    VkPipelineShaderStageCreateInfo frag_shader_stage_info{};
+    frag_shader_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    frag_shader_stage_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    frag_shader_stage_info.module = frag_shader_module;
+    frag_shader_stage_info.pName = "main";
+    frag_shader_stage_info.pSpecializationInfo = specialisation;
+
+    /// Store them for later.
+    VkPipelineShaderStageCreateInfo shader_stages[] = { vert_shader_stage_info, frag_shader_stage_info };
+
+    /// Dynamic state.
+    std::vector<VkDynamicState> dynamic_states = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+    VkPipelineDynamicStateCreateInfo dynamic_state_info{};
+    dynamic_state_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_state_info.dynamicStateCount = u32(dynamic_states.size());
+    dynamic_state_info.pDynamicStates = dynamic_states.data();
+
+    /// Vertex input.
+    auto binding_description = vertex::binding_description();
+    auto attribute_descriptions = vertex::attribute_descriptions();
+
+    VkPipelineVertexInputStateCreateInfo vertex_input_info{};
+    vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertex_input_info.vertexBindingDescriptionCount = 1;
+    vertex_input_info.pVertexBindingDescriptions = &binding_description;
+    vertex_input_info.vertexAttributeDescriptionCount = u32(attribute_descriptions.size());
+    vertex_input_info.pVertexAttributeDescriptions = attribute_descriptions.data();
+
+    /// Input assembly.
+    VkPipelineInputAssemblyStateCreateInfo input_assembly_info{};
+    input_assembly_info.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    input_assembly_info.topology = state.topology;
+    input_assembly_info.primitiveRestartEnable = VK_FALSE;
+
+    VkPipelineViewportStateCreateInfo viewport_state_info{};
+    viewport_state_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport_state_info.viewportCount = 1;
+    viewport_state_info.scissorCount = 1;
+
+    /// Rasteriser.
+    VkPipelineRasterizationStateCreateInfo rasteriser_info{};
+    rasteriser_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasteriser_info.depthClampEnable = VK_FALSE;
+    rasteriser_info.rasterizerDiscardEnable = VK_FALSE;
+    rasteriser_info.polygonMode = state.polygon_mode;
+    rasteriser_info.lineWidth = 1.0f;
+    rasteriser_info.cullMode = state.cull_mode;
+    rasteriser_info.frontFace = state.front_face;
+    rasteriser_info.depthBiasEnable = VK_FALSE;
+
+    /// Multisampling.
+    VkPipelineMultisampleStateCreateInfo multisampling_info{};
+    multisampling_info.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling_info.sampleShadingEnable = VK_TRUE;
+    multisampling_info.rasterizationSamples = ctx->msaa_samples;
+    multisampling_info.minSampleShading = .2f;
+
+    /// Colour blending.
+    VkPipelineColorBlendAttachmentState colour_blend_attachment{};
+    colour_blend_attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT
+                                             | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    colour_blend_attachment.blendEnable = state.alpha_blend ? VK_TRUE : VK_FALSE;
+    colour_blend_attachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    colour_blend_attachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    colour_blend_attachment.colorBlendOp = VK_BLEND_OP_ADD;
+    colour_blend_attachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    colour_blend_attachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+    colour_blend_attachment.alphaBlendOp = VK_BLEND_OP_ADD;
+
+    VkPipelineColorBlendStateCreateInfo colour_blend_info{};
+    colour_blend_info.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colour_blend_info.logicOpEnable = VK_FALSE;
+    colour_blend_info.logicOp = VK_LOGIC_OP_COPY;
+    colour_blend_info.attachmentCount = 1;
+    colour_blend_info.pAttachments = &colour_blend_attachment;
+
+    /// Depth stencil.
+    VkPipelineDepthStencilStateCreateInfo depth_stencil_info{};
+    depth_stencil_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depth_stencil_info.depthTestEnable = state.depth_test ? VK_TRUE : VK_FALSE;
+    depth_stencil_info.depthWriteEnable = state.depth_write ? VK_TRUE : VK_FALSE;
+    depth_stencil_info.depthCompareOp = state.depth_compare;
+    depth_stencil_info.depthBoundsTestEnable = VK_FALSE;
+    depth_stencil_info.stencilTestEnable = VK_FALSE;
+
+    /// Finally, create the pipeline.
+    VkGraphicsPipelineCreateInfo pipeline_info{};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipeline_info.flags = desc.flags;
+    pipeline_info.stageCount = u32(sizeof shader_stages / sizeof *shader_stages);
+    pipeline_info.pStages = shader_stages;
+    pipeline_info.pVertexInputState = &vertex_input_info;
+    pipeline_info.pInputAssemblyState = &input_assembly_info;
+    pipeline_info.pViewportState = &viewport_state_info;
+    pipeline_info.pRasterizationState = &rasteriser_info;
+    pipeline_info.pMultisampleState = &multisampling_info;
+    pipeline_info.pDepthStencilState = &depth_stencil_info;
+    pipeline_info.pColorBlendState = &colour_blend_info;
+    pipeline_info.pDynamicState = &dynamic_state_info;
+    pipeline_info.layout = desc.layout;
+    pipeline_info.renderPass = ctx->render_pass;
+
+    /// With dynamic rendering, there is no render pass; describe the attachments instead.
+    VkPipelineRenderingCreateInfoKHR rendering_info{};
+    rendering_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachmentFormats = &ctx->swap_chain_image_format;
+    rendering_info.depthAttachmentFormat = ctx->depth_format;
+    if (ctx->dynamic_rendering) pipeline_info.pNext = &rendering_info;
+    pipeline_info.subpass = 0;
+    pipeline_info.basePipelineHandle = desc.base;
+    pipeline_info.basePipelineIndex = -1;
+
+    if (desc.base != VK_NULL_HANDLE) pipeline_info.flags |= VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+
+    VkPipeline graphics_pipeline;
+    assert_success(vkCreateGraphicsPipelines(ctx->device, ctx->pipeline_cache, 1, &pipeline_info, nullptr, &graphics_pipeline),
+        "failed to create graphics pipeline");
+    return graphics_pipeline;
+}
+
+/// ======================================================================
+///  Pipeline builder
+/// ======================================================================
+vk::pipeline_builder::pipeline_builder(context* ctx, u32 thread_count) : ctx(ctx), thread_count(thread_count) {}
+
+vk::pipeline_builder::~pipeline_builder() {
+    build();
+}
+
+auto vk::pipeline_builder::add(pipeline_description desc) -> std::shared_future<VkPipeline> {
+    std::unique_lock lock{ queue_mutex };
+    auto& p = queue.emplace_back(std::move(desc));
+    return p.promise.get_future().share();
+}
+
+void vk::pipeline_builder::build() {
+    std::vector<pending> building;
+    {
+        std::unique_lock lock{ queue_mutex };
+        building.swap(queue);
+    }
+
+    /// The pool's destructor waits for all pipelines to be created.
+    if (!building.empty()) {
+        thread_pool pool{ std::min(thread_count, u32(building.size())) };
+        for (auto& p : building) pool.push([this, &p] { p.promise.set_value(build_graphics_pipeline(ctx, p.desc)); });
+    }
+
+    /// Nobody is going to use these, so get rid of them right away.
+    std::unique_lock lock{ abandoned_mutex };
+    for (auto& a : abandoned) {
+        vkDestroyPipeline(ctx->device, a.pipeline.get(), nullptr);
+        vkDestroyPipelineLayout(ctx->device, a.layout, nullptr);
+    }
+    abandoned.clear();
+}
+
+void vk::pipeline_builder::abandon(std::shared_future<VkPipeline> pipeline, VkPipelineLayout layout) {
+    std::unique_lock lock{ abandoned_mutex };
+    abandoned.push_back({ std::move(pipeline), layout });
+}
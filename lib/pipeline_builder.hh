@@ -0,0 +1,108 @@
+#ifndef VULKAN_TEMPLATE_PIPELINE_BUILDER_HH
+#define VULKAN_TEMPLATE_PIPELINE_BUILDER_HH
+#include "thread_pool.hh"
+#include "utils.hh"
+
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace vk {
+struct context;
+
+/// Fixed-function state and specialisation constants of a graphics pipeline.
+///
+/// The defaults match what every renderer used before variants existed.
+struct pipeline_state {
+    /// Input assembly and rasterisation.
+    VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    VkPolygonMode polygon_mode = VK_POLYGON_MODE_FILL;
+    VkCullModeFlags cull_mode = VK_CULL_MODE_BACK_BIT;
+    VkFrontFace front_face = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+
+    /// Depth testing.
+    bool depth_test = true;
+    bool depth_write = true;
+    VkCompareOp depth_compare = VK_COMPARE_OP_LESS; /// Lower depth = closer.
+
+    /// Standard alpha blending (src_alpha, 1 - src_alpha).
+    bool alpha_blend = false;
+
+    /// Specialisation constants, passed to both shader stages. The value at
+    /// index i is bound to `layout(constant_id = i)`.
+    std::vector<u32> specialisation_constants;
+
+    bool operator==(const pipeline_state& other) const = default;
+};
+
+struct pipeline_state_hash {
+    size_t operator()(const pipeline_state& s) const;
+};
+
+/// Everything needed to create a graphics pipeline.
+struct pipeline_description {
+    std::string vert_path;
+    std::string frag_path;
+    VkPipelineLayout layout;
+    pipeline_state state{};
+
+    /// Creation flags, and the pipeline to derive from, if any.
+    VkPipelineCreateFlags flags = 0;
+    VkPipeline base = VK_NULL_HANDLE;
+};
+
+/// Create a graphics pipeline. This is safe to call from any thread.
+auto build_graphics_pipeline(context* ctx, const pipeline_description& desc) -> VkPipeline;
+
+/// Collects pipeline descriptions and compiles them all at once on a
+/// temporary set of worker threads.
+///
+/// Pipelines are created against the context's pipeline cache, which
+/// the driver synchronises internally, so the workers can share it.
+struct pipeline_builder {
+    /// A queued pipeline.
+    struct pending {
+        pipeline_description desc;
+        std::promise<VkPipeline> promise;
+    };
+
+    /// A pipeline whose owner was destroyed before it was built.
+    struct abandoned_pipeline {
+        std::shared_future<VkPipeline> pipeline;
+        VkPipelineLayout layout;
+    };
+
+    context* ctx;
+    u32 thread_count;
+    std::vector<pending> queue;
+    std::mutex queue_mutex;
+    std::vector<abandoned_pipeline> abandoned;
+    std::mutex abandoned_mutex;
+
+    explicit pipeline_builder(context* ctx, u32 thread_count = std::max(std::thread::hardware_concurrency(), 1u));
+
+    /// Builds any pipelines that are still queued.
+    ~pipeline_builder();
+
+    nocopy(pipeline_builder);
+    nomove(pipeline_builder);
+
+    /// Queue a pipeline. The future becomes ready once build() has run.
+    auto add(pipeline_description desc) -> std::shared_future<VkPipeline>;
+
+    /// Compile all queued pipelines and wait for them to finish. This may be
+    /// called from any thread; pipelines that another call is already building
+    /// are left to it.
+    void build();
+
+    /// Take ownership of a queued pipeline and its layout, e.g. because the
+    /// renderer it was queued for has been destroyed. Both are destroyed as
+    /// soon as the pipeline has been built.
+    void abandon(std::shared_future<VkPipeline> pipeline, VkPipelineLayout layout);
+};
+
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_PIPELINE_BUILDER_HH
@@ -0,0 +1,55 @@
+#include "pipeline_library.hh"
+
+#include "context.hh"
+
+vk::pipeline_library::pipeline_library(context* ctx, pipeline_description description, u32 capacity)
+    : ctx(ctx), description(std::move(description)), capacity(std::max(capacity, 1u)) {}
+
+vk::pipeline_library::~pipeline_library() {
+    /// Frames that are still in flight may be using these.
+    std::vector<VkPipeline> pipelines;
+    for (auto& [_, v] : variants) pipelines.push_back(v.pipeline);
+    if (pipelines.empty()) return;
+    ctx->defer_delete([device = ctx->device, pipelines = std::move(pipelines)] {
+        for (auto p : pipelines) vkDestroyPipeline(device, p, nullptr);
+    });
+}
+
+auto vk::pipeline_library::get(const pipeline_state& state, VkPipeline parent) -> VkPipeline {
+    /// Move the variant to the front if we already have it.
+    {
+        std::unique_lock lock{ mutex };
+        if (auto it = variants.find(state); it != variants.end()) {
+            lru.splice(lru.begin(), lru, it->second.lru_entry);
+            return it->second.pipeline;
+        }
+    }
+
+    /// Otherwise, create it. This can take a while, so don't hold the lock
+    /// and stall other threads that only want a variant we already have.
+    auto desc = description;
+    desc.state = state;
+    desc.base = parent;
+    auto p = build_graphics_pipeline(ctx, desc);
+
+    /// Another thread may have created the same variant in the meantime; keep
+    /// theirs and throw ours away.
+    std::unique_lock lock{ mutex };
+    if (auto it = variants.find(state); it != variants.end()) {
+        vkDestroyPipeline(ctx->device, p, nullptr);
+        lru.splice(lru.begin(), lru, it->second.lru_entry);
+        return it->second.pipeline;
+    }
+
+    lru.push_front(state);
+    variants[state] = { .pipeline = p, .lru_entry = lru.begin() };
+    if (variants.size() > capacity) evict();
+    return p;
+}
+
+void vk::pipeline_library::evict() {
+    auto it = variants.find(lru.back());
+    ctx->defer_delete([device = ctx->device, p = it->second.pipeline] { vkDestroyPipeline(device, p, nullptr); });
+    variants.erase(it);
+    lru.pop_back();
+}
@@ -0,0 +1,57 @@
+#ifndef VULKAN_TEMPLATE_PIPELINE_LIBRARY_HH
+#define VULKAN_TEMPLATE_PIPELINE_LIBRARY_HH
+#include "pipeline_builder.hh"
+#include "utils.hh"
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace vk {
+struct context;
+
+/// Variants of a pipeline that share its shaders and layout, but differ in
+/// fixed-function state or specialisation constants.
+///
+/// Variants are created on demand the first time they are requested and are
+/// derived from a parent pipeline so the driver can reuse its work. At most
+/// `capacity` variants are kept alive; the least recently used one is evicted
+/// once that limit is exceeded, and handed to the context's deletion queue,
+/// as are the remaining variants when the library is destroyed.
+struct pipeline_library {
+    /// A cached variant.
+    struct variant {
+        VkPipeline pipeline;
+        std::list<pipeline_state>::iterator lru_entry;
+    };
+
+    context* ctx;
+    pipeline_description description;
+    u32 capacity;
+
+    /// Variants, most recently used first.
+    std::unordered_map<pipeline_state, variant, pipeline_state_hash> variants;
+    std::list<pipeline_state> lru;
+    std::mutex mutex;
+
+    /// `description` provides the shaders and layout; its state is ignored.
+    pipeline_library(context* ctx, pipeline_description description, u32 capacity = 16);
+    ~pipeline_library();
+
+    nocopy(pipeline_library);
+    nomove(pipeline_library);
+
+    /// Get the variant for a state, creating it if need be; the lock is not held
+    /// while a new variant compiles. If `parent` is not null, the variant is
+    /// derived from it; the parent must have been created with
+    /// VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT.
+    auto get(const pipeline_state& state, VkPipeline parent = VK_NULL_HANDLE) -> VkPipeline;
+
+    /// INTERNAL:
+    void evict();
+};
+
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_PIPELINE_LIBRARY_HH
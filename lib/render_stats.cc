@@ -0,0 +1,141 @@
+#include "render_stats.hh"
+
+#include "context.hh"
+
+#include <memory>
+#include <mutex>
+
+namespace {
+/// All thread counters. These are never freed so that commands counted by
+/// threads that have exited still show up in the totals.
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<vk::render_stats::thread_counters>> registry;
+} // namespace
+
+thread_local vk::render_stats::thread_counters* vk::render_stats::current_thread_counters = nullptr;
+
+vk::render_stats::render_stats(context* ctx) : ctx(ctx), at_frame_end(sum()) {}
+
+vk::render_stats::~render_stats() {
+    set_pipeline_statistics(false);
+}
+
+auto vk::render_stats::register_thread() -> thread_counters* {
+    std::unique_lock lock{ registry_mutex };
+    current_thread_counters = registry.emplace_back(std::make_unique<thread_counters>()).get();
+    return current_thread_counters;
+}
+
+auto vk::render_stats::sum() -> frame_stats {
+    std::unique_lock lock{ registry_mutex };
+    frame_stats res;
+    for (auto& c : registry) {
+        res.draw_calls += c->draw_calls.load(std::memory_order_relaxed);
+        res.triangles += c->triangles.load(std::memory_order_relaxed);
+        res.pipeline_binds += c->pipeline_binds.load(std::memory_order_relaxed);
+        res.descriptor_binds += c->descriptor_binds.load(std::memory_order_relaxed);
+        res.vertex_binds += c->vertex_binds.load(std::memory_order_relaxed);
+        res.push_constants += c->push_constants.load(std::memory_order_relaxed);
+    }
+    return res;
+}
+
+void vk::render_stats::begin_frame(VkCommandBuffer command_buffer) {
+    query_active = false;
+    if (query_pool == VK_NULL_HANDLE) return;
+
+    /// The GPU is done with the frame that last used this slot, so its results are ready.
+    collect(pending[ctx->current_frame]);
+
+    /// Secondary command buffers can only be executed while a query is active
+    /// if they inherit it, which not every device supports.
+    if (ctx->recording_threads && !ctx->inherited_queries_supported) return;
+
+    /// Queries have to be reset outside of a render pass.
+    vkCmdResetQueryPool(command_buffer, query_pool, ctx->current_frame, 1);
+    vkCmdBeginQuery(command_buffer, query_pool, ctx->current_frame, 0);
+    query_active = true;
+}
+
+void vk::render_stats::end_frame(VkCommandBuffer command_buffer) {
+    /// All workers have finished recording by now, so the thread counters are
+    /// up to date; what they have counted this frame is the difference to the
+    /// previous frame.
+    auto now = sum();
+    frame_stats f{
+        .frame = ctx->frame_number,
+        .draw_calls = now.draw_calls - at_frame_end.draw_calls,
+        .triangles = now.triangles - at_frame_end.triangles,
+        .pipeline_binds = now.pipeline_binds - at_frame_end.pipeline_binds,
+        .descriptor_binds = now.descriptor_binds - at_frame_end.descriptor_binds,
+        .vertex_binds = now.vertex_binds - at_frame_end.vertex_binds,
+        .push_constants = now.push_constants - at_frame_end.push_constants,
+        .uploads = uploads.exchange(0, std::memory_order_relaxed),
+        .upload_bytes = upload_bytes.exchange(0, std::memory_order_relaxed),
+        .pipeline_compiles = pipeline_compiles.exchange(0, std::memory_order_relaxed),
+        .swap_chain_recreates = swap_chain_recreates.exchange(0, std::memory_order_relaxed),
+    };
+
+    at_frame_end = now;
+    recorded = f;
+
+    if (!query_active) {
+        last = f;
+        return;
+    }
+
+    vkCmdEndQuery(command_buffer, query_pool, ctx->current_frame);
+    pending[ctx->current_frame] = f;
+}
+
+void vk::render_stats::end_present() {
+    /// A swap chain recreation after presenting the frame happens after end_frame()
+    /// took its snapshot, but it's still the frame that caused it. If nothing was
+    /// recorded this frame, e.g. because acquiring failed, leave it to the next one.
+    if (recorded.frame != ctx->frame_number) return;
+    auto n = swap_chain_recreates.exchange(0, std::memory_order_relaxed);
+    if (n == 0) return;
+    recorded.swap_chain_recreates += n;
+    if (auto& p = pending; !p.empty() && p[ctx->current_frame] && p[ctx->current_frame]->frame == recorded.frame) p[ctx->current_frame]->swap_chain_recreates += n;
+    else if (last.frame == recorded.frame) last.swap_chain_recreates += n;
+}
+
+void vk::render_stats::collect(std::optional<frame_stats>& f) {
+    if (!f) return;
+    defer { f.reset(); };
+
+    /// One value per statistic, in the order of the bits in query_flags.
+    u64 data[5]{};
+    auto res = vkGetQueryPoolResults(ctx->device, query_pool, ctx->current_frame, 1, sizeof data, data, sizeof data, VK_QUERY_RESULT_64_BIT);
+    if (res == VK_SUCCESS) {
+        f->has_pipeline_statistics = true;
+        f->input_assembly_primitives = data[0];
+        f->vertex_invocations = data[1];
+        f->clipping_invocations = data[2];
+        f->clipping_primitives = data[3];
+        f->fragment_invocations = data[4];
+    } else if (res != VK_NOT_READY) {
+        assert_success(res, "failed to get pipeline statistics query results");
+    }
+
+    /// Don't go back in time if a later frame was published without a query.
+    if (f->frame >= last.frame) last = *f;
+}
+
+void vk::render_stats::set_pipeline_statistics(bool enable) {
+    /// The caller is responsible for making sure no frames in flight use the pool.
+    if (query_pool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(ctx->device, query_pool, nullptr);
+        query_pool = VK_NULL_HANDLE;
+        pending.clear();
+    }
+
+    if (!enable) return;
+    VkQueryPoolCreateInfo pool_info{};
+    pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_info.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+    pool_info.queryCount = MAX_FRAMES_IN_FLIGHT;
+    pool_info.pipelineStatistics = query_flags;
+    assert_success(vkCreateQueryPool(ctx->device, &pool_info, nullptr, &query_pool), "failed to create pipeline statistics query pool");
+    pending.resize(MAX_FRAMES_IN_FLIGHT);
+}
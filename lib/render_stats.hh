@@ -0,0 +1,153 @@
+#ifndef VULKAN_TEMPLATE_RENDER_STATS_HH
+#define VULKAN_TEMPLATE_RENDER_STATS_HH
+#include "utils.hh"
+
+#include <atomic>
+#include <optional>
+#include <vector>
+
+namespace vk {
+struct context;
+
+/// Work done in a single frame.
+struct frame_stats {
+    /// The frame these statistics belong to.
+    u64 frame = 0;
+
+    /// Commands recorded through the renderers.
+    u64 draw_calls = 0;
+    u64 triangles = 0;
+    u64 pipeline_binds = 0;
+    u64 descriptor_binds = 0;
+    u64 vertex_binds = 0;
+    u64 push_constants = 0;
+
+    /// Data written to GPU buffers and images: staging copies, uniform
+    /// updates, and the immediate-mode batch.
+    u64 uploads = 0;
+    u64 upload_bytes = 0;
+
+    /// Expensive events that tend to cause hitches.
+    u64 pipeline_compiles = 0;
+    u64 swap_chain_recreates = 0;
+
+    /// Pipeline statistics as counted by the GPU. These are only valid if
+    /// `has_pipeline_statistics` is set.
+    bool has_pipeline_statistics = false;
+    u64 input_assembly_primitives = 0;
+    u64 vertex_invocations = 0;
+    u64 clipping_invocations = 0;
+    u64 clipping_primitives = 0;
+    u64 fragment_invocations = 0;
+};
+
+/// Counts the work that the renderers record every frame.
+///
+/// Several threads may record at once (see record_parallel()), so the counters
+/// of recorded commands are kept per thread; only the owning thread writes to
+/// them, so counting a command never touches a shared cache line. They are
+/// summed up at the end of every frame. Uploads and the other rare events use
+/// shared atomics, which are reset at the end of every frame. Anything counted
+/// between two frames, e.g. uploads while loading a model, is thus attributed
+/// to the next frame.
+///
+/// If pipeline statistics are enabled, every frame slot also gets a pipeline
+/// statistics query that covers the entire frame. Its results are read once
+/// the slot is reused, so the statistics of a frame are only complete a few
+/// frames later; until then, latest() returns the previous complete frame.
+struct render_stats {
+    /// The statistics we query.
+    static constexpr VkQueryPipelineStatisticFlags query_flags = VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT
+                                                               | VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT
+                                                               | VK_QUERY_PIPELINE_STATISTIC_CLIPPING_INVOCATIONS_BIT
+                                                               | VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT
+                                                               | VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+
+    /// Counters of recorded commands of a single thread. These only ever go
+    /// up, and only the owning thread writes to them.
+    struct alignas(64) thread_counters {
+        std::atomic<u64> draw_calls = 0;
+        std::atomic<u64> triangles = 0;
+        std::atomic<u64> pipeline_binds = 0;
+        std::atomic<u64> descriptor_binds = 0;
+        std::atomic<u64> vertex_binds = 0;
+        std::atomic<u64> push_constants = 0;
+    };
+
+    /// Counters of the current thread; null until the thread counts its first command.
+    static thread_local thread_counters* current_thread_counters;
+
+    context* ctx;
+
+    /// Sum of all thread counters at the end of the previous frame.
+    frame_stats at_frame_end;
+
+    /// Counters of rare events in the frame that is currently being recorded.
+    std::atomic<u64> uploads = 0;
+    std::atomic<u64> upload_bytes = 0;
+    std::atomic<u64> pipeline_compiles = 0;
+    std::atomic<u64> swap_chain_recreates = 0;
+
+    /// Pipeline statistics queries, one per frame slot. Null if disabled.
+    VkQueryPool query_pool = VK_NULL_HANDLE;
+
+    /// Whether the current frame has a pipeline statistics query active.
+    bool query_active = false;
+
+    /// Frames waiting for the results of their query. Indexed by frame.
+    std::vector<std::optional<frame_stats>> pending;
+
+    /// The most recent frame whose statistics are complete.
+    frame_stats last;
+
+    /// The counters of the most recently recorded frame, without pipeline statistics.
+    frame_stats recorded;
+
+    explicit render_stats(context* ctx);
+    ~render_stats();
+
+    nocopy(render_stats);
+    nomove(render_stats);
+
+    /// Count a draw call.
+    void draw(u64 index_count) {
+        auto& c = counters();
+        add(c.draw_calls, 1);
+        add(c.triangles, index_count / 3);
+    }
+
+    /// Count a bind or push constant write.
+    void pipeline_bind() { add(counters().pipeline_binds, 1); }
+    void descriptor_bind() { add(counters().descriptor_binds, 1); }
+    void vertex_bind() { add(counters().vertex_binds, 1); }
+    void push_constant_write() { add(counters().push_constants, 1); }
+
+    /// Count an upload of `bytes` bytes.
+    void upload(u64 bytes) {
+        uploads.fetch_add(1, std::memory_order_relaxed);
+        upload_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    /// Count a pipeline compilation or swap chain recreation.
+    void pipeline_compile() { pipeline_compiles.fetch_add(1, std::memory_order_relaxed); }
+    void swap_chain_recreate() { swap_chain_recreates.fetch_add(1, std::memory_order_relaxed); }
+
+    /// Get the statistics of the most recent frame that is complete.
+    auto latest() const -> const frame_stats& { return last; }
+
+    /// INTERNAL:
+    void end_present();
+    static auto register_thread() -> thread_counters*;
+    static auto sum() -> frame_stats;
+    static auto counters() -> thread_counters& { return current_thread_counters ? *current_thread_counters : *register_thread(); }
+    static void add(std::atomic<u64>& counter, u64 n) { counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+
+    void begin_frame(VkCommandBuffer command_buffer);
+    void end_frame(VkCommandBuffer command_buffer);
+    void collect(std::optional<frame_stats>& f);
+    void set_pipeline_statistics(bool enable);
+};
+
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_RENDER_STATS_HH
@@ -2,7 +2,8 @@
 
 #include "context.hh"
 
-#define DESCRIPTOR_POOL_MAX_SIZE 1000
+#include <cstring>
+#include <glm/gtc/constants.hpp>
 
 #ifdef ENABLE_VALIDATION_LAYERS
 #    define CHECK_MOVE_PIPELINE(other)                                                 \
@@ -18,13 +19,19 @@
 #define MOVE_PIPELINE(other)                                              \
     do {                                                                  \
         CHECK_MOVE_PIPELINE(other);                                       \
-        descriptor_pool = other.descriptor_pool;                          \
         descriptor_set_layout = other.descriptor_set_layout;              \
-        graphics_pipeline = other.graphics_pipeline;                      \
+        graphics_pipeline = other.graphics_pipeline.load();               \
         pipeline_layout = other.pipeline_layout;                          \
+        pending_pipeline = std::move(other.pending_pipeline);             \
+        builder = other.builder;                                          \
+        variants = std::move(other.variants);                             \
         uniform_buffers = std::move(other.uniform_buffers);               \
         uniform_buffers_memory = std::move(other.uniform_buffers_memory); \
+        push_constant_size = other.push_constant_size;                    \
+        shared_set_layouts = std::move(other.shared_set_layouts);         \
+        kind = other.kind;                                                \
         other.graphics_pipeline = VK_NULL_HANDLE;                         \
+        other.pipeline_layout = VK_NULL_HANDLE;                           \
     } while (0)
 
 #define DEFAULT_CTORS(renderer)                                                       \
@@ -40,11 +47,13 @@
 /// ======================================================================
 ///  Pipeline
 /// ======================================================================
-vk::pipeline::pipeline(PIPELINE_CTOR_ARGS, const std::vector<VkDescriptorSetLayoutBinding>& descriptor_set_layout_bindings) : ctx(ctx) {
+vk::pipeline::pipeline(PIPELINE_CTOR_ARGS, const std::vector<VkDescriptorSetLayoutBinding>& descriptor_set_layout_bindings,
+    u32 push_constant_size, std::vector<VkDescriptorSetLayout> shared_set_layouts)
+    : ctx(ctx), push_constant_size(push_constant_size), shared_set_layouts(std::move(shared_set_layouts)) {
     create_descriptor_set_layout(descriptor_set_layout_bindings);
     create_uniform_buffers();
-    create_descriptor_pool(descriptor_set_layout_bindings);
-    create_graphics_pipeline(vert_path, frag_path);
+    create_pipeline_layout();
+    create_graphics_pipeline(vert_path, frag_path, builder);
 }
 
 vk::pipeline::pipeline(pipeline&& other) noexcept : ctx(other.ctx) {
@@ -57,43 +66,60 @@ vk::pipeline& vk::pipeline::operator=(pipeline&& other) noexcept {
 }
 
 vk::pipeline::~pipeline() {
-    if (graphics_pipeline != VK_NULL_HANDLE) {
-        vkDestroyPipeline(ctx->device, graphics_pipeline, nullptr);
-        vkDestroyPipelineLayout(ctx->device, pipeline_layout, nullptr);
+    if (pipeline_layout != VK_NULL_HANDLE) {
+        if (ctx->capture) ctx->capture->forget(this);
+        variants.reset();
+
+        /// If the builder hasn't gotten around to building the pipeline yet, it
+        /// still needs the layout; let it destroy both once it's done.
+        auto p = graphics_pipeline.load();
+        bool building = p == VK_NULL_HANDLE
+                     && pending_pipeline.valid()
+                     && pending_pipeline.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+
+        if (building) builder->abandon(pending_pipeline, pipeline_layout);
+        else {
+            vkDestroyPipeline(ctx->device, p != VK_NULL_HANDLE ? p : pending_pipeline.get(), nullptr);
+            vkDestroyPipelineLayout(ctx->device, pipeline_layout, nullptr);
+        }
 
         for (u64 i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
             vkDestroyBuffer(ctx->device, uniform_buffers[i], nullptr);
             vkFreeMemory(ctx->device, uniform_buffers_memory[i], nullptr);
         }
 
-        vkDestroyDescriptorPool(ctx->device, descriptor_pool, nullptr);
+        ctx->descriptors->forget_layout(descriptor_set_layout);
         vkDestroyDescriptorSetLayout(ctx->device, descriptor_set_layout, nullptr);
 
         graphics_pipeline = VK_NULL_HANDLE;
+        pipeline_layout = VK_NULL_HANDLE;
+        pending_pipeline = {};
     }
 }
 
 void vk::pipeline::allocate_descriptor_sets(std::vector<VkDescriptorSet>& descriptor_sets) {
-    std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, descriptor_set_layout);
-    VkDescriptorSetAllocateInfo alloc_info{};
-    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    alloc_info.descriptorPool = descriptor_pool;
-    alloc_info.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
-    alloc_info.pSetLayouts = layouts.data();
+    descriptor_sets.resize(MAX_FRAMES_IN_FLIGHT);
+    for (auto& set : descriptor_sets) set = ctx->descriptors->allocate(descriptor_set_layout);
+}
 
+void vk::pipeline::create_uniform_descriptor_sets(std::vector<VkDescriptorSet>& descriptor_sets) {
     descriptor_sets.resize(MAX_FRAMES_IN_FLIGHT);
-    assert_success(vkAllocateDescriptorSets(ctx->device, &alloc_info, descriptor_sets.data()), "failed to allocate descriptor sets");
+    for (u64 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        descriptor_write ubo{ .binding = 0, .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER };
+        ubo.buffer.buffer = uniform_buffers[i];
+        ubo.buffer.offset = 0;
+        ubo.buffer.range = sizeof(uniform_buffer_object);
+        descriptor_sets[i] = ctx->descriptors->allocate(descriptor_set_layout, { &ubo, 1 });
+    }
 }
 
 void vk::pipeline::update_uniform_buffers(const std::function<void(uniform_buffer_object&)>& update_func) {
     uniform_buffer_object* ubo;
     vkMapMemory(ctx->device, uniform_buffers_memory[ctx->current_frame], 0, sizeof *ubo, 0, (void**)&ubo);
     update_func(*ubo);
+    if (ctx->capture) ctx->capture->uniforms(this, *ubo);
     vkUnmapMemory(ctx->device, uniform_buffers_memory[ctx->current_frame]);
-}
-
-bool vk::pipeline::bound() const {
-    return ctx->bound_pipeline == graphics_pipeline;
+    ctx->stats.upload(sizeof *ubo);
 }
 
 void vk::pipeline::create_descriptor_set_layout(const std::vector<VkDescriptorSetLayoutBinding>& descriptor_set_layout_bindings) {
@@ -115,243 +141,161 @@ void vk::pipeline::create_uniform_buffers() {
     }
 }
 
-void vk::pipeline::create_descriptor_pool(const std::vector<VkDescriptorSetLayoutBinding>& descriptor_set_layout_bindings) {
-    std::vector<VkDescriptorPoolSize> pool_sizes{ descriptor_set_layout_bindings.size() };
-    for (u64 i = 0; i < descriptor_set_layout_bindings.size(); ++i) {
-        pool_sizes[i].type = descriptor_set_layout_bindings[i].descriptorType;
-        pool_sizes[i].descriptorCount = DESCRIPTOR_POOL_MAX_SIZE;
-    }
-
-    VkDescriptorPoolCreateInfo pool_info{};
-    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    pool_info.poolSizeCount = u32(pool_sizes.size());
-    pool_info.pPoolSizes = pool_sizes.data();
-    pool_info.maxSets = DESCRIPTOR_POOL_MAX_SIZE * u32(pool_sizes.size());
-    assert_success(vkCreateDescriptorPool(ctx->device, &pool_info, nullptr, &descriptor_pool), "failed to create descriptor pool");
-}
-
-void vk::pipeline::create_graphics_pipeline(std::string_view vert_path, std::string_view frag_path) {
-    /// Create the shader modules.
-    auto vert_shader_module = create_shader_module(map_file(vert_path));
-    auto frag_shader_module = create_shader_module(map_file(frag_path));
-    defer {
-        vkDestroyShaderModule(ctx->device, vert_shader_module, nullptr);
-        vkDestroyShaderModule(ctx->device, frag_shader_module, nullptr);
-    };
-
-    /// Assign the shaders to their corresponding stages.
-    VkPipelineShaderStageCreateInfo vert_shader_stage_info{};
-    vert_shader_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vert_shader_stage_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vert_shader_stage_info.module = vert_shader_module;
-    vert_shader_stage_info.pName = "main";
-
-    VkPipelineShaderStageCreateInfo frag_shader_stage_info{};
-    frag_shader_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    frag_shader_stage_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    frag_shader_stage_info.module = frag_shader_module;
-    frag_shader_stage_info.pName = "main";
-
-    /// Store them for later.
-    VkPipelineShaderStageCreateInfo shader_stages[] = { vert_shader_stage_info, frag_shader_stage_info };
-
-    /// Dynamic state.
-    std::vector<VkDynamicState> dynamic_states = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
-    VkPipelineDynamicStateCreateInfo dynamic_state_info{};
-    dynamic_state_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-    dynamic_state_info.dynamicStateCount = u32(dynamic_states.size());
-    dynamic_state_info.pDynamicStates = dynamic_states.data();
-
-    /// Vertex input.
-    auto binding_description = vertex::binding_description();
-    auto attribute_descriptions = vertex::attribute_descriptions();
-
-    VkPipelineVertexInputStateCreateInfo vertex_input_info{};
-    vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertex_input_info.vertexBindingDescriptionCount = 1;
-    vertex_input_info.pVertexBindingDescriptions = &binding_description;
-    vertex_input_info.vertexAttributeDescriptionCount = u32(attribute_descriptions.size());
-    vertex_input_info.pVertexAttributeDescriptions = attribute_descriptions.data();
-
-    /// Input assembly.
-    VkPipelineInputAssemblyStateCreateInfo input_assembly_info{};
-    input_assembly_info.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    input_assembly_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    input_assembly_info.primitiveRestartEnable = VK_FALSE;
-
-    VkPipelineViewportStateCreateInfo viewport_state_info{};
-    viewport_state_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewport_state_info.viewportCount = 1;
-    viewport_state_info.scissorCount = 1;
-
-    /// Rasteriser.
-    VkPipelineRasterizationStateCreateInfo rasteriser_info{};
-    rasteriser_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasteriser_info.depthClampEnable = VK_FALSE;
-    rasteriser_info.rasterizerDiscardEnable = VK_FALSE;
-    rasteriser_info.polygonMode = VK_POLYGON_MODE_FILL;
-    rasteriser_info.lineWidth = 1.0f;
-    rasteriser_info.cullMode = VK_CULL_MODE_BACK_BIT;
-    rasteriser_info.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-    rasteriser_info.depthBiasEnable = VK_FALSE;
-
-    /// Multisampling.
-    VkPipelineMultisampleStateCreateInfo multisampling_info{};
-    multisampling_info.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling_info.sampleShadingEnable = VK_TRUE;
-    multisampling_info.rasterizationSamples = ctx->msaa_samples;
-    multisampling_info.minSampleShading = .2f;
-
-    /// Colour blending.
-    VkPipelineColorBlendAttachmentState colour_blend_attachment{};
-    colour_blend_attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT
-                                             | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    colour_blend_attachment.blendEnable = VK_FALSE;
-
-    VkPipelineColorBlendStateCreateInfo colour_blend_info{};
-    colour_blend_info.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    colour_blend_info.logicOpEnable = VK_FALSE;
-    colour_blend_info.logicOp = VK_LOGIC_OP_COPY;
-    colour_blend_info.attachmentCount = 1;
-    colour_blend_info.pAttachments = &colour_blend_attachment;
-
-    /// Depth stencil.
-    VkPipelineDepthStencilStateCreateInfo depth_stencil_info{};
-    depth_stencil_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depth_stencil_info.depthTestEnable = VK_TRUE;
-    depth_stencil_info.depthWriteEnable = VK_TRUE;
-    depth_stencil_info.depthCompareOp = VK_COMPARE_OP_LESS; /// Lower depth = closer.
-    depth_stencil_info.depthBoundsTestEnable = VK_FALSE;
-    depth_stencil_info.stencilTestEnable = VK_FALSE;
-
+void vk::pipeline::create_pipeline_layout() {
     /// Push constants.
     VkPushConstantRange push_constant_range{};
     push_constant_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
     push_constant_range.offset = 0;
-    push_constant_range.size = sizeof(push_constant);
+    push_constant_range.size = push_constant_size;
 
     /// Pipeline layout.
+    std::vector<VkDescriptorSetLayout> set_layouts = { descriptor_set_layout };
+    set_layouts.insert(set_layouts.end(), shared_set_layouts.begin(), shared_set_layouts.end());
+
     VkPipelineLayoutCreateInfo pipeline_layout_info{};
     pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipeline_layout_info.setLayoutCount = 1;
-    pipeline_layout_info.pSetLayouts = &descriptor_set_layout;
+    pipeline_layout_info.setLayoutCount = u32(set_layouts.size());
+    pipeline_layout_info.pSetLayouts = set_layouts.data();
     pipeline_layout_info.pushConstantRangeCount = 1;
     pipeline_layout_info.pPushConstantRanges = &push_constant_range;
     assert_success(vkCreatePipelineLayout(ctx->device, &pipeline_layout_info, nullptr, &pipeline_layout), "failed to create pipeline layout");
+}
+
+void vk::pipeline::create_graphics_pipeline(std::string_view vert_path, std::string_view frag_path, pipeline_builder* builder) {
+    pipeline_description desc{
+        .vert_path = std::string{ vert_path },
+        .frag_path = std::string{ frag_path },
+        .layout = pipeline_layout,
+        .flags = VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT,
+    };
 
-    /// Finally, create the pipeline.
-    VkGraphicsPipelineCreateInfo pipeline_info{};
-    pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipeline_info.stageCount = u32(sizeof shader_stages / sizeof *shader_stages);
-    pipeline_info.pStages = shader_stages;
-    pipeline_info.pVertexInputState = &vertex_input_info;
-    pipeline_info.pInputAssemblyState = &input_assembly_info;
-    pipeline_info.pViewportState = &viewport_state_info;
-    pipeline_info.pRasterizationState = &rasteriser_info;
-    pipeline_info.pMultisampleState = &multisampling_info;
-    pipeline_info.pDepthStencilState = &depth_stencil_info;
-    pipeline_info.pColorBlendState = &colour_blend_info;
-    pipeline_info.pDynamicState = &dynamic_state_info;
-    pipeline_info.layout = pipeline_layout;
-    pipeline_info.renderPass = ctx->render_pass;
-    pipeline_info.subpass = 0;
-    pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
-    pipeline_info.basePipelineIndex = -1;
-    assert_success(vkCreateGraphicsPipelines(ctx->device, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &graphics_pipeline),
-        "failed to create graphics pipeline");
-}
-
-auto vk::pipeline::create_shader_module(const std::vector<char>& code) -> VkShaderModule {
-    VkShaderModuleCreateInfo create_info{};
-    create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    create_info.codeSize = code.size();
-    create_info.pCode = reinterpret_cast<const u32*>(code.data());
-
-    VkShaderModule shader_module;
-    assert_success(vkCreateShaderModule(ctx->device, &create_info, nullptr, &shader_module), "failed to create shader module");
-    return shader_module;
+    variants = std::make_unique<pipeline_library>(ctx, desc);
+
+    if (builder) {
+        this->builder = builder;
+        pending_pipeline = builder->add(std::move(desc));
+    } else {
+        graphics_pipeline = build_graphics_pipeline(ctx, desc);
+    }
+}
+
+auto vk::pipeline::handle() -> VkPipeline {
+    if (auto p = graphics_pipeline.load(std::memory_order_acquire); p != VK_NULL_HANDLE) return p;
+
+    /// The pipeline was queued, but nobody has built it yet, e.g. because we're
+    /// drawing before build() was called; build it now rather than waiting for
+    /// a promise that nothing would ever fulfil. If it's being built already,
+    /// this does nothing and we wait for it below.
+    if (pending_pipeline.wait_for(std::chrono::seconds(0)) != std::future_status::ready) builder->build();
+
+    /// Several recording threads may get here at the same time, but they
+    /// all store the same handle.
+    auto p = pending_pipeline.get();
+    graphics_pipeline.store(p, std::memory_order_release);
+    return p;
+}
+
+auto vk::pipeline::variant(const pipeline_state* state) -> VkPipeline {
+    /// The default state is the base pipeline itself; don't build a copy of it.
+    if (!state || *state == variants->description.state) return handle();
+    return variants->get(*state, handle());
+}
+
+bool vk::pipeline::bind(VkCommandBuffer command_buffer, VkPipeline p) {
+    if (ctx->bound_pipeline == p) return false;
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, p);
+    ctx->bound_pipeline = p;
+    ctx->stats.pipeline_bind();
+    return true;
 }
 
 /// ======================================================================
 ///  Texture renderer
 /// ======================================================================
 vk::texture_renderer::texture_renderer(PIPELINE_CTOR_ARGS)
-    : pipeline(PIPELINE_CTOR_PARAMS, [] -> std::vector<VkDescriptorSetLayoutBinding> {
+    : pipeline(PIPELINE_CTOR_PARAMS, [ctx] -> std::vector<VkDescriptorSetLayoutBinding> {
           VkDescriptorSetLayoutBinding ubo_layout_binding{};
           ubo_layout_binding.binding = 0;
           ubo_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
           ubo_layout_binding.descriptorCount = 1; /// Dimension.
           ubo_layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
+          /// The texture table replaces the per-model sampler.
+          if (ctx->textures) return { ubo_layout_binding };
+
           VkDescriptorSetLayoutBinding sampler_layout_binding{};
           sampler_layout_binding.binding = 1;
           sampler_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
           sampler_layout_binding.descriptorCount = 1; /// Dimension.
           sampler_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
           return { ubo_layout_binding, sampler_layout_binding };
-      }()) {
+      }(),
+          ctx->textures ? u32(sizeof(bindless_push_constant)) : u32(sizeof(push_constant)),
+          ctx->textures ? std::vector{ ctx->textures->descriptor_set_layout } : std::vector<VkDescriptorSetLayout>{}),
+      bindless(ctx->textures != nullptr) {
+    kind = renderer_kind::texture;
     create_texture_sampler();
+    if (bindless) create_uniform_descriptor_sets(descriptor_sets);
 }
 
 vk::texture_renderer::texture_renderer(texture_renderer&& other) noexcept : pipeline(std::move(other)) {
     texture_sampler = other.texture_sampler;
+    bindless = other.bindless;
+    descriptor_sets = std::move(other.descriptor_sets);
+    projection_frame = other.projection_frame.load();
 }
 
 auto vk::texture_renderer::operator=(texture_renderer&& other) noexcept -> texture_renderer& {
     MOVE_PIPELINE(other);
 
     texture_sampler = other.texture_sampler;
+    bindless = other.bindless;
+    descriptor_sets = std::move(other.descriptor_sets);
+    projection_frame = other.projection_frame.load();
     return *this;
 }
 
 vk::texture_renderer::~texture_renderer() {
-    if (graphics_pipeline != VK_NULL_HANDLE) vkDestroySampler(ctx->device, texture_sampler, nullptr);
+    if (pipeline_layout != VK_NULL_HANDLE) vkDestroySampler(ctx->device, texture_sampler, nullptr);
 }
 
-/// FIXME: Multiple models doesn't work atm
 void vk::texture_renderer::create_descriptor_sets(std::vector<VkDescriptorSet>& descriptor_sets, VkImageView view) {
-    allocate_descriptor_sets(descriptor_sets);
-
+    descriptor_sets.resize(MAX_FRAMES_IN_FLIGHT);
     for (u64 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-        VkDescriptorBufferInfo buffer_info{};
-        buffer_info.buffer = uniform_buffers[i];
-        buffer_info.offset = 0;
-        buffer_info.range = sizeof(uniform_buffer_object);
-
-        VkDescriptorImageInfo image_info{};
-        image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        image_info.imageView = view;
-        image_info.sampler = texture_sampler;
-
-        VkWriteDescriptorSet descriptor_writes[2]{};
-        descriptor_writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptor_writes[0].dstSet = descriptor_sets[i];
-        descriptor_writes[0].dstBinding = 0;
-        descriptor_writes[0].dstArrayElement = 0;
-        descriptor_writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        descriptor_writes[0].descriptorCount = 1;
-        descriptor_writes[0].pBufferInfo = &buffer_info;
-
-        descriptor_writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptor_writes[1].dstSet = descriptor_sets[i];
-        descriptor_writes[1].dstBinding = 1;
-        descriptor_writes[1].dstArrayElement = 0;
-        descriptor_writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        descriptor_writes[1].descriptorCount = 1;
-        descriptor_writes[1].pImageInfo = &image_info;
-
-        vkUpdateDescriptorSets(ctx->device, sizeof descriptor_writes / sizeof *descriptor_writes, descriptor_writes, 0, nullptr);
+        descriptor_write writes[2]{};
+        writes[0].binding = 0;
+        writes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        writes[0].buffer.buffer = uniform_buffers[i];
+        writes[0].buffer.offset = 0;
+        writes[0].buffer.range = sizeof(uniform_buffer_object);
+
+        writes[1].binding = 1;
+        writes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        writes[1].image.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        writes[1].image.imageView = view;
+        writes[1].image.sampler = texture_sampler;
+
+        descriptor_sets[i] = ctx->descriptors->allocate(descriptor_set_layout, writes);
     }
 }
 
-void vk::texture_renderer::draw(VkCommandBuffer command_buffer, const vk::model_instance& ti) {
-    if (!bound()) {
-        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_pipeline);
-        ctx->bound_pipeline = graphics_pipeline;
+void vk::texture_renderer::draw(VkCommandBuffer command_buffer, const vk::model_instance& ti, const pipeline_state* state) {
+    if (ctx->capture) ctx->capture->draw(this, ti, state);
+    if (bind(command_buffer, variant(state))) {
+        /// Bindless renderers only need to bind their descriptor sets once.
+        if (bindless) {
+            VkDescriptorSet sets[] = { descriptor_sets[ctx->current_frame], ctx->textures->descriptor_set };
+            vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 2, sets, 0, nullptr);
+            ctx->stats.descriptor_bind();
+        }
+    }
 
-        /// The texture renderer assumes that the viewport is a 1x1 square.
-        /// If this aspect ratio is not 1x1, then the texture will be stretched.
-        /// To fix this, scale whichever dimension is greater proportionally to the other.
+    /// The texture renderer assumes that the viewport is a 1x1 square.
+    /// If this aspect ratio is not 1x1, then the texture will be stretched.
+    /// To fix this, scale whichever dimension is greater proportionally to the other.
+    ///
+    /// This only needs to happen once per frame, no matter how many threads are drawing.
+    if (projection_frame.exchange(ctx->frame_number) != ctx->frame_number) {
         update_uniform_buffers([&](uniform_buffer_object& ubo) {
             f32 ht = f32(ctx->swap_chain_extent.height), wd = f32(ctx->swap_chain_extent.width), scale_x, scale_y;
             if (wd > ht) {
@@ -367,9 +311,17 @@ void vk::texture_renderer::draw(VkCommandBuffer command_buffer, const vk::model_
     }
 
     ti.m->verts.bind(command_buffer);
-    vkCmdPushConstants(command_buffer, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof ti.constant, &ti.constant);
-    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &ti.m->descriptor_sets[ctx->current_frame], 0, nullptr);
+    if (bindless) {
+        bindless_push_constant constant{ .transform = ti.constant.transform, .texture_index = ti.m->texture_index };
+        vkCmdPushConstants(command_buffer, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof constant, &constant);
+    } else {
+        vkCmdPushConstants(command_buffer, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof ti.constant, &ti.constant);
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &ti.m->descriptor_sets[ctx->current_frame], 0, nullptr);
+        ctx->stats.descriptor_bind();
+    }
     vkCmdDrawIndexed(command_buffer, u32(ti.m->verts.index_count), 1, 0, 0, 0);
+    ctx->stats.push_constant_write();
+    ctx->stats.draw(ti.m->verts.index_count);
 }
 
 void vk::texture_renderer::create_texture_sampler() {
@@ -399,8 +351,6 @@ void vk::texture_renderer::create_texture_sampler() {
 /// ======================================================================
 ///  Geometric renderer
 /// ======================================================================
-DEFAULT_CTORS(geometric_renderer)
-
 vk::geometric_renderer::geometric_renderer(PIPELINE_CTOR_ARGS)
     : pipeline(PIPELINE_CTOR_PARAMS, [] -> std::vector<VkDescriptorSetLayoutBinding> {
           VkDescriptorSetLayoutBinding ubo_layout_binding{};
@@ -410,24 +360,39 @@ vk::geometric_renderer::geometric_renderer(PIPELINE_CTOR_ARGS)
           ubo_layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
           return { ubo_layout_binding };
       }()) {
-    allocate_descriptor_sets(descriptor_sets);
+    kind = renderer_kind::geometric;
+    create_uniform_descriptor_sets(descriptor_sets);
+    batch_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+}
 
-    for (u64 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-        VkDescriptorBufferInfo buffer_info{};
-        buffer_info.buffer = uniform_buffers[i];
-        buffer_info.offset = 0;
-        buffer_info.range = sizeof(uniform_buffer_object);
-
-        VkWriteDescriptorSet descriptor_write{};
-        descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptor_write.dstSet = descriptor_sets[i];
-        descriptor_write.dstBinding = 0;
-        descriptor_write.dstArrayElement = 0;
-        descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        descriptor_write.descriptorCount = 1;
-        descriptor_write.pBufferInfo = &buffer_info;
-
-        vkUpdateDescriptorSets(ctx->device, 1, &descriptor_write, 0, nullptr);
+vk::geometric_renderer::geometric_renderer(geometric_renderer&& other) noexcept : pipeline(std::move(other)) {
+    descriptor_sets = std::move(other.descriptor_sets);
+    batch_buffers = std::move(other.batch_buffers);
+    batch_frame = other.batch_frame;
+    batch_vertex_count = other.batch_vertex_count;
+    batch_index_count = other.batch_index_count;
+    batch_flushed_vertex = other.batch_flushed_vertex;
+    batch_flushed_index = other.batch_flushed_index;
+}
+
+auto vk::geometric_renderer::operator=(geometric_renderer&& other) noexcept -> geometric_renderer& {
+    MOVE_PIPELINE(other);
+
+    descriptor_sets = std::move(other.descriptor_sets);
+    batch_buffers = std::move(other.batch_buffers);
+    batch_frame = other.batch_frame;
+    batch_vertex_count = other.batch_vertex_count;
+    batch_index_count = other.batch_index_count;
+    batch_flushed_vertex = other.batch_flushed_vertex;
+    batch_flushed_index = other.batch_flushed_index;
+    return *this;
+}
+
+vk::geometric_renderer::~geometric_renderer() {
+    if (pipeline_layout == VK_NULL_HANDLE) return;
+    for (auto& b : batch_buffers) {
+        vkDestroyBuffer(ctx->device, b.buffer, nullptr);
+        vkFreeMemory(ctx->device, b.memory, nullptr);
     }
 }
 
@@ -435,16 +400,173 @@ auto vk::geometric_renderer::build_geometry() -> geometry_builder {
     return geometry_builder{ this };
 }
 
-void vk::geometric_renderer::draw(VkCommandBuffer command_buffer, const vk::geometry& g) {
-    if (!bound()) {
-        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_pipeline);
-        ctx->bound_pipeline = graphics_pipeline;
-    }
+void vk::geometric_renderer::draw(VkCommandBuffer command_buffer, const vk::geometry& g, const pipeline_state* state) {
+    if (ctx->capture) ctx->capture->draw(this, g, state);
+    bind(command_buffer, variant(state));
 
     g.verts.bind(command_buffer);
     vkCmdPushConstants(command_buffer, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof g.constant, &g.constant);
     vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &descriptor_sets[ctx->current_frame], 0, nullptr);
     vkCmdDrawIndexed(command_buffer, u32(g.verts.index_count), 1, 0, 0, 0);
+    ctx->stats.push_constant_write();
+    ctx->stats.descriptor_bind();
+    ctx->stats.draw(g.verts.index_count);
+}
+
+/// ======================================================================
+///  Immediate-mode batch
+/// ======================================================================
+void vk::geometric_renderer::rect(glm::vec2 a, glm::vec2 b, glm::vec3 colour) {
+    push_quad(a, { a.x, b.y }, b, { b.x, a.y }, colour);
+}
+
+void vk::geometric_renderer::line(glm::vec2 a, glm::vec2 b, f32 thickness, glm::vec3 colour) {
+    auto dir = b - a;
+    if (dir == glm::vec2{}) return;
+
+    auto n = glm::normalize(glm::vec2{ -dir.y, dir.x }) * (thickness / 2);
+    push_quad(a + n, a - n, b - n, b + n, colour);
+}
+
+void vk::geometric_renderer::circle(glm::vec2 centre, f32 radius, glm::vec3 colour, u32 segments) {
+    segments = std::max(segments, 3u);
+    auto& b = reserve_batch(segments + 1, segments * 3);
+    u32 first = batch_vertex_count;
+
+    /// Go around clockwise (with y pointing up) so the triangles face the same
+    /// way as those of make_rectangle().
+    push_vertex(b, centre, colour);
+    for (u32 i = 0; i < segments; i++) {
+        f32 angle = -2.f * glm::pi<f32>() * f32(i) / f32(segments);
+        push_vertex(b, centre + radius * glm::vec2{ std::cos(angle), std::sin(angle) }, colour);
+    }
+
+    auto* indices = reinterpret_cast<u32*>(static_cast<vertex*>(b.mapped) + b.vertex_capacity);
+    for (u32 i = 0; i < segments; i++) {
+        indices[batch_index_count++] = first;
+        indices[batch_index_count++] = first + 1 + i;
+        indices[batch_index_count++] = first + 1 + (i + 1) % segments;
+    }
+}
+
+void vk::geometric_renderer::triangle(glm::vec2 a, glm::vec2 b, glm::vec2 c, glm::vec3 colour) {
+    /// Fix the winding order so the triangle isn't culled.
+    auto ab = b - a, ac = c - a;
+    if (ab.x * ac.y - ab.y * ac.x > 0) std::swap(b, c);
+
+    auto& buf = reserve_batch(3, 3);
+    u32 first = batch_vertex_count;
+    push_vertex(buf, a, colour);
+    push_vertex(buf, b, colour);
+    push_vertex(buf, c, colour);
+
+    auto* indices = reinterpret_cast<u32*>(static_cast<vertex*>(buf.mapped) + buf.vertex_capacity);
+    for (u32 i = 0; i < 3; i++) indices[batch_index_count++] = first + i;
+}
+
+void vk::geometric_renderer::append(std::span<const vertex> vertices, std::span<const u32> indices) {
+    auto& b = reserve_batch(u32(vertices.size()), u32(indices.size()));
+    u32 first = batch_vertex_count;
+    std::memcpy(static_cast<vertex*>(b.mapped) + batch_vertex_count, vertices.data(), vertices.size_bytes());
+    batch_vertex_count += u32(vertices.size());
+
+    auto* out = reinterpret_cast<u32*>(static_cast<vertex*>(b.mapped) + b.vertex_capacity);
+    for (u32 i : indices) out[batch_index_count++] = first + i;
+}
+
+void vk::geometric_renderer::flush(VkCommandBuffer command_buffer, const push_constant& constant, const pipeline_state* state) {
+    begin_batch();
+    if (batch_index_count == batch_flushed_index) return;
+    if (ctx->capture) ctx->capture->batch(this, constant, state);
+
+    auto& b = batch_buffers[ctx->current_frame];
+    VkDeviceSize offset = 0;
+    bind(command_buffer, variant(state));
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &b.buffer, &offset);
+    vkCmdBindIndexBuffer(command_buffer, b.buffer, VkDeviceSize(b.vertex_capacity) * sizeof(vertex), VK_INDEX_TYPE_UINT32);
+    vkCmdPushConstants(command_buffer, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof constant, &constant);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &descriptor_sets[ctx->current_frame], 0, nullptr);
+    vkCmdDrawIndexed(command_buffer, batch_index_count - batch_flushed_index, 1, batch_flushed_index, 0, 0);
+
+    /// The batch is written straight to mapped memory, so count that as an upload.
+    ctx->stats.upload((batch_vertex_count - batch_flushed_vertex) * sizeof(vertex) + (batch_index_count - batch_flushed_index) * sizeof(u32));
+    ctx->stats.vertex_bind();
+    ctx->stats.push_constant_write();
+    ctx->stats.descriptor_bind();
+    ctx->stats.draw(batch_index_count - batch_flushed_index);
+    batch_flushed_vertex = batch_vertex_count;
+    batch_flushed_index = batch_index_count;
+}
+
+void vk::geometric_renderer::begin_batch() {
+    /// The GPU is done with this frame's buffer by the time the frame is recorded.
+    if (batch_frame == ctx->frame_number) return;
+    batch_frame = ctx->frame_number;
+    batch_vertex_count = 0;
+    batch_index_count = 0;
+    batch_flushed_vertex = 0;
+    batch_flushed_index = 0;
+}
+
+auto vk::geometric_renderer::reserve_batch(u32 vertex_count, u32 index_count) -> batch_buffer& {
+    begin_batch();
+    auto& b = batch_buffers[ctx->current_frame];
+    if (batch_vertex_count + vertex_count <= b.vertex_capacity && batch_index_count + index_count <= b.index_capacity) return b;
+
+    /// Grow the buffer. The old one may already be used by draws in this frame.
+    batch_buffer grown;
+    grown.vertex_capacity = std::max({ 1024u, b.vertex_capacity * 2, batch_vertex_count + vertex_count });
+    grown.index_capacity = std::max({ 1536u, b.index_capacity * 2, batch_index_count + index_count });
+    ctx->create_buffer(
+        VkDeviceSize(grown.vertex_capacity) * sizeof(vertex) + VkDeviceSize(grown.index_capacity) * sizeof(u32),
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        grown.buffer,
+        grown.memory
+    );
+    assert_success(vkMapMemory(ctx->device, grown.memory, 0, VK_WHOLE_SIZE, 0, &grown.mapped), "failed to map batch buffer");
+
+    if (b.buffer != VK_NULL_HANDLE) {
+        std::memcpy(grown.mapped, b.mapped, batch_vertex_count * sizeof(vertex));
+        std::memcpy(
+            static_cast<vertex*>(grown.mapped) + grown.vertex_capacity,
+            static_cast<vertex*>(b.mapped) + b.vertex_capacity,
+            batch_index_count * sizeof(u32)
+        );
+
+        ctx->defer_delete([device = ctx->device, buffer = b.buffer, memory = b.memory] {
+            vkDestroyBuffer(device, buffer, nullptr);
+            vkFreeMemory(device, memory, nullptr);
+        });
+    }
+
+    b = grown;
+    return b;
+}
+
+void vk::geometric_renderer::push_quad(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2, glm::vec2 p3, glm::vec3 colour) {
+    /// Same winding order as make_rectangle().
+    auto e1 = p1 - p0, e2 = p2 - p0;
+    if (e1.x * e2.y - e1.y * e2.x > 0) std::swap(p1, p3);
+
+    auto& b = reserve_batch(4, 6);
+    u32 first = batch_vertex_count;
+    push_vertex(b, p0, colour);
+    push_vertex(b, p1, colour);
+    push_vertex(b, p2, colour);
+    push_vertex(b, p3, colour);
+
+    auto* indices = reinterpret_cast<u32*>(static_cast<vertex*>(b.mapped) + b.vertex_capacity);
+    for (u32 i : QUAD_VERTICES) indices[batch_index_count++] = first + i;
+}
+
+void vk::geometric_renderer::push_vertex(batch_buffer& b, glm::vec2 pos, glm::vec3 colour) {
+    static_cast<vertex*>(b.mapped)[batch_vertex_count++] = {
+        .pos = glm::vec3(pos, 0.f),
+        .colour = colour,
+        .normal = {},
+        .tex_coord = {},
+    };
 }
 
 /// ======================================================================
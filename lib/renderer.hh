@@ -1,23 +1,35 @@
 #ifndef VULKAN_TEMPLATE_RENDERER_HH
 #define VULKAN_TEMPLATE_RENDERER_HH
 #include "model.hh"
+#include "pipeline_builder.hh"
+#include "pipeline_library.hh"
 #include "utils.hh"
 
+#include <atomic>
+#include <future>
+#include <memory>
+#include <span>
 #include <vector>
 
-#define PIPELINE_CTOR_ARGS   context *ctx, std::string_view vert_path, std::string_view frag_path
-#define PIPELINE_CTOR_PARAMS ctx, vert_path, frag_path
-#define RENDERER_CTORS(renderer)                    \
-    renderer(PIPELINE_CTOR_ARGS);                   \
-    nocopy(renderer);                               \
-    renderer(renderer&& other) noexcept;            \
-    renderer& operator=(renderer&& other) noexcept; \
+#define PIPELINE_CTOR_ARGS   context *ctx, std::string_view vert_path, std::string_view frag_path, pipeline_builder *builder
+#define PIPELINE_CTOR_PARAMS ctx, vert_path, frag_path, builder
+#define RENDERER_CTORS(renderer)                                                                                         \
+    renderer(context* ctx, std::string_view vert_path, std::string_view frag_path, pipeline_builder* builder = nullptr); \
+    nocopy(renderer);                                                                                                    \
+    renderer(renderer&& other) noexcept;                                                                                 \
+    renderer& operator=(renderer&& other) noexcept;                                                                      \
     ~renderer();
 
 namespace vk {
 
 struct context;
 
+/// What a pipeline is the base of; see command_capture.
+enum struct renderer_kind : u8 {
+    texture,
+    geometric,
+};
+
 /// Data that can be used by a geometric renderer.
 struct geometry {
     push_constant constant;
@@ -30,52 +42,93 @@ struct geometry {
 struct pipeline {
     context* ctx;
 
-    /// Descriptors.
-    VkDescriptorPool descriptor_pool;
+    /// Descriptors. The sets themselves come from the context's descriptor allocator.
     VkDescriptorSetLayout descriptor_set_layout;
 
-    /// Pipeline.
-    VkPipeline graphics_pipeline;
-    VkPipelineLayout pipeline_layout;
+    /// Pipeline. If the pipeline was queued on a pipeline builder, graphics_pipeline
+    /// is null until the first call to handle(), which waits for the builder. This
+    /// may happen on several recording threads at once, hence the atomic.
+    std::atomic<VkPipeline> graphics_pipeline = VK_NULL_HANDLE;
+    VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+    std::shared_future<VkPipeline> pending_pipeline;
+    pipeline_builder* builder = nullptr;
+
+    /// Variants of this pipeline with different state, derived from graphics_pipeline.
+    std::unique_ptr<pipeline_library> variants;
 
     /// Uniforms.
     std::vector<VkBuffer> uniform_buffers;
     std::vector<VkDeviceMemory> uniform_buffers_memory;
 
-    pipeline(PIPELINE_CTOR_ARGS, const std::vector<VkDescriptorSetLayoutBinding>& descriptor_set_layout_bindings);
+    /// Size of the push constants, and layouts of sets shared with other pipelines
+    /// (e.g. the texture table); the latter are bound after the pipeline's own set.
+    u32 push_constant_size;
+    std::vector<VkDescriptorSetLayout> shared_set_layouts;
+
+    /// Set by the renderer that this is the base of.
+    renderer_kind kind = renderer_kind::texture;
+
+    pipeline(PIPELINE_CTOR_ARGS, const std::vector<VkDescriptorSetLayoutBinding>& descriptor_set_layout_bindings,
+        u32 push_constant_size = sizeof(push_constant), std::vector<VkDescriptorSetLayout> shared_set_layouts = {});
     nocopy(pipeline);
     pipeline(pipeline&& other) noexcept;
     pipeline& operator=(pipeline&& other) noexcept;
     ~pipeline();
 
-    /// Check if this pipeline is currently bound to the context.
-    bool bound() const;
+    /// Get the pipeline handle, waiting for it to be built if need be.
+    auto handle() -> VkPipeline;
+
+    /// Get the pipeline for a state. Null, or a state equal to the default
+    /// state, returns the base pipeline.
+    auto variant(const pipeline_state* state) -> VkPipeline;
+
+    /// Bind a pipeline unless it is already bound. Returns whether it was bound.
+    bool bind(VkCommandBuffer command_buffer, VkPipeline p);
 
     /// Allocate the descriptor sets for initialisation by the renderer.
     void allocate_descriptor_sets(std::vector<VkDescriptorSet>& descriptor_sets);
 
+    /// Allocate descriptor sets that only contain the uniform buffer for each frame.
+    void create_uniform_descriptor_sets(std::vector<VkDescriptorSet>& descriptor_sets);
+
     /// Update the uniform buffers.
     void update_uniform_buffers(const std::function<void(uniform_buffer_object&)>& update_func);
 
     /// INTERNAL:
     void create_descriptor_set_layout(const std::vector<VkDescriptorSetLayoutBinding>& descriptor_set_layout_bindings);
     void create_uniform_buffers();
-    void create_descriptor_pool(const std::vector<VkDescriptorSetLayoutBinding>& descriptor_set_layout_bindings);
-    void create_graphics_pipeline(std::string_view vert_path, std::string_view frag_path);
-    auto create_shader_module(const std::vector<char>& code) -> VkShaderModule;
+    void create_pipeline_layout();
+    void create_graphics_pipeline(std::string_view vert_path, std::string_view frag_path, pipeline_builder* builder);
 };
 
 /// Renderer for models that have both vertices and textures.
+///
+/// If bindless textures are enabled on the context when the renderer is created,
+/// models are drawn by index into the context's texture table, and the only
+/// descriptor sets are the renderer's own per-frame uniform sets.
 struct texture_renderer : pipeline {
     /// Textures.
     VkSampler texture_sampler;
 
+    /// Whether this renderer uses the context's texture table.
+    bool bindless;
+
+    /// Uniform descriptor sets; only used if this renderer is bindless.
+    std::vector<VkDescriptorSet> descriptor_sets;
+
+    /// The frame for which the projection was last updated. Atomic since
+    /// draw() may be called from several recording threads at once.
+    std::atomic<u64> projection_frame = u64(-1);
+
     RENDERER_CTORS(texture_renderer);
 
-    /// Draw a model.
-    void draw(VkCommandBuffer command_buffer, const model_instance& ti);
+    /// Draw a model, optionally with a variant of this renderer's pipeline.
+    void draw(VkCommandBuffer command_buffer, const model_instance& ti, const pipeline_state* state = nullptr);
 
-    /// Create the descriptor sets for a model.
+    /// Create the descriptor sets for a model, one per frame slot. Every model
+    /// gets sets of its own from the context's descriptor allocator, even if
+    /// it uses the same texture as another; they go back to the allocator
+    /// when the model is destroyed.
     void create_descriptor_sets(std::vector<VkDescriptorSet>& descriptor_sets, VkImageView view);
 
     /// INTERNAL:
@@ -83,7 +136,25 @@ struct texture_renderer : pipeline {
 };
 
 /// Renderer for models consisting entirely of vertices with colours and no texture.
+///
+/// Besides drawing prebuilt geometries, this can also draw shapes in immediate
+/// mode: rect(), line(), circle() and triangle() append to a batch that is written
+/// straight into a persistently mapped buffer for the current frame, and flush()
+/// draws everything appended since the last flush with a single draw call. Once
+/// the buffers have grown large enough, this neither allocates nor copies.
+///
+/// The batch is not thread-safe; only use it from the main recording thread.
 struct geometric_renderer : pipeline {
+    /// Vertex and index storage of the batch for one frame. The indices
+    /// are stored right after `vertex_capacity` vertices.
+    struct batch_buffer {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        void* mapped = nullptr;
+        u32 vertex_capacity = 0;
+        u32 index_capacity = 0;
+    };
+
     /// Helper struct to build a geometry.
     struct geometry_builder {
         geometric_renderer* r;
@@ -111,13 +182,47 @@ struct geometric_renderer : pipeline {
     /// Descriptor sets.
     std::vector<VkDescriptorSet> descriptor_sets;
 
+    /// Immediate-mode batch. Indexed by frame.
+    std::vector<batch_buffer> batch_buffers;
+    u64 batch_frame = u64(-1);
+    u32 batch_vertex_count = 0;
+    u32 batch_index_count = 0;
+    u32 batch_flushed_vertex = 0;
+    u32 batch_flushed_index = 0;
+
     RENDERER_CTORS(geometric_renderer);
 
     /// Return a builder for a geometry.
     auto build_geometry() -> geometry_builder;
 
-    /// Draw a model.
-    void draw(VkCommandBuffer command_buffer, const geometry& m);
+    /// Draw a model, optionally with a variant of this renderer's pipeline.
+    void draw(VkCommandBuffer command_buffer, const geometry& m, const pipeline_state* state = nullptr);
+
+    /// Append a filled rect between a and b to the batch.
+    void rect(glm::vec2 a, glm::vec2 b, glm::vec3 colour = { 1.f, 1.f, 1.f });
+
+    /// Append a line from a to b to the batch.
+    void line(glm::vec2 a, glm::vec2 b, f32 thickness, glm::vec3 colour = { 1.f, 1.f, 1.f });
+
+    /// Append a filled circle to the batch.
+    void circle(glm::vec2 centre, f32 radius, glm::vec3 colour = { 1.f, 1.f, 1.f }, u32 segments = 32);
+
+    /// Append a filled triangle to the batch.
+    void triangle(glm::vec2 a, glm::vec2 b, glm::vec2 c, glm::vec3 colour = { 1.f, 1.f, 1.f });
+
+    /// Append vertices and indices to the batch. Indices are relative to the
+    /// first vertex in `vertices`.
+    void append(std::span<const vertex> vertices, std::span<const u32> indices);
+
+    /// Draw everything that was appended to the batch since the last flush. Call
+    /// this at least once at the end of every frame that uses the batch.
+    void flush(VkCommandBuffer command_buffer, const push_constant& constant = {}, const pipeline_state* state = nullptr);
+
+    /// INTERNAL:
+    void begin_batch();
+    auto reserve_batch(u32 vertex_count, u32 index_count) -> batch_buffer&;
+    void push_quad(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2, glm::vec2 p3, glm::vec3 colour);
+    void push_vertex(batch_buffer& b, glm::vec2 pos, glm::vec3 colour);
 };
 
 } // namespace vk
@@ -0,0 +1,43 @@
+#include "startup_timeline.hh"
+
+#include <algorithm>
+
+namespace {
+auto to_ms(vk::startup_timeline::clock::duration d) -> f64 {
+    return std::chrono::duration<f64, std::milli>(d).count();
+}
+} // namespace
+
+void vk::startup_timeline::record(std::string name, clock::time_point begin, clock::time_point end) {
+    std::unique_lock lock{ mutex };
+    if (finished()) return;
+    phases.push_back({ .name = std::move(name), .start_ms = to_ms(begin - start), .duration_ms = to_ms(end - begin) });
+}
+
+void vk::startup_timeline::finish() {
+    {
+        std::unique_lock lock{ mutex };
+        if (finished()) return;
+        first_frame_ms = to_ms(clock::now() - start);
+    }
+
+    if (print_report) info("{}", report());
+}
+
+auto vk::startup_timeline::report() const -> std::string {
+    std::unique_lock lock{ mutex };
+    auto sorted = phases;
+    std::stable_sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) { return a.start_ms < b.start_ms; });
+
+    u64 width = 5;
+    for (const auto& p : sorted) width = std::max(width, p.name.size());
+
+    std::string out = first_frame_ms
+                        ? fmt::format("[Vulkan] Startup: first frame after {:.1f} ms\n", *first_frame_ms)
+                        : std::string{ "[Vulkan] Startup: no frame yet\n" };
+
+    out += fmt::format("  {:<{}}  {:>10}  {:>10}\n", "Phase", width, "Start", "Duration");
+    for (const auto& p : sorted) out += fmt::format("  {:<{}}  {:>7.1f} ms  {:>7.1f} ms\n", p.name, width, p.start_ms, p.duration_ms);
+    if (!out.empty()) out.pop_back();
+    return out;
+}
@@ -0,0 +1,81 @@
+#ifndef VULKAN_TEMPLATE_STARTUP_TIMELINE_HH
+#define VULKAN_TEMPLATE_STARTUP_TIMELINE_HH
+#include "utils.hh"
+
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace vk {
+/// A phase of startup. Times are in milliseconds, relative to the start of
+/// context construction.
+struct startup_phase {
+    std::string name;
+    f64 start_ms;
+    f64 duration_ms;
+};
+
+/// Records how long each phase of startup takes, from the construction of
+/// the context up to the first frame that is presented (or submitted, if
+/// the context is headless).
+///
+/// The context times its own setup phases; assets that are loaded before the
+/// first frame, e.g. models and pipelines, are recorded as well. Phases may be
+/// recorded from any thread, so they can overlap. Once the first frame is out,
+/// nothing is recorded anymore.
+struct startup_timeline {
+    using clock = std::chrono::steady_clock;
+
+    /// When the context started being constructed.
+    clock::time_point start = clock::now();
+
+    /// Recorded phases, in the order in which they ended.
+    std::vector<startup_phase> phases;
+    mutable std::mutex mutex;
+
+    /// Time from the start to the first frame; empty until then.
+    std::optional<f64> first_frame_ms;
+
+    /// Print the report once the first frame is out.
+    bool print_report = false;
+
+    /// Whether the first frame is out.
+    bool finished() const { return first_frame_ms.has_value(); }
+
+    /// Record a phase that ran from `begin` to `end`.
+    void record(std::string name, clock::time_point begin, clock::time_point end);
+
+    /// Run `fn` and record it as a phase.
+    template <typename callable>
+    void time(std::string name, callable&& fn) {
+        auto begin = clock::now();
+        std::forward<callable>(fn)();
+        record(std::move(name), begin, clock::now());
+    }
+
+    /// Get a human-readable table of all phases.
+    auto report() const -> std::string;
+
+    /// INTERNAL:
+    void finish();
+};
+
+/// Records a startup phase from its construction to its destruction.
+struct startup_scope {
+    startup_timeline& timeline;
+    std::string name;
+    startup_timeline::clock::time_point begin = startup_timeline::clock::now();
+
+    startup_scope(startup_timeline& timeline, std::string name) : timeline(timeline), name(std::move(name)) {}
+    ~startup_scope() { timeline.record(std::move(name), begin, startup_timeline::clock::now()); }
+
+    nocopy(startup_scope);
+    nomove(startup_scope);
+};
+
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_STARTUP_TIMELINE_HH
@@ -0,0 +1,110 @@
+#include "texture_table.hh"
+
+#include "context.hh"
+
+vk::texture_table::texture_table(context* ctx, u32 requested_capacity) : ctx(ctx) {
+    /// Make sure we don't exceed what the device supports.
+    VkPhysicalDeviceDescriptorIndexingProperties indexing_props{};
+    indexing_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES;
+
+    VkPhysicalDeviceProperties2 props{};
+    props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props.pNext = &indexing_props;
+    vkGetPhysicalDeviceProperties2(ctx->physical_device, &props);
+
+    /// Every combined image sampler counts against both the sampler and the
+    /// sampled image limits.
+    capacity = std::min({
+        requested_capacity,
+        props.properties.limits.maxPerStageDescriptorSamplers,
+        props.properties.limits.maxDescriptorSetSamplers,
+        indexing_props.maxPerStageDescriptorUpdateAfterBindSamplers,
+        indexing_props.maxDescriptorSetUpdateAfterBindSamplers,
+        indexing_props.maxPerStageDescriptorUpdateAfterBindSampledImages,
+        indexing_props.maxDescriptorSetUpdateAfterBindSampledImages,
+    });
+
+    /// The table is a single, partially bound binding.
+    VkDescriptorSetLayoutBinding binding{};
+    binding.binding = 0;
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    binding.descriptorCount = capacity;
+    binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    VkDescriptorBindingFlags binding_flags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT;
+    VkDescriptorSetLayoutBindingFlagsCreateInfo binding_flags_info{};
+    binding_flags_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+    binding_flags_info.bindingCount = 1;
+    binding_flags_info.pBindingFlags = &binding_flags;
+
+    VkDescriptorSetLayoutCreateInfo layout_info{};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.pNext = &binding_flags_info;
+    layout_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+    layout_info.bindingCount = 1;
+    layout_info.pBindings = &binding;
+    assert_success(vkCreateDescriptorSetLayout(ctx->device, &layout_info, nullptr, &descriptor_set_layout), "failed to create texture table layout");
+
+    /// Pool for the one and only set.
+    VkDescriptorPoolSize pool_size{};
+    pool_size.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    pool_size.descriptorCount = capacity;
+
+    VkDescriptorPoolCreateInfo pool_info{};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    pool_info.maxSets = 1;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+    assert_success(vkCreateDescriptorPool(ctx->device, &pool_info, nullptr, &descriptor_pool), "failed to create texture table pool");
+
+    VkDescriptorSetAllocateInfo alloc_info{};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = descriptor_pool;
+    alloc_info.descriptorSetCount = 1;
+    alloc_info.pSetLayouts = &descriptor_set_layout;
+    assert_success(vkAllocateDescriptorSets(ctx->device, &alloc_info, &descriptor_set), "failed to allocate texture table");
+}
+
+vk::texture_table::~texture_table() {
+    vkDestroyDescriptorPool(ctx->device, descriptor_pool, nullptr);
+    vkDestroyDescriptorSetLayout(ctx->device, descriptor_set_layout, nullptr);
+}
+
+auto vk::texture_table::add(VkImageView view, VkSampler sampler) -> u32 {
+    std::unique_lock lock{ mutex };
+    u32 index;
+    if (!free_indices.empty()) {
+        index = free_indices.back();
+        free_indices.pop_back();
+    } else {
+        if (next_index == capacity) die("[Vulkan] Texture table is full ({} textures)", capacity);
+        index = next_index++;
+    }
+
+    VkDescriptorImageInfo image_info{};
+    image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    image_info.imageView = view;
+    image_info.sampler = sampler;
+
+    VkWriteDescriptorSet descriptor_write{};
+    descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptor_write.dstSet = descriptor_set;
+    descriptor_write.dstBinding = 0;
+    descriptor_write.dstArrayElement = index;
+    descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    descriptor_write.descriptorCount = 1;
+    descriptor_write.pImageInfo = &image_info;
+    vkUpdateDescriptorSets(ctx->device, 1, &descriptor_write, 0, nullptr);
+
+    return index;
+}
+
+void vk::texture_table::remove(u32 index) {
+    /// Frames that are still in flight may sample from this slot, so we
+    /// can only hand it out again once they're done.
+    ctx->defer_delete([this, index] {
+        std::unique_lock lock{ mutex };
+        free_indices.push_back(index);
+    });
+}
@@ -0,0 +1,53 @@
+#ifndef VULKAN_TEMPLATE_TEXTURE_TABLE_HH
+#define VULKAN_TEMPLATE_TEXTURE_TABLE_HH
+#include "utils.hh"
+
+#include <mutex>
+#include <vector>
+
+namespace vk {
+struct context;
+
+/// Global descriptor set containing a large array of textures that shaders
+/// index into with a push constant, so that drawing a model does not require
+/// binding any descriptor sets.
+///
+/// The array is partially bound, and slots can be written while a frame that
+/// uses the table is being recorded or is in flight, so long as that frame
+/// doesn't use those particular slots. This is why removed slots are only
+/// reused once every frame that might still be using them has finished.
+///
+/// Textures may be added and removed from any thread, e.g. by loader threads
+/// while the main thread flushes the deletion queue.
+struct texture_table {
+    context* ctx;
+
+    /// Descriptors.
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSetLayout descriptor_set_layout;
+    VkDescriptorSet descriptor_set;
+
+    /// Slots. Writes to the descriptor set are also made under the mutex since
+    /// it must not be updated from several threads at once.
+    u32 capacity;
+    u32 next_index = 0;
+    std::vector<u32> free_indices;
+    std::mutex mutex;
+
+    texture_table(context* ctx, u32 capacity);
+    ~texture_table();
+
+    nocopy(texture_table);
+    nomove(texture_table);
+
+    /// Add a texture to the table and return its index.
+    auto add(VkImageView view, VkSampler sampler) -> u32;
+
+    /// Release a slot. The slot is reused once all frames that are currently
+    /// in flight have finished.
+    void remove(u32 index);
+};
+
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_TEXTURE_TABLE_HH
@@ -0,0 +1,44 @@
+#include "thread_pool.hh"
+
+vk::thread_pool::thread_pool(u32 thread_count) {
+    if (thread_count == 0) thread_count = 1;
+    workers.reserve(thread_count);
+    for (u32 i = 0; i < thread_count; i++) workers.emplace_back([this] { worker_main(); });
+}
+
+vk::thread_pool::~thread_pool() {
+    {
+        std::unique_lock lock{ tasks_mutex };
+        stopping = true;
+    }
+
+    tasks_cond.notify_all();
+    for (auto& w : workers) w.join();
+}
+
+void vk::thread_pool::push(task t) {
+    {
+        std::unique_lock lock{ tasks_mutex };
+        tasks.push_back(std::move(t));
+    }
+
+    tasks_cond.notify_one();
+}
+
+void vk::thread_pool::worker_main() {
+    for (;;) {
+        task t;
+
+        {
+            std::unique_lock lock{ tasks_mutex };
+            tasks_cond.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+            /// Drain the queue before exiting.
+            if (tasks.empty()) return;
+            t = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        t();
+    }
+}
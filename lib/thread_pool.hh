@@ -0,0 +1,59 @@
+#ifndef VULKAN_TEMPLATE_THREAD_POOL_HH
+#define VULKAN_TEMPLATE_THREAD_POOL_HH
+#include "utils.hh"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace vk {
+
+/// A fixed-size pool of worker threads.
+struct thread_pool {
+    using task = std::function<void()>;
+
+    /// Workers.
+    std::vector<std::thread> workers;
+
+    /// Pending tasks.
+    std::deque<task> tasks;
+    std::mutex tasks_mutex;
+    std::condition_variable tasks_cond;
+    bool stopping = false;
+
+    /// Create a pool with `thread_count` workers.
+    explicit thread_pool(u32 thread_count);
+
+    /// Finish all pending tasks and join the workers.
+    ~thread_pool();
+
+    nocopy(thread_pool);
+    nomove(thread_pool);
+
+    /// Get the number of workers.
+    u32 size() const { return u32(workers.size()); }
+
+    /// Run a function on one of the workers.
+    template <typename callable>
+    auto submit(callable&& func) -> std::future<std::invoke_result_t<callable>> {
+        using result = std::invoke_result_t<callable>;
+
+        /// std::function requires a copyable callable, so the task has to live on the heap.
+        auto packaged = std::make_shared<std::packaged_task<result()>>(std::forward<callable>(func));
+        auto fut = packaged->get_future();
+        push([packaged] { (*packaged)(); });
+        return fut;
+    }
+
+    /// INTERNAL:
+    void push(task t);
+    void worker_main();
+};
+
+} // namespace vk
+
+#endif // VULKAN_TEMPLATE_THREAD_POOL_HH
@@ -41,6 +41,56 @@ std::vector<char> map_file(std::string_view filename) {
     return bytes;
 }
 
+std::string json_escape(std::string_view s) {
+    std::string out;
+    out.reserve(s.size());
+    for (char c : s) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                /// Other control characters have no short escape.
+                if (u8(c) < 0x20) out += fmt::format("\\u{:04x}", u32(u8(c)));
+                else out += c;
+        }
+    }
+    return out;
+}
+
+bool write_file_atomic(std::string_view filename, const void* data, size_t size) {
+    auto tmp = fmt::format("{}.{}.tmp", filename, ::getpid());
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) [[unlikely]]
+        return false;
+
+    /// Write everything, then make sure it's on disk before we rename.
+    auto* ptr = static_cast<const char*>(data);
+    while (size) {
+        auto written = ::write(fd, ptr, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            ::close(fd);
+            ::unlink(tmp.c_str());
+            return false;
+        }
+
+        ptr += written;
+        size -= size_t(written);
+    }
+
+    bool synced = ::fsync(fd) == 0;
+    bool closed = ::close(fd) == 0;
+    if (!synced || !closed || ::rename(tmp.c_str(), std::string{ filename }.c_str())) [[unlikely]] {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
 std::string current_stacktrace() {
     void* buffer[15];
     auto nptrs = backtrace(buffer, 15);
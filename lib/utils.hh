@@ -3,17 +3,25 @@
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #include "utils_base.hh"
+#include "vk_calls.hh"
 
 #include <vulkan/vulkan_core.h>
 
 template <typename... args_t>
 inline void assert_success(VkResult res, fmt::format_string<args_t...> fmt_str = "", args_t&&... args) {
     if (res != VK_SUCCESS) {
-        fmt::print(stderr, "[Vulkan] ");
-        fmt::print(stderr, fmt_str, std::forward<args_t>(args)...);
-        fmt::print(stderr, "\n");
-        std::exit(1);
+        fmt::memory_buffer buf;
+        fmt::format_to(std::back_inserter(buf), "[Vulkan] ");
+        fmt::format_to(std::back_inserter(buf), fmt_str, std::forward<args_t>(args)...);
+        vk::logger::fatal({ buf.data(), buf.size() });
     }
 }
 
+namespace vk {
+/// Mix a value into a hash.
+inline void hash_combine(size_t& seed, size_t value) {
+    seed ^= value + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2);
+}
+} // namespace vk
+
 #endif
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include <cstdint>
 #include <fmt/format.h>
+#include <iterator>
+#include <string_view>
 #include <vector>
 
 #define CAT_(X, Y) X##Y
@@ -86,32 +88,72 @@ std::string current_time();
 /// Get the current stacktrace.
 std::string current_stacktrace();
 
+/// Logging. Messages are formatted on the calling thread and written out by
+/// a background thread; see lib/logger.hh for the details and the settings.
+namespace vk {
+enum struct log_level : u8 {
+    debug,
+    info,
+    warning,
+    error,
+    fatal,
+};
+} // namespace vk
+
+namespace vk::logger {
+/// Whether messages of a level are written at all.
+bool enabled(log_level level);
+
+/// Buffer of the current thread that messages are formatted into.
+auto scratch() -> fmt::memory_buffer&;
+
+/// Queue a message. `site` identifies where it comes from for rate limiting,
+/// e.g. the address of its format string.
+void write(log_level level, u64 site, std::string_view message);
+
+/// Write out everything that is queued, then the message, and exit.
+[[noreturn]] void fatal(std::string_view message);
+
+/// Write out everything that has been logged so far. This may be called from any thread.
+void flush();
+
+template <typename... args_t>
+void log(log_level level, fmt::format_string<args_t...> fmt_str, args_t&&... args) {
+    if (!enabled(level)) return;
+    auto& buf = scratch();
+    buf.clear();
+    fmt::format_to(std::back_inserter(buf), fmt_str, std::forward<args_t>(args)...);
+#ifdef ENABLE_VALIDATION_LAYERS
+    if (level >= log_level::error) fmt::format_to(std::back_inserter(buf), "\n{}", current_stacktrace());
+#endif
+    write(level, u64(reinterpret_cast<uintptr_t>(fmt_str.get().data())), { buf.data(), buf.size() });
+}
+} // namespace vk::logger
+
 template <typename... args_t>
 inline void info(fmt::format_string<args_t...> fmt_str, args_t&&... args) {
-    fmt::print(stderr, "\033[33m[{}] Info: ", current_time());
-    fmt::print(stderr, fmt_str, std::forward<args_t>(args)...);
-    fmt::print(stderr, "\033[m\n");
+    vk::logger::log(vk::log_level::info, fmt_str, std::forward<args_t>(args)...);
+}
+
+template <typename... args_t>
+inline void warn(fmt::format_string<args_t...> fmt_str, args_t&&... args) {
+    vk::logger::log(vk::log_level::warning, fmt_str, std::forward<args_t>(args)...);
 }
 
 template <typename... args_t>
 inline void err(fmt::format_string<args_t...> fmt_str, args_t&&... args) {
-    fmt::print(stderr, "\033[31m[{}] Error: ", current_time());
-    fmt::print(stderr, fmt_str, std::forward<args_t>(args)...);
-#ifdef ENABLE_VALIDATION_LAYERS
-    fmt::print(stderr, "\n{}", current_stacktrace());
-#endif
-    fmt::print(stderr, "\033[m\n");
+    vk::logger::log(vk::log_level::error, fmt_str, std::forward<args_t>(args)...);
 }
 
 template <typename... args_t>
 [[noreturn]] inline void die(fmt::format_string<args_t...> fmt_str, args_t&&... args) {
-    fmt::print(stderr, "\033[1;31m[{}] Fatal: ", current_time());
-    fmt::print(stderr, fmt_str, std::forward<args_t>(args)...);
+    /// Don't use the scratch buffer; we might be dying while formatting into it.
+    fmt::memory_buffer buf;
+    fmt::format_to(std::back_inserter(buf), fmt_str, std::forward<args_t>(args)...);
 #ifdef ENABLE_VALIDATION_LAYERS
-    fmt::print(stderr, "\n{}", current_stacktrace());
+    fmt::format_to(std::back_inserter(buf), "\n{}", current_stacktrace());
 #endif
-    fmt::print(stderr, "\033[m\n");
-    std::exit(1);
+    vk::logger::fatal({ buf.data(), buf.size() });
 }
 
 template <typename callable_t>
@@ -135,6 +177,9 @@ struct defer_type_operator_lhs {
 template <typename... args_t>
 [[noreturn]] void assertion_error(const std::string& cond_mess, const char* file, int line, const char* pretty_function,
     fmt::format_string<args_t...> fmt_str = "", args_t&&... args) {
+    /// Don't lose whatever led up to this; it's still queued in the logger.
+    vk::logger::flush();
+
     /// The extra \033[m may seem superfluous, but having them as extra delimiters
     /// makes translating the colour codes into html tags easier.
     if (isatty(STDERR_FILENO)) {
@@ -175,4 +220,12 @@ consteval const char* this_file_name(const char* fname = __builtin_FILE()) {
 
 std::vector<char> map_file(std::string_view filename);
 
+/// Write a file atomically: the data is written to a temporary file which
+/// then replaces the target, so readers never see a partially written file.
+/// Returns false and leaves the target untouched on error.
+bool write_file_atomic(std::string_view filename, const void* data, size_t size);
+
+/// Escape a string for use inside a JSON string literal.
+std::string json_escape(std::string_view s);
+
 #endif // HPUTILS_UTILS_BASE_HH
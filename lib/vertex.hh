@@ -64,6 +64,12 @@ struct push_constant {
     glm::mat4 transform = glm::mat4(1.0f);
 };
 
+/// Push constant used by bindless renderers.
+struct bindless_push_constant {
+    glm::mat4 transform = glm::mat4(1.0f);
+    uint32_t texture_index = 0;
+};
+
 template <>
 struct std::hash<vertex> {
     size_t operator()(const vertex& v) const {
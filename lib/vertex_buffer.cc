@@ -22,14 +22,15 @@ vk::vertex_buffer::vertex_buffer(context* ctx, const std::vector<vertex>& vertic
         memcpy(data, vertices.data(), (u64) buffer_size);
         vkUnmapMemory(ctx->device, staging_buffer_memory);
 
-        /// Create the vertex buffer.
-        ctx->create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        /// Create the vertex buffer. Captures copy it back, so it's a transfer source too.
+        ctx->create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vk_vertbuf, vk_vertbuf_mem);
 
         /// Copy the data to the buffer and delete the staging buffer.
         ctx->copy_buffer(vk_vertbuf, staging_buffer, buffer_size);
         vkDestroyBuffer(ctx->device, staging_buffer, nullptr);
         vkFreeMemory(ctx->device, staging_buffer_memory, nullptr);
+        vertex_count = vertices.size();
     }
 
     /// Index buffer.
@@ -52,7 +53,7 @@ vk::vertex_buffer::vertex_buffer(context* ctx, const std::vector<vertex>& vertic
         vkUnmapMemory(ctx->device, staging_buffer_memory);
 
         /// Create the vertex buffer.
-        ctx->create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+        ctx->create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vk_idxbuf, vk_idxbuf_mem);
 
         /// Copy the data to the buffer and delete the staging buffer.
@@ -79,6 +80,7 @@ auto vk::vertex_buffer::operator=(vertex_buffer&& other)  noexcept -> vertex_buf
     vk_vertbuf_mem = other.vk_vertbuf_mem;
     vk_idxbuf_mem = other.vk_idxbuf_mem;
     offsets = other.offsets;
+    vertex_count = other.vertex_count;
     index_count = other.index_count;
 
     other.ctx = nullptr;
@@ -88,6 +90,7 @@ auto vk::vertex_buffer::operator=(vertex_buffer&& other)  noexcept -> vertex_buf
     other.vk_vertbuf_mem = VK_NULL_HANDLE;
     other.vk_idxbuf_mem = VK_NULL_HANDLE;
     other.offsets = 0;
+    other.vertex_count = 0;
     other.index_count = 0;
 #endif
 
@@ -96,6 +99,7 @@ auto vk::vertex_buffer::operator=(vertex_buffer&& other)  noexcept -> vertex_buf
 
 vk::vertex_buffer::~vertex_buffer() {
     if (ctx) {
+        if (ctx->capture) ctx->capture->forget(vk_vertbuf);
         vkDestroyBuffer(ctx->device, vk_idxbuf, nullptr);
         vkFreeMemory(ctx->device, vk_idxbuf_mem, nullptr);
 
@@ -107,4 +111,5 @@ vk::vertex_buffer::~vertex_buffer() {
 void vk::vertex_buffer::bind(VkCommandBuffer command_buffer) const {
     vkCmdBindVertexBuffers(command_buffer, 0, 1, &vk_vertbuf, &offsets);
     vkCmdBindIndexBuffer(command_buffer, vk_idxbuf, 0, VK_INDEX_TYPE_UINT32);
+    ctx->stats.vertex_bind();
 }
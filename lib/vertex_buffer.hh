@@ -11,16 +11,17 @@ struct context;
 struct vertex_buffer {
     context* ctx = nullptr;
 
-    VkBuffer vk_vertbuf;
-    VkBuffer vk_idxbuf;
+    VkBuffer vk_vertbuf = VK_NULL_HANDLE;
+    VkBuffer vk_idxbuf = VK_NULL_HANDLE;
 
-    VkDeviceMemory vk_vertbuf_mem;
-    VkDeviceMemory vk_idxbuf_mem;
+    VkDeviceMemory vk_vertbuf_mem = VK_NULL_HANDLE;
+    VkDeviceMemory vk_idxbuf_mem = VK_NULL_HANDLE;
 
     /// For the bind call.
     VkDeviceSize offsets = {0};
 
-    u64 index_count;
+    u64 vertex_count = 0;
+    u64 index_count = 0;
 
     vertex_buffer() {}
     vertex_buffer(context* ctx, const std::vector<vertex>& vertices, const std::vector<u32>& indices);
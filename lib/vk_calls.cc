@@ -0,0 +1,134 @@
+#include "vk_calls.hh"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <ranges>
+#include <vector>
+
+namespace {
+using namespace vk;
+using namespace vk::vk_calls;
+
+struct state {
+    /// All thread counters. These are never freed so that calls made by
+    /// threads that have exited still show up in the totals.
+    std::mutex mutex;
+    std::vector<std::unique_ptr<thread_counters>> registry;
+
+    /// Sum of all counters at the end of the previous frame and at the last reset.
+    std::array<stats, function_count> at_frame_end{};
+    std::array<stats, function_count> at_reset{};
+
+    std::array<stats, function_count> last_frame{};
+    u64 frames = 0;
+};
+
+auto get() -> state& {
+    static state s;
+    return s;
+}
+
+/// Requires the mutex to be held.
+auto sum(state& s) -> std::array<stats, function_count> {
+    std::array<stats, function_count> res{};
+    for (auto& c : s.registry) {
+        for (u64 i = 0; i < function_count; i++) {
+            res[i].calls += c->calls[i].load(std::memory_order_relaxed);
+            res[i].ns += c->ns[i].load(std::memory_order_relaxed);
+        }
+    }
+    return res;
+}
+
+auto difference(
+    const std::array<stats, function_count>& a,
+    const std::array<stats, function_count>& b
+) -> std::array<stats, function_count> {
+    std::array<stats, function_count> res{};
+    for (u64 i = 0; i < function_count; i++) res[i] = { a[i].calls - b[i].calls, a[i].ns - b[i].ns };
+    return res;
+}
+} // namespace
+
+thread_local vk::vk_calls::thread_counters* vk::vk_calls::current_thread_counters = nullptr;
+
+auto vk::vk_calls::register_thread() -> thread_counters* {
+    auto& s = get();
+    std::unique_lock lock{ s.mutex };
+    current_thread_counters = s.registry.emplace_back(std::make_unique<thread_counters>()).get();
+    return current_thread_counters;
+}
+
+void vk::vk_calls::end_frame() {
+    auto& s = get();
+    std::unique_lock lock{ s.mutex };
+    auto now = sum(s);
+    s.last_frame = difference(now, s.at_frame_end);
+    s.at_frame_end = now;
+    s.frames++;
+}
+
+auto vk::vk_calls::last_frame() -> std::array<stats, function_count> {
+    auto& s = get();
+    std::unique_lock lock{ s.mutex };
+    return s.last_frame;
+}
+
+auto vk::vk_calls::totals() -> std::array<stats, function_count> {
+    auto& s = get();
+    std::unique_lock lock{ s.mutex };
+    return difference(sum(s), s.at_reset);
+}
+
+auto vk::vk_calls::frames() -> u64 {
+    auto& s = get();
+    std::unique_lock lock{ s.mutex };
+    return s.frames;
+}
+
+void vk::vk_calls::reset() {
+    auto& s = get();
+    std::unique_lock lock{ s.mutex };
+    s.at_reset = s.at_frame_end = sum(s);
+    s.last_frame = {};
+    s.frames = 0;
+}
+
+auto vk::vk_calls::report(u64 top) -> std::string {
+    auto t = totals();
+    auto f = std::max<u64>(frames(), 1);
+
+    std::vector<u64> order(function_count);
+    std::iota(order.begin(), order.end(), u64(0));
+    std::ranges::stable_sort(order, std::greater{}, [&](u64 i) { return t[i].ns; });
+
+    std::string out = fmt::format(
+        "[Vulkan] Calls over {} frames:\n"
+        "  {:<36} {:>10} {:>10} {:>10} {:>10} {:>10}\n",
+        frames(),
+        "Function",
+        "Calls",
+        "Per frame",
+        "Total ms",
+        "ms/frame",
+        "Avg µs"
+    );
+
+    for (auto i : order | std::views::take(top)) {
+        if (t[i].calls == 0) break;
+        fmt::format_to(
+            std::back_inserter(out),
+            "  {:<36} {:>10} {:>10.1f} {:>10.3f} {:>10.4f} {:>10.2f}\n",
+            names[i],
+            t[i].calls,
+            f64(t[i].calls) / f64(f),
+            f64(t[i].ns) / 1e6,
+            f64(t[i].ns) / 1e6 / f64(f),
+            f64(t[i].ns) / 1e3 / f64(t[i].calls)
+        );
+    }
+
+    return out;
+}
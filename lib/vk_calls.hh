@@ -0,0 +1,208 @@
+#ifndef VULKAN_TEMPLATE_VK_CALLS_HH
+#define VULKAN_TEMPLATE_VK_CALLS_HH
+#include "utils_base.hh"
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <time.h>
+#include <vulkan/vulkan_core.h>
+
+/// Vulkan call tracing.
+///
+/// If ENABLE_VK_CALL_TRACING is defined, the Vulkan functions listed below are
+/// replaced with function-like macros in every file that includes utils.hh, so
+/// every call that the engine makes to them is counted and timed. Every thread
+/// has its own counters, so this takes no locks; the totals of each frame are
+/// computed when the context finishes a frame, and report() lists the calls
+/// that took the most time.
+///
+/// Otherwise, the functions are called directly and none of this costs anything.
+/// Calls made by ImGui are not traced either way.
+#define VK_CALL_TRACE_FUNCTIONS(X)       \
+    X(vkAllocateMemory)                  \
+    X(vkFreeMemory)                      \
+    X(vkCreateBuffer)                    \
+    X(vkDestroyBuffer)                   \
+    X(vkCreateImage)                     \
+    X(vkDestroyImage)                    \
+    X(vkBindBufferMemory)                \
+    X(vkBindImageMemory)                 \
+    X(vkGetBufferMemoryRequirements)     \
+    X(vkGetImageMemoryRequirements)      \
+    X(vkMapMemory)                       \
+    X(vkUnmapMemory)                     \
+    X(vkInvalidateMappedMemoryRanges)    \
+    X(vkGetPhysicalDeviceMemoryProperties) \
+    X(vkGetPhysicalDeviceProperties)     \
+    X(vkGetPhysicalDeviceFormatProperties) \
+    X(vkQueueSubmit)                     \
+    X(vkQueuePresentKHR)                 \
+    X(vkAcquireNextImageKHR)             \
+    X(vkQueueWaitIdle)                   \
+    X(vkDeviceWaitIdle)                  \
+    X(vkWaitSemaphores)                  \
+    X(vkGetSemaphoreCounterValue)        \
+    X(vkGetQueryPoolResults)             \
+    X(vkAllocateCommandBuffers)          \
+    X(vkFreeCommandBuffers)              \
+    X(vkResetCommandPool)                \
+    X(vkResetCommandBuffer)              \
+    X(vkBeginCommandBuffer)              \
+    X(vkEndCommandBuffer)                \
+    X(vkAllocateDescriptorSets)          \
+    X(vkFreeDescriptorSets)              \
+    X(vkResetDescriptorPool)             \
+    X(vkUpdateDescriptorSets)            \
+    X(vkCreateShaderModule)              \
+    X(vkCreateGraphicsPipelines)         \
+    X(vkCmdBindPipeline)                 \
+    X(vkCmdBindDescriptorSets)           \
+    X(vkCmdBindVertexBuffers)            \
+    X(vkCmdBindIndexBuffer)              \
+    X(vkCmdPushConstants)                \
+    X(vkCmdDrawIndexed)                  \
+    X(vkCmdPipelineBarrier)              \
+    X(vkCmdCopyBuffer)                   \
+    X(vkCmdCopyBufferToImage)            \
+    X(vkCmdExecuteCommands)
+
+#ifdef ENABLE_VK_CALL_TRACING
+#    define VK_TRACED_CALL(name, ...) ::vk::vk_calls::call<::vk::vk_calls::function::name>(name, __VA_ARGS__)
+#    define VK_CALL_FRAME_MARK()      ::vk::vk_calls::end_frame()
+#else
+#    define VK_CALL_FRAME_MARK() static_cast<void>(0)
+#endif
+
+namespace vk::vk_calls {
+enum struct function : u16 {
+#define X(name) name,
+    VK_CALL_TRACE_FUNCTIONS(X)
+#undef X
+        count,
+};
+
+inline constexpr u64 function_count = u64(function::count);
+
+inline constexpr std::array<std::string_view, function_count> names{
+#define X(name) #name,
+    VK_CALL_TRACE_FUNCTIONS(X)
+#undef X
+};
+
+/// Number of calls to a function and the time spent in them.
+struct stats {
+    u64 calls = 0;
+    u64 ns = 0;
+};
+
+/// Counters of a single thread. These only ever go up, and only the owning
+/// thread writes to them.
+struct thread_counters {
+    std::array<std::atomic<u64>, function_count> calls{};
+    std::array<std::atomic<u64>, function_count> ns{};
+};
+
+/// Counters of the current thread; null until the thread makes its first call.
+extern thread_local thread_counters* current_thread_counters;
+
+/// Create the counters for the current thread.
+auto register_thread() -> thread_counters*;
+
+inline auto now() -> u64 {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return u64(ts.tv_sec) * 1'000'000'000 + u64(ts.tv_nsec);
+}
+
+inline void record(function f, u64 ns) {
+    auto* c = current_thread_counters ? current_thread_counters : register_thread();
+    auto i = u64(f);
+    c->calls[i].store(c->calls[i].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    c->ns[i].store(c->ns[i].load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+}
+
+/// Call a Vulkan function and record it.
+template <function f, typename ret, typename... params, typename... args>
+inline auto call(ret (*fn)(params...), args&&... a) -> ret {
+    auto start = now();
+    if constexpr (std::is_void_v<ret>) {
+        fn(std::forward<args>(a)...);
+        record(f, now() - start);
+    } else {
+        auto res = fn(std::forward<args>(a)...);
+        record(f, now() - start);
+        return res;
+    }
+}
+
+/// Compute the totals of the frame that just ended. Use VK_CALL_FRAME_MARK() instead.
+void end_frame();
+
+/// Calls made during the last frame.
+auto last_frame() -> std::array<stats, function_count>;
+
+/// Calls made since the last reset, and the number of frames that covers.
+auto totals() -> std::array<stats, function_count>;
+auto frames() -> u64;
+
+/// Start counting from zero.
+void reset();
+
+/// Get a table of the `top` functions that took the most time in total.
+auto report(u64 top = 10) -> std::string;
+} // namespace vk::vk_calls
+
+/// The wrappers. These must come after the declarations of the functions.
+#ifdef ENABLE_VK_CALL_TRACING
+#    define vkAllocateMemory(...)                    VK_TRACED_CALL(vkAllocateMemory, __VA_ARGS__)
+#    define vkFreeMemory(...)                        VK_TRACED_CALL(vkFreeMemory, __VA_ARGS__)
+#    define vkCreateBuffer(...)                      VK_TRACED_CALL(vkCreateBuffer, __VA_ARGS__)
+#    define vkDestroyBuffer(...)                     VK_TRACED_CALL(vkDestroyBuffer, __VA_ARGS__)
+#    define vkCreateImage(...)                       VK_TRACED_CALL(vkCreateImage, __VA_ARGS__)
+#    define vkDestroyImage(...)                      VK_TRACED_CALL(vkDestroyImage, __VA_ARGS__)
+#    define vkBindBufferMemory(...)                  VK_TRACED_CALL(vkBindBufferMemory, __VA_ARGS__)
+#    define vkBindImageMemory(...)                   VK_TRACED_CALL(vkBindImageMemory, __VA_ARGS__)
+#    define vkGetBufferMemoryRequirements(...)       VK_TRACED_CALL(vkGetBufferMemoryRequirements, __VA_ARGS__)
+#    define vkGetImageMemoryRequirements(...)        VK_TRACED_CALL(vkGetImageMemoryRequirements, __VA_ARGS__)
+#    define vkMapMemory(...)                         VK_TRACED_CALL(vkMapMemory, __VA_ARGS__)
+#    define vkUnmapMemory(...)                       VK_TRACED_CALL(vkUnmapMemory, __VA_ARGS__)
+#    define vkInvalidateMappedMemoryRanges(...)      VK_TRACED_CALL(vkInvalidateMappedMemoryRanges, __VA_ARGS__)
+#    define vkGetPhysicalDeviceMemoryProperties(...) VK_TRACED_CALL(vkGetPhysicalDeviceMemoryProperties, __VA_ARGS__)
+#    define vkGetPhysicalDeviceProperties(...)       VK_TRACED_CALL(vkGetPhysicalDeviceProperties, __VA_ARGS__)
+#    define vkGetPhysicalDeviceFormatProperties(...) VK_TRACED_CALL(vkGetPhysicalDeviceFormatProperties, __VA_ARGS__)
+#    define vkQueueSubmit(...)                       VK_TRACED_CALL(vkQueueSubmit, __VA_ARGS__)
+#    define vkQueuePresentKHR(...)                   VK_TRACED_CALL(vkQueuePresentKHR, __VA_ARGS__)
+#    define vkAcquireNextImageKHR(...)               VK_TRACED_CALL(vkAcquireNextImageKHR, __VA_ARGS__)
+#    define vkQueueWaitIdle(...)                     VK_TRACED_CALL(vkQueueWaitIdle, __VA_ARGS__)
+#    define vkDeviceWaitIdle(...)                    VK_TRACED_CALL(vkDeviceWaitIdle, __VA_ARGS__)
+#    define vkWaitSemaphores(...)                    VK_TRACED_CALL(vkWaitSemaphores, __VA_ARGS__)
+#    define vkGetSemaphoreCounterValue(...)          VK_TRACED_CALL(vkGetSemaphoreCounterValue, __VA_ARGS__)
+#    define vkGetQueryPoolResults(...)               VK_TRACED_CALL(vkGetQueryPoolResults, __VA_ARGS__)
+#    define vkAllocateCommandBuffers(...)            VK_TRACED_CALL(vkAllocateCommandBuffers, __VA_ARGS__)
+#    define vkFreeCommandBuffers(...)                VK_TRACED_CALL(vkFreeCommandBuffers, __VA_ARGS__)
+#    define vkResetCommandPool(...)                  VK_TRACED_CALL(vkResetCommandPool, __VA_ARGS__)
+#    define vkResetCommandBuffer(...)                VK_TRACED_CALL(vkResetCommandBuffer, __VA_ARGS__)
+#    define vkBeginCommandBuffer(...)                VK_TRACED_CALL(vkBeginCommandBuffer, __VA_ARGS__)
+#    define vkEndCommandBuffer(...)                  VK_TRACED_CALL(vkEndCommandBuffer, __VA_ARGS__)
+#    define vkAllocateDescriptorSets(...)            VK_TRACED_CALL(vkAllocateDescriptorSets, __VA_ARGS__)
+#    define vkFreeDescriptorSets(...)                VK_TRACED_CALL(vkFreeDescriptorSets, __VA_ARGS__)
+#    define vkResetDescriptorPool(...)               VK_TRACED_CALL(vkResetDescriptorPool, __VA_ARGS__)
+#    define vkUpdateDescriptorSets(...)              VK_TRACED_CALL(vkUpdateDescriptorSets, __VA_ARGS__)
+#    define vkCreateShaderModule(...)                VK_TRACED_CALL(vkCreateShaderModule, __VA_ARGS__)
+#    define vkCreateGraphicsPipelines(...)           VK_TRACED_CALL(vkCreateGraphicsPipelines, __VA_ARGS__)
+#    define vkCmdBindPipeline(...)                   VK_TRACED_CALL(vkCmdBindPipeline, __VA_ARGS__)
+#    define vkCmdBindDescriptorSets(...)             VK_TRACED_CALL(vkCmdBindDescriptorSets, __VA_ARGS__)
+#    define vkCmdBindVertexBuffers(...)              VK_TRACED_CALL(vkCmdBindVertexBuffers, __VA_ARGS__)
+#    define vkCmdBindIndexBuffer(...)                VK_TRACED_CALL(vkCmdBindIndexBuffer, __VA_ARGS__)
+#    define vkCmdPushConstants(...)                  VK_TRACED_CALL(vkCmdPushConstants, __VA_ARGS__)
+#    define vkCmdDrawIndexed(...)                    VK_TRACED_CALL(vkCmdDrawIndexed, __VA_ARGS__)
+#    define vkCmdPipelineBarrier(...)                VK_TRACED_CALL(vkCmdPipelineBarrier, __VA_ARGS__)
+#    define vkCmdCopyBuffer(...)                     VK_TRACED_CALL(vkCmdCopyBuffer, __VA_ARGS__)
+#    define vkCmdCopyBufferToImage(...)              VK_TRACED_CALL(vkCmdCopyBufferToImage, __VA_ARGS__)
+#    define vkCmdExecuteCommands(...)                VK_TRACED_CALL(vkCmdExecuteCommands, __VA_ARGS__)
+#endif
+
+#endif // VULKAN_TEMPLATE_VK_CALLS_HH
@@ -0,0 +1,18 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+layout(location = 0) in vec3 frag_colour;
+layout(location = 1) in vec2 frag_texcoord;
+
+layout(location = 0) out vec4 out_colour;
+
+layout(set = 1, binding = 0) uniform sampler2D textures[];
+
+layout(push_constant) uniform push_constant {
+    mat4 transform;
+    uint texture_index;
+} push;
+
+void main() {
+    out_colour = texture(textures[push.texture_index], frag_texcoord);
+}
\ No newline at end of file